@@ -0,0 +1,101 @@
+/* RLTK (RogueLike Tool Kit) 1.00
+ * Copyright (c) 2016-Present, Bracket Productions.
+ * Licensed under the MIT license - see LICENSE file.
+ *
+ * Benchmark: ECS message throughput. Each case is run five times and the best time is reported, in millions
+ * of messages per second. The receiving system has two per-message handlers and a mailbox for the busy type,
+ * and 60 other message types are registered, so delivery has idle types to skip.
+ */
+
+#include "../rltk/ecs.hpp"
+#include <chrono>
+#include <cstdio>
+#include <utility>
+
+using namespace rltk;
+
+struct hit_t { int damage; int target; };
+struct tally_t { int amount; };
+template <int N> struct idle_t { int x; };
+
+constexpr int MESSAGES = 2000000;
+constexpr int RUNS = 5;
+
+struct sink_system : public base_system {
+	virtual void update(const double duration_ms) override {}
+};
+
+template <int... Ns>
+void subscribe_idle(ecs &world, base_system &sys, std::integer_sequence<int, Ns...>) {
+	const int unused[] = { 0, (sys.subscribe<idle_t<Ns>>(world, [] (idle_t<Ns> &) {}), 0)... };
+	(void)unused;
+}
+
+/* Best of RUNS: the fastest time to run func, in seconds */
+template <typename F>
+double best_time(F func) {
+	double best = 0.0;
+	for (int run=0; run<RUNS; ++run) {
+		const auto start = std::chrono::steady_clock::now();
+		func();
+		const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		if (run == 0 || seconds < best) best = seconds;
+	}
+	return best;
+}
+
+void report(const char * name, const double count, const double seconds) {
+	std::printf("%-44s %8.2f M msg/s\n", name, count / seconds / 1e6);
+}
+
+int main() {
+	ecs world;
+	world.set_worker_threads(4);
+	world.add_system<sink_system>();
+	base_system &sink = *world.system_store[0];
+	long long total = 0;
+	sink.subscribe<hit_t>(world, [&total] (hit_t &h) { total += h.damage; });
+	sink.subscribe<hit_t>(world, [&total] (hit_t &h) { total += h.target; });
+	sink.subscribe_mbox<hit_t>(world);
+	sink.subscribe_batch<tally_t>(world, [&total] (span_t<tally_t> messages) {
+		for (const tally_t &t : messages) total += t.amount;
+	});
+	subscribe_idle(world, sink, std::make_integer_sequence<int, 60>{});
+
+	const double deferred = best_time([&world, &sink, &total] () {
+		for (int i=0; i<MESSAGES; ++i) world.emit_deferred(hit_t{ 1, i & 7 });
+		world.deliver_messages();
+		sink.each_mbox<hit_t>([&total] (const hit_t &h) { total += h.damage; });
+	});
+	report("emit_deferred + deliver + mailbox drain", MESSAGES, deferred);
+
+	const double from_workers = best_time([&world, &sink, &total] () {
+		world.workers().parallel_for(MESSAGES, 4096, [&world] (const std::size_t begin, const std::size_t end) {
+			for (std::size_t i=begin; i<end; ++i) world.emit_deferred(hit_t{ 1, static_cast<int>(i & 7) });
+		});
+		world.deliver_messages();
+		sink.each_mbox<hit_t>([&total] (const hit_t &h) { total += h.damage; });
+	});
+	report("emit_deferred from 4 workers + deliver", MESSAGES, from_workers);
+
+	const double batched = best_time([&world] () {
+		for (int i=0; i<MESSAGES; ++i) world.emit_deferred(tally_t{ 1 });
+		world.deliver_messages();
+	});
+	report("emit_deferred + deliver to a batch handler", MESSAGES, batched);
+
+	const double immediate = best_time([&world, &sink, &total] () {
+		for (int i=0; i<MESSAGES; ++i) world.emit(hit_t{ 1, 1 });
+		sink.each_mbox<hit_t>([&total] (const hit_t &h) { total += h.damage; });
+	});
+	report("emit (immediate) + mailbox drain", MESSAGES, immediate);
+
+	constexpr int EMPTY_DELIVERIES = 200000;
+	const double empty = best_time([&world] () {
+		for (int i=0; i<EMPTY_DELIVERIES; ++i) world.deliver_messages();
+	});
+	std::printf("%-44s %8.1f ns/call\n", "deliver_messages with nothing queued", empty / EMPTY_DELIVERIES * 1e9);
+
+	std::fprintf(stderr, "(checksum %lld)\n", total);
+	return 0;
+}
@@ -0,0 +1,117 @@
+/* RLTK (RogueLike Tool Kit) 1.00
+ * Copyright (c) 2016-Present, Bracket Productions.
+ * Licensed under the MIT license - see LICENSE file.
+ *
+ * Benchmark: mpsc_queue throughput, in millions of items per second (best of five runs). "ticked" pushes a
+ * thousand items then drains them, over and over - the pattern of emit_deferred and deliver_messages. The
+ * other cases push from several threads, either draining as they go or all at the end. Every case checks
+ * that each producer's items come out complete and in order.
+ */
+
+#include "../rltk/mpsc_queue.hpp"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+using namespace rltk;
+
+constexpr std::size_t ITEMS = 2000000;
+constexpr int RUNS = 5;
+
+struct small_t { std::size_t producer; std::size_t sequence; };
+struct large_t { std::size_t producer; std::size_t sequence; char payload[48]; };
+
+template <typename F>
+double best_time(F func) {
+	double best = 0.0;
+	for (int run=0; run<RUNS; ++run) {
+		const auto start = std::chrono::steady_clock::now();
+		func();
+		const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		if (run == 0 || seconds < best) best = seconds;
+	}
+	return best;
+}
+
+/* Checks items arrive complete and, per producer, in order */
+struct order_check_t {
+	std::vector<std::size_t> expected;
+	std::size_t seen = 0;
+
+	explicit order_check_t(const std::size_t producers) : expected(producers, 0) {}
+
+	template <class T>
+	void operator()(T &item) {
+		if (expected[item.producer] != item.sequence) {
+			std::printf("Producer %zu's items arrived out of order\n", item.producer);
+			std::exit(1);
+		}
+		++expected[item.producer];
+		++seen;
+	}
+};
+
+template <class T>
+double ticked() {
+	return best_time([] () {
+		mpsc_queue<T> queue;
+		order_check_t check(1);
+		for (std::size_t tick=0; tick<ITEMS/1000; ++tick) {
+			for (std::size_t i=0; i<1000; ++i) {
+				T item{};
+				item.sequence = tick * 1000 + i;
+				queue.push(item);
+			}
+			queue.drain(check);
+		}
+		if (check.seen != ITEMS) std::exit(1);
+	});
+}
+
+template <class T>
+double threaded(const std::size_t producers, const bool drain_while_pushing) {
+	return best_time([producers, drain_while_pushing] () {
+		mpsc_queue<T> queue;
+		order_check_t check(producers);
+		std::atomic<std::size_t> finished{0};
+		std::vector<std::thread> threads;
+		for (std::size_t p=0; p<producers; ++p) {
+			threads.emplace_back([&queue, &finished, p, producers] () {
+				for (std::size_t i=0; i<ITEMS/producers; ++i) {
+					T item{};
+					item.producer = p;
+					item.sequence = i;
+					queue.push(item);
+				}
+				++finished;
+			});
+		}
+		if (drain_while_pushing) {
+			while (finished.load() < producers) queue.drain(check);
+		}
+		for (std::thread &t : threads) t.join();
+		queue.drain(check);
+		if (check.seen != (ITEMS/producers) * producers) {
+			std::printf("Items went missing\n");
+			std::exit(1);
+		}
+	});
+}
+
+template <class T>
+void run(const char * name) {
+	const double items = static_cast<double>(ITEMS);
+	std::printf("%s items:\n", name);
+	std::printf("  %-34s %8.2f M items/s\n", "ticked, one thread", items / ticked<T>() / 1e6);
+	std::printf("  %-34s %8.2f M items/s\n", "4 producers, draining meanwhile", items / threaded<T>(4, true) / 1e6);
+	std::printf("  %-34s %8.2f M items/s\n", "4 producers, drained at the end", items / threaded<T>(4, false) / 1e6);
+}
+
+int main() {
+	run<small_t>("16-byte");
+	run<large_t>("64-byte");
+	return 0;
+}
@@ -1,93 +1,1203 @@
 #include "ecs.hpp"
 #include <cereal/types/polymorphic.hpp>
 #include <cereal/archives/binary.hpp>
+#include <cstdio>
 
 namespace rltk {
 
 std::size_t impl::base_component_t::type_counter = 1;
 std::size_t base_message_t::type_counter = 1;
-std::size_t entity_t::entity_counter{1}; // Not using zero since it is used as null so often
+std::size_t impl::view_cache_t::type_counter = 0;
+std::size_t impl::base_resource_t::type_counter = 0;
 ecs default_ecs;
 
 entity_t * ecs::entity(const std::size_t id) noexcept {
-	entity_t * result = nullptr;
-	auto finder = entity_store.find(id);
-	if (finder == entity_store.end()) return result;
-	if (finder->second.deleted) return result;
-	result = &finder->second;
+	entity_t * result = entity_store.find(id);
+	if (result && result->deleted) return nullptr;
 	return result;
 }
 
-entity_t * ecs::create_entity() {
-    entity_t new_entity;
-    while (entity_store.find(new_entity.id) != entity_store.end()) {
-        ++entity_t::entity_counter;
-        new_entity.id = entity_t::entity_counter;
-    }
-    //std::cout << "New Entity ID#: " << new_entity.id << "\n";
+entity_t * ecs::entity(const entity_handle_t &handle) noexcept {
+	entity_t * result = entity_store.find(handle);
+	if (result && result->deleted) return nullptr;
+	return result;
+}
 
-    entity_store.emplace(new_entity.id, new_entity);
-    return entity(new_entity.id);
+entity_t * ecs::create_entity() {
+	return &entity_store.create();
 }
 
 entity_t * ecs::create_entity(const std::size_t new_id) {
-	entity_t new_entity(new_id);
-    if (entity_store.find(new_entity.id) != entity_store.end()) {
-        throw std::runtime_error("WARNING: Duplicate entity ID. Odd things will happen\n");
-    }
-	entity_store.emplace(new_entity.id, new_entity);
-	return entity(new_entity.id);
+	return &entity_store.create(new_id);
 }
 
-void ecs::each(std::function<void(entity_t &)> &&func) {
-	for (auto it=entity_store.begin(); it!=entity_store.end(); ++it) {
-		if (!it->second.deleted) {
-			func(it->second);
-		}
-	}
+entity_range_t ecs::create_entities(const std::size_t count) {
+	return entity_range_t{ entity_store.create_range(count), count };
 }
 
-
 void ecs::delete_all_systems() {
 	system_store.clear();
 	system_profiling.clear();
+	std::size_t family_id;
+	while (dirty_messages.pop(family_id)) {}
 	pubsub_holder.clear();
+	system_schedule.clear();
+	schedule_dirty = true;
 }
 
 void ecs::ecs_configure() {
 	for (std::unique_ptr<base_system> & sys : system_store) {
 		sys->configure();
 	}
+	schedule_dirty = true;
+}
+
+void ecs::build_schedule() {
+	system_schedule.clear();
+	std::vector<std::size_t> wave_of(system_store.size(), 0);
+	for (std::size_t i=0; i<system_store.size(); ++i) {
+		std::size_t wave = 0;
+		for (std::size_t j=0; j<i; ++j) {
+			if (wave_of[j] >= wave && system_store[i]->conflicts_with(*system_store[j])) wave = wave_of[j] + 1;
+		}
+		wave_of[i] = wave;
+		if (system_schedule.size() < wave+1) system_schedule.resize(wave+1);
+		system_schedule[wave].push_back(i);
+	}
+	schedule_dirty = false;
+}
+
+void ecs::run_system(const std::size_t index, const double duration_ms) {
+	base_system &sys = *system_store[index];
+	sys.changes_since = sys.last_run_tick;
+	sys.last_run_tick = change_tick;
+	std::chrono::high_resolution_clock::time_point t1 = std::chrono::high_resolution_clock::now();
+	sys.update(duration_ms);
+	std::chrono::high_resolution_clock::time_point t2 = std::chrono::high_resolution_clock::now();
+	double duration = static_cast<double>(std::chrono::duration_cast<std::chrono::microseconds>( t2 - t1 ).count());
+
+	const std::size_t worker = worker_pool ? worker_pool->worker_index() : thread_pool::NOT_A_WORKER;
+	const std::size_t thread = (worker == thread_pool::NOT_A_WORKER) ? 0 : worker + 1;
+	system_profiling_t &profile = system_profiling[index];
+	profile.last = duration;
+	profile.thread = thread;
+	if (duration > profile.worst) profile.worst = duration;
+	if (duration < profile.best) profile.best = duration;
+	thread_profiling[thread] += duration;
+}
+
+void ecs::play_back_commands() {
+	struct queued_command_t {
+		std::size_t entity_id;
+		std::size_t buffer;
+		std::size_t sequence;
+	};
+	std::vector<queued_command_t> queue;
+	std::vector<std::size_t> assigns_per_family;
+	for (std::size_t b=0; b<command_buffers.size(); ++b) {
+		const command_buffer_t &buffer = *command_buffers[b];
+		for (std::size_t i=0; i<buffer.commands.size(); ++i) {
+			const command_buffer_t::command_t &command = buffer.commands[i];
+			queue.push_back(queued_command_t{ command.entity_id, b, i });
+			if (command.kind == command_buffer_t::command_kind_t::ASSIGN_COMPONENT) {
+				if (assigns_per_family.size() < command.family_id+1) assigns_per_family.resize(command.family_id+1, 0);
+				++assigns_per_family[command.family_id];
+			}
+		}
+	}
+	if (queue.empty()) return;
+	// The buffers are emptied even if a command throws, so nothing is replayed on the next tick
+	struct clear_guard_t {
+		std::vector<std::unique_ptr<command_buffer_t>> &buffers;
+		~clear_guard_t() { for (auto &buffer : buffers) buffer->clear(); }
+	} guard{ command_buffers };
+
+	std::sort(queue.begin(), queue.end(), [] (const queued_command_t &a, const queued_command_t &b) {
+		if (a.entity_id != b.entity_id) return a.entity_id < b.entity_id;
+		if (a.buffer != b.buffer) return a.buffer < b.buffer;
+		return a.sequence < b.sequence;
+	});
+	for (std::size_t family_id=0; family_id<assigns_per_family.size(); ++family_id) {
+		if (assigns_per_family[family_id] > 0 && family_id < component_store.size() && component_store[family_id]) {
+			component_store[family_id]->reserve(assigns_per_family[family_id]);
+		}
+	}
+
+	for (const queued_command_t &queued : queue) {
+		command_buffer_t &buffer = *command_buffers[queued.buffer];
+		const command_buffer_t::command_t &command = buffer.commands[queued.sequence];
+		switch (command.kind) {
+			case command_buffer_t::command_kind_t::CREATE_ENTITY : {
+				entity_store.create(command.entity_id);
+			} break;
+			case command_buffer_t::command_kind_t::ASSIGN_COMPONENT : {
+				entity_t * e = entity(command.entity_id);
+				if (e) command.apply(*this, *e, buffer, command.payload_index);
+			} break;
+			case command_buffer_t::command_kind_t::DELETE_COMPONENT : {
+				delete_component(command.entity_id, command.family_id, command.delete_entity_if_empty);
+			} break;
+			case command_buffer_t::command_kind_t::DELETE_ENTITY : {
+				delete_entity(command.entity_id);
+			} break;
+		}
+	}
 }
 
 void ecs::ecs_tick(const double duration_ms) {
-	std::size_t count = 0;
-	for (std::unique_ptr<base_system> & sys : system_store) {
-		std::chrono::high_resolution_clock::time_point t1 = std::chrono::high_resolution_clock::now();
-		sys->update(duration_ms);
+	if (schedule_dirty) build_schedule();
+	thread_profiling.assign((worker_pool ? worker_pool->size() : 0) + 1, 0.0);
+
+	for (const std::vector<std::size_t> &wave : system_schedule) {
+		++change_tick;
+		if (wave.size() == 1) {
+			run_system(wave[0], duration_ms);
+		} else {
+			thread_pool &pool = workers();
+			if (thread_profiling.size() < pool.size() + 1) thread_profiling.resize(pool.size() + 1, 0.0);
+			{
+				begin_parallel_wave();
+				struct wave_guard_t {
+					ecs &world;
+					~wave_guard_t() { world.end_parallel_wave(); }
+				} guard{ *this };
+				pool.parallel_for(wave.size(), 1, [this, &wave, duration_ms] (const std::size_t begin, const std::size_t end) {
+					for (std::size_t i=begin; i<end; ++i) run_system(wave[i], duration_ms);
+				});
+			}
+			flush_archetype_changes();
+		}
+		// Changes made from here until the next wave are new to every system in this one
+		++change_tick;
+		play_back_commands();
+		if (!dirty_observers.empty() || positions) notify_observers();
 		deliver_messages();
-		std::chrono::high_resolution_clock::time_point t2 = std::chrono::high_resolution_clock::now();
-		double duration = static_cast<double>(std::chrono::duration_cast<std::chrono::microseconds>( t2 - t1 ).count());
+	}
+	play_back_commands();
+	ecs_garbage_collect();
+}
 
-		system_profiling[count].last = duration;
-		if (duration > system_profiling[count].worst) system_profiling[count].worst = duration;
-		if (duration < system_profiling[count].best) system_profiling[count].best = duration;
-		++count;
+void ecs::begin_parallel_wave() {
+	// Views are compacted now, and not again until the wave is over, so no system sees a list change under it
+	for (auto &v : views) {
+		if (v) v->compact(entity_store);
+	}
+	for (auto &v : views) {
+		if (v) v->held = true;
+	}
+	++archetypes.iterating; // Likewise, archetype changes wait for the end of the wave
+	in_parallel_wave = true;
+}
+
+void ecs::end_parallel_wave() noexcept {
+	in_parallel_wave = false;
+	for (auto &v : views) {
+		if (v) v->held = false;
+	}
+	--archetypes.iterating;
+}
+
+void ecs::notify_observers() {
+	if (notifying) return; // Events raised by an observer are picked up by the loop below
+	notifying = true;
+	struct notifying_guard_t {
+		bool &flag;
+		~notifying_guard_t() { flag = false; }
+	} guard{ notifying };
+	while (!dirty_observers.empty()) {
+		std::vector<std::size_t> dirty;
+		dirty.swap(dirty_observers);
+		for (const std::size_t &family_id : dirty) {
+			impl::base_observer_t &observer = *observers[family_id];
+			observer.queued = false;
+			observer.deliver(*this);
+		}
+	}
+	if (positions) {
+		const std::size_t since = positions->synced_tick;
+		positions->synced_tick = change_checkpoint();
+		positions->resync(*positions, since);
+	}
+}
+
+void ecs::flush_archetype_changes() {
+	if (archetypes.iterating > 0) return;
+	std::vector<std::size_t> pending;
+	pending.swap(archetypes.pending);
+	for (const std::size_t &id : pending) {
+		update_archetype(id);
+	}
+	if (archetype_deferred && !archetype_deferred->empty()) {
+		command_buffer_t &buffer = *archetype_deferred;
+		for (const command_buffer_t::command_t &command : buffer.commands) {
+			entity_t * e = entity(command.entity_id);
+			if (e) command.apply(*this, *e, buffer, command.payload_index);
+		}
+		buffer.clear();
+	}
+}
+
+namespace {
+	const char SNAPSHOT_MAGIC[8] = { 'R', 'L', 'T', 'K', 'S', 'N', 'A', 'P' };
+	const char DELTA_MAGIC[8] = { 'R', 'L', 'T', 'K', 'D', 'E', 'L', 'T' };
+	constexpr std::uint64_t ENTITY_SECTION = ~std::uint64_t(0); // Section "family" for the entity list
+	constexpr std::uint64_t REMOVED_SECTION = ~std::uint64_t(1); // Deltas: IDs of the entities deleted since
+	constexpr std::size_t MASK_WORDS = (impl::MAX_COMPONENTS + 63) / 64;
+
+	/* The component mask as 64-bit words, lowest families first */
+	inline void mask_to_words(const std::bitset<impl::MAX_COMPONENTS> &mask, std::uint64_t * words) {
+		static const std::bitset<impl::MAX_COMPONENTS> low_word(~0ULL);
+		for (std::size_t w=0; w<MASK_WORDS; ++w) words[w] = ((mask >> (w * 64)) & low_word).to_ullong();
+	}
+
+	inline std::bitset<impl::MAX_COMPONENTS> mask_from_words(const std::uint64_t * words) {
+		std::bitset<impl::MAX_COMPONENTS> mask;
+		for (std::size_t w=MASK_WORDS; w-- > 0;) {
+			mask <<= 64;
+			mask |= std::bitset<impl::MAX_COMPONENTS>(words[w]);
+		}
+		return mask;
+	}
+
+	/* An ID for a new full save; its deltas carry it, so they can't be applied on top of the wrong one */
+	std::uint32_t new_save_id() {
+		static std::atomic<std::uint32_t> counter{0};
+		const std::uint64_t now = static_cast<std::uint64_t>(std::chrono::high_resolution_clock::now().time_since_epoch().count());
+		const std::uint32_t id = static_cast<std::uint32_t>((now ^ (now >> 32)) * 2654435761u) + counter.fetch_add(0x9e3779b9u);
+		return id == 0 ? 1 : id;
+	}
+
+	struct section_t {
+		std::uint64_t family;
+		std::uint64_t offset;
+		std::uint64_t size;
+		std::uint64_t packed = 0; // Bytes in the file if compressed; 0 if stored as it is
+		const char * bytes = nullptr; // The section itself, once unpacked
+	};
+
+	/* A snapshot or delta header, checked, with the saved family IDs mapped to ours by name */
+	struct parsed_snapshot_t {
+		const char * data = nullptr;
+		std::uint32_t version = 0;
+		std::uint32_t save_id = 0;
+		std::uint32_t sequence = 0; // Deltas: 1 for the first after the full save, and so on
+		std::uint64_t next_id = 0;
+		std::vector<impl::snapshot_type_t> types;
+		std::vector<std::size_t> remap = std::vector<std::size_t>(impl::MAX_COMPONENTS, impl::NO_INDEX);
+		std::bitset<impl::MAX_COMPONENTS> known;
+		bool identity = true;
+		std::vector<section_t> sections;
+		bool packed = false;
+		std::vector<std::string> inflated; // Compressed sections, unpacked
+
+		inline impl::snapshot_reader_t body(const section_t &section) const {
+			impl::snapshot_reader_t in(section.bytes, static_cast<std::size_t>(section.size));
+			in.version = version;
+			return in;
+		}
+
+		/* A saved component mask, in our family IDs */
+		inline std::bitset<impl::MAX_COMPONENTS> mask(const char * saved_words) const {
+			std::uint64_t words[MASK_WORDS];
+			std::memcpy(words, saved_words, sizeof(words));
+			const std::bitset<impl::MAX_COMPONENTS> saved = mask_from_words(words);
+			if ((saved & ~known).any()) throw std::runtime_error("The snapshot is truncated or corrupt.");
+			if (identity) return saved;
+			std::bitset<impl::MAX_COMPONENTS> result;
+			for (std::size_t family_id=0; family_id<impl::MAX_COMPONENTS; ++family_id) {
+				if (saved.test(family_id)) result.set(remap[family_id]);
+			}
+			return result;
+		}
+	};
+
+	parsed_snapshot_t parse_snapshot(const char * data, const std::size_t size, const bool delta) {
+		parsed_snapshot_t parsed;
+		parsed.data = data;
+		impl::snapshot_reader_t in(data, size);
+		in.take(sizeof(SNAPSHOT_MAGIC));
+		parsed.version = in.read<std::uint32_t>();
+		if (parsed.version < 1 || parsed.version > impl::SNAPSHOT_VERSION) throw std::runtime_error("The snapshot was written by an incompatible version.");
+		parsed.save_id = in.read<std::uint32_t>();
+		parsed.next_id = in.read<std::uint64_t>();
+		if (delta) {
+			parsed.sequence = in.read<std::uint32_t>();
+			in.read<std::uint32_t>();
+		}
+
+		std::unordered_map<std::string, std::size_t> family_of;
+		{
+			std::lock_guard<std::mutex> lock(impl::snapshot_types_mutex());
+			parsed.types = impl::snapshot_types();
+		}
+		for (std::size_t family_id=0; family_id<parsed.types.size(); ++family_id) {
+			if (!parsed.types[family_id].name.empty()) family_of[parsed.types[family_id].name] = family_id;
+		}
+		const std::uint32_t type_count = in.read<std::uint32_t>();
+		for (std::uint32_t i=0; i<type_count; ++i) {
+			const std::uint64_t saved = in.read<std::uint64_t>();
+			const std::string name = in.read_string();
+			auto finder = family_of.find(name);
+			if (finder == family_of.end()) throw std::runtime_error("The snapshot holds component type " + name + ", which is not registered; see register_components.");
+			if (saved >= impl::MAX_COMPONENTS) throw std::runtime_error("The snapshot is truncated or corrupt.");
+			parsed.remap[saved] = finder->second;
+			parsed.known.set(saved);
+			if (saved != finder->second) parsed.identity = false;
+		}
+
+		parsed.sections.resize(in.read<std::uint32_t>());
+		for (section_t &section : parsed.sections) {
+			section.family = in.read<std::uint64_t>();
+			section.offset = in.read<std::uint64_t>();
+			section.size = in.read<std::uint64_t>();
+			if (parsed.version >= 3) section.packed = in.read<std::uint64_t>();
+			const std::uint64_t stored = section.packed > 0 ? section.packed : section.size;
+			if (section.offset > size || stored > size - section.offset) throw std::runtime_error("The snapshot is truncated or corrupt.");
+			section.bytes = data + section.offset;
+			if (section.packed > 0) parsed.packed = true;
+			if (section.family == ENTITY_SECTION || (delta && section.family == REMOVED_SECTION)) continue;
+			if (section.family >= impl::MAX_COMPONENTS || parsed.remap[section.family] == impl::NO_INDEX) {
+				throw std::runtime_error("The snapshot is truncated or corrupt.");
+			}
+			if (!parsed.types[parsed.remap[section.family]].make_store) {
+				throw std::runtime_error("The snapshot holds data for " + parsed.types[parsed.remap[section.family]].name + ", which is now a tag.");
+			}
+		}
+		return parsed;
+	}
+
+	/* An entity section: an ID, generation and component mask per entity */
+	struct entity_rows_t {
+		std::vector<std::size_t> ids;
+		const char * generations;
+		const char * masks;
+
+		explicit entity_rows_t(impl::snapshot_reader_t &in) {
+			const std::size_t count = static_cast<std::size_t>(in.read<std::uint64_t>());
+			in.read_ids(ids, count);
+			generations = in.take(count * sizeof(std::uint32_t));
+			masks = in.take(count * MASK_WORDS * sizeof(std::uint64_t));
+		}
+
+		inline std::uint32_t generation(const std::size_t i) const noexcept {
+			std::uint32_t result;
+			std::memcpy(&result, generations + i * sizeof(std::uint32_t), sizeof(result));
+			return result;
+		}
+
+		inline const char * mask(const std::size_t i) const noexcept {
+			return masks + i * MASK_WORDS * sizeof(std::uint64_t);
+		}
+	};
+
+	/* Writes an entity section from the three arrays */
+	void write_entity_rows(impl::snapshot_writer_t &out, const std::vector<std::size_t> &ids, const std::vector<std::uint32_t> &generations,
+		const std::vector<std::uint64_t> &masks)
+	{
+		out.write<std::uint64_t>(ids.size());
+		out.write_ids(ids.data(), ids.size());
+		out.write_bytes(generations.data(), generations.size() * sizeof(std::uint32_t));
+		out.write_bytes(masks.data(), masks.size() * sizeof(std::uint64_t));
+	}
+
+	/* One run of a section, compressed (or inflated) on its own so the runs can be worked on in parallel */
+	struct chunk_t {
+		const char * source;
+		std::size_t source_size;
+		char * target;
+		std::size_t target_size;
+		std::string packed;
+	};
+
+	/*
+	 * Compresses each section in SNAPSHOT_CHUNK_SIZE chunks, spread over the pool. A packed section is the chunk
+	 * size, each chunk's compressed length, then the chunks; one that doesn't get any smaller is left empty, and
+	 * the section is stored as it is.
+	 */
+	std::vector<std::string> pack_sections(const std::vector<impl::snapshot_writer_t> &sections, thread_pool &pool) {
+		std::vector<chunk_t> chunks;
+		std::vector<std::size_t> first_chunk;
+		for (const impl::snapshot_writer_t &section : sections) {
+			first_chunk.push_back(chunks.size());
+			for (std::size_t begin=0; begin<section.bytes.size(); begin+=impl::SNAPSHOT_CHUNK_SIZE) {
+				chunks.push_back(chunk_t{ section.bytes.data() + begin, std::min(impl::SNAPSHOT_CHUNK_SIZE, section.bytes.size() - begin), nullptr, 0, {} });
+			}
+		}
+		first_chunk.push_back(chunks.size());
+		pool.parallel_for(chunks.size(), 1, [&chunks] (const std::size_t begin, const std::size_t end) {
+			for (std::size_t i=begin; i<end; ++i) {
+				chunk_t &chunk = chunks[i];
+				uLongf length = compressBound(static_cast<uLong>(chunk.source_size));
+				chunk.packed.resize(length);
+				if (compress2(reinterpret_cast<Bytef *>(&chunk.packed[0]), &length, reinterpret_cast<const Bytef *>(chunk.source),
+						static_cast<uLong>(chunk.source_size), Z_BEST_SPEED) != Z_OK) {
+					throw std::runtime_error("Unable to compress the snapshot.");
+				}
+				chunk.packed.resize(length);
+			}
+		});
+
+		std::vector<std::string> packed(sections.size());
+		for (std::size_t s=0; s<sections.size(); ++s) {
+			const std::size_t count = first_chunk[s+1] - first_chunk[s];
+			std::size_t total = sizeof(std::uint64_t) * (count + 1);
+			for (std::size_t i=first_chunk[s]; i<first_chunk[s+1]; ++i) total += chunks[i].packed.size();
+			if (total >= sections[s].bytes.size()) continue;
+			impl::snapshot_writer_t out;
+			out.bytes.reserve(total);
+			out.write<std::uint64_t>(impl::SNAPSHOT_CHUNK_SIZE);
+			for (std::size_t i=first_chunk[s]; i<first_chunk[s+1]; ++i) out.write<std::uint64_t>(chunks[i].packed.size());
+			for (std::size_t i=first_chunk[s]; i<first_chunk[s+1]; ++i) out.write_bytes(chunks[i].packed.data(), chunks[i].packed.size());
+			packed[s] = std::move(out.bytes);
+		}
+		return packed;
+	}
+
+	/* Inflates the packed sections, every chunk in parallel on the pool, so body() reads them like the rest */
+	void unpack_sections(parsed_snapshot_t &parsed, thread_pool &pool) {
+		std::vector<chunk_t> chunks;
+		parsed.inflated.resize(parsed.sections.size());
+		for (std::size_t s=0; s<parsed.sections.size(); ++s) {
+			section_t &section = parsed.sections[s];
+			if (section.packed == 0) continue;
+			impl::snapshot_reader_t in(section.bytes, static_cast<std::size_t>(section.packed));
+			const std::uint64_t chunk_size = in.read<std::uint64_t>();
+			if (chunk_size == 0 || chunk_size > (1u << 30)) throw std::runtime_error("The snapshot is truncated or corrupt.");
+			const std::uint64_t count = (section.size + chunk_size - 1) / chunk_size;
+			if (count > (in.size - in.position) / sizeof(std::uint64_t)) throw std::runtime_error("The snapshot is truncated or corrupt.");
+			std::vector<std::uint64_t> lengths(static_cast<std::size_t>(count));
+			in.read_bytes(lengths.data(), lengths.size() * sizeof(std::uint64_t));
+			// Deflate can't do better than about 1032:1, so a bigger claimed size is corruption rather than a huge allocation
+			std::uint64_t most = 0;
+			for (const std::uint64_t &length : lengths) most += std::min<std::uint64_t>(length, in.size) * 1032 + 1032;
+			if (section.size > most) throw std::runtime_error("The snapshot is truncated or corrupt.");
+			parsed.inflated[s].resize(static_cast<std::size_t>(section.size));
+			for (std::size_t i=0; i<lengths.size(); ++i) {
+				const std::size_t begin = static_cast<std::size_t>(i * chunk_size);
+				if (lengths[i] > in.size - in.position) throw std::runtime_error("The snapshot is truncated or corrupt.");
+				const char * source = in.take(static_cast<std::size_t>(lengths[i]));
+				chunks.push_back(chunk_t{ source, static_cast<std::size_t>(lengths[i]), &parsed.inflated[s][begin],
+					std::min(static_cast<std::size_t>(chunk_size), static_cast<std::size_t>(section.size) - begin), {} });
+			}
+			section.bytes = parsed.inflated[s].data();
+		}
+		pool.parallel_for(chunks.size(), 1, [&chunks] (const std::size_t begin, const std::size_t end) {
+			for (std::size_t i=begin; i<end; ++i) {
+				chunk_t &chunk = chunks[i];
+				uLongf length = static_cast<uLongf>(chunk.target_size);
+				if (uncompress(reinterpret_cast<Bytef *>(chunk.target), &length, reinterpret_cast<const Bytef *>(chunk.source),
+						static_cast<uLong>(chunk.source_size)) != Z_OK || length != chunk.target_size) {
+					throw std::runtime_error("The snapshot is truncated or corrupt.");
+				}
+			}
+		});
+	}
+
+	/*
+	 * Writes a snapshot or delta: the header, a type table naming every family in use (so the loader can map
+	 * them to its own family IDs), then the sections - each starting on a SNAPSHOT_SECTION_ALIGNMENT boundary,
+	 * so mapped arrays are aligned in memory. Given a pool, the sections are compressed on it.
+	 */
+	void write_container(std::ostream &out, const bool delta, const std::uint32_t save_id, const std::uint32_t sequence,
+		const std::uint64_t next_id, const std::bitset<impl::MAX_COMPONENTS> &used, const std::vector<std::uint64_t> &section_families,
+		std::vector<impl::snapshot_writer_t> &sections, thread_pool * pool = nullptr)
+	{
+		const std::vector<std::string> packed = pool ? pack_sections(sections, *pool) : std::vector<std::string>(sections.size());
+
+		std::vector<impl::snapshot_type_t> types;
+		{
+			std::lock_guard<std::mutex> lock(impl::snapshot_types_mutex());
+			types = impl::snapshot_types();
+		}
+
+		impl::snapshot_writer_t header;
+		header.write_bytes(delta ? DELTA_MAGIC : SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+		header.write<std::uint32_t>(impl::SNAPSHOT_VERSION);
+		header.write<std::uint32_t>(save_id);
+		header.write<std::uint64_t>(next_id);
+		if (delta) {
+			header.write<std::uint32_t>(sequence);
+			header.write<std::uint32_t>(0);
+		}
+		std::unordered_set<std::string> names;
+		header.write<std::uint32_t>(static_cast<std::uint32_t>(used.count()));
+		for (std::size_t family_id=0; family_id<impl::MAX_COMPONENTS; ++family_id) {
+			if (!used.test(family_id)) continue;
+			if (family_id >= types.size() || types[family_id].name.empty()) {
+				throw std::runtime_error("A component type in the world is not registered for saving.");
+			}
+			if (!names.insert(types[family_id].name).second) {
+				throw std::runtime_error("Two component types share the name " + types[family_id].name + "; give one an xml_identity.");
+			}
+			header.write<std::uint64_t>(family_id);
+			header.write_string(types[family_id].name);
+		}
+		header.write<std::uint32_t>(static_cast<std::uint32_t>(sections.size()));
+
+		const auto aligned = [] (const std::uint64_t position) {
+			return (position + impl::SNAPSHOT_SECTION_ALIGNMENT - 1) / impl::SNAPSHOT_SECTION_ALIGNMENT * impl::SNAPSHOT_SECTION_ALIGNMENT;
+		};
+		std::uint64_t offset = aligned(header.bytes.size() + sections.size() * 4 * sizeof(std::uint64_t));
+		for (std::size_t i=0; i<sections.size(); ++i) {
+			header.write<std::uint64_t>(section_families[i]);
+			header.write<std::uint64_t>(offset);
+			header.write<std::uint64_t>(sections[i].bytes.size());
+			header.write<std::uint64_t>(packed[i].size());
+			offset = aligned(offset + (packed[i].empty() ? sections[i].bytes.size() : packed[i].size()));
+		}
+		header.align(impl::SNAPSHOT_SECTION_ALIGNMENT);
+
+		out.write(header.bytes.data(), header.bytes.size());
+		static const char padding[impl::SNAPSHOT_SECTION_ALIGNMENT] = {};
+		for (std::size_t i=0; i<sections.size(); ++i) {
+			const std::string &bytes = packed[i].empty() ? sections[i].bytes : packed[i];
+			out.write(bytes.data(), bytes.size());
+			out.write(padding, (impl::SNAPSHOT_SECTION_ALIGNMENT - bytes.size() % impl::SNAPSHOT_SECTION_ALIGNMENT) % impl::SNAPSHOT_SECTION_ALIGNMENT);
+		}
+	}
+}
+
+/*
+ * Everything a snapshot is written from: the live entities' IDs, generations and masks, and the stores with the
+ * families they are saved under. For ecs_save the stores are the world's own; for ecs_save_async they are copies,
+ * kept (indexed by family) along with the entity arrays so the next save can copy into the same memory.
+ */
+struct impl::snapshot_capture_t {
+	std::atomic<bool> writing{false}; // A background save is still using this
+	std::uint32_t save_id = 0;
+	std::uint64_t next_id = 0;
+	std::vector<std::size_t> ids;
+	std::vector<std::uint32_t> generations;
+	std::vector<std::bitset<impl::MAX_COMPONENTS>> masks; // Turned into words by write_capture, off the game thread
+	std::vector<std::pair<std::size_t, impl::base_component_store *>> stores;
+	std::vector<std::unique_ptr<impl::base_component_store>> owned;
+	std::vector<std::pair<std::size_t, impl::snapshot_writer_t>> raw_sections; // Still waiting in a mapped snapshot
+};
+
+namespace {
+	/*
+	 * Writes a captured world in the native snapshot format, compressed on the pool if one is given. This doesn't
+	 * touch the ecs, so runs on any thread.
+	 */
+	void write_capture(impl::snapshot_capture_t &capture, std::ostream &out, thread_pool * pool) {
+		std::bitset<impl::MAX_COMPONENTS> used;
+		std::vector<std::uint64_t> masks(capture.masks.size() * MASK_WORDS);
+		for (std::size_t i=0; i<capture.masks.size(); ++i) {
+			mask_to_words(capture.masks[i], &masks[i * MASK_WORDS]);
+			used |= capture.masks[i];
+		}
+		std::vector<std::uint64_t> section_families;
+		std::vector<impl::snapshot_writer_t> sections;
+		section_families.push_back(ENTITY_SECTION);
+		sections.emplace_back();
+		write_entity_rows(sections.back(), capture.ids, capture.generations, masks);
+
+		for (const auto &store : capture.stores) {
+			used.set(store.first);
+			section_families.push_back(store.first);
+			sections.emplace_back();
+			store.second->snapshot_save(sections.back());
+		}
+		for (auto &raw : capture.raw_sections) {
+			used.set(raw.first);
+			section_families.push_back(raw.first);
+			sections.push_back(std::move(raw.second));
+		}
+		write_container(out, false, capture.save_id, 0, capture.next_id, used, section_families, sections, pool);
 	}
+
+	/* Writes bytes to path through path.tmp, so path is only ever replaced by a complete file */
+	void write_file_atomically(const std::string &path, const std::string &bytes) {
+		const std::string temporary = path + ".tmp";
+		std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+		file.write(bytes.data(), bytes.size());
+		file.close();
+		if (!file) throw std::runtime_error("Unable to write " + temporary);
+		if (std::rename(temporary.c_str(), path.c_str()) != 0) {
+			// Windows won't rename over an existing file
+			std::remove(path.c_str());
+			if (std::rename(temporary.c_str(), path.c_str()) != 0) throw std::runtime_error("Unable to replace " + path);
+		}
+	}
+
+	/* Inflates a whole gzip-compressed snapshot, as ecs_save_async used to write */
+	std::string gunzip(const char * data, std::size_t size) {
+		z_stream stream;
+		std::memset(&stream, 0, sizeof(stream));
+		if (inflateInit2(&stream, 16 + MAX_WBITS) != Z_OK) throw std::runtime_error("Unable to decompress the snapshot.");
+		std::string result(std::max<std::size_t>(size * 4, 4096), '\0');
+		std::size_t produced = 0;
+		int status = Z_OK;
+		while (status != Z_STREAM_END) {
+			if (stream.avail_in == 0 && size > 0) {
+				const uInt chunk = static_cast<uInt>(std::min<std::size_t>(size, 1u << 30));
+				stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data));
+				stream.avail_in = chunk;
+				data += chunk;
+				size -= chunk;
+			}
+			if (produced == result.size()) result.resize(result.size() * 2);
+			const uInt room = static_cast<uInt>(std::min<std::size_t>(result.size() - produced, 1u << 30));
+			stream.next_out = reinterpret_cast<Bytef *>(&result[produced]);
+			stream.avail_out = room;
+			status = inflate(&stream, Z_NO_FLUSH);
+			produced += room - stream.avail_out;
+			// Z_BUF_ERROR with room to spare means the input ran out first
+			if ((status != Z_OK && status != Z_STREAM_END && status != Z_BUF_ERROR) || (status == Z_BUF_ERROR && stream.avail_out != 0)) {
+				inflateEnd(&stream);
+				throw std::runtime_error("The snapshot is truncated or corrupt.");
+			}
+		}
+		inflateEnd(&stream);
+		result.resize(produced);
+		return result;
+	}
+
+	inline bool is_gzip(const char * data, const std::size_t size) {
+		return size >= 2 && static_cast<unsigned char>(data[0]) == 0x1f && static_cast<unsigned char>(data[1]) == 0x8b;
+	}
+
+	inline bool is_snapshot(const char * data, const std::size_t size) {
+		return size >= sizeof(SNAPSHOT_MAGIC) && std::equal(SNAPSHOT_MAGIC, SNAPSHOT_MAGIC + sizeof(SNAPSHOT_MAGIC), data);
+	}
+
+	inline bool is_delta(const char * data, const std::size_t size) {
+		return size >= sizeof(DELTA_MAGIC) && std::equal(DELTA_MAGIC, DELTA_MAGIC + sizeof(DELTA_MAGIC), data);
+	}
+}
+
+void ecs::stores_from_archetypes() {
+	// Archetype storage is saved in the same form as the sparse-set stores, so either mode can load it
+	flush_archetype_changes();
+	component_store.clear();
+	for (auto &archetype : archetypes.archetypes) {
+		for (std::size_t row=0; row<archetype->size; ++row) {
+			const std::size_t id = archetype->id_at(row);
+			for (std::size_t c=0; c<archetype->columns.size(); ++c) {
+				archetype->columns[c]->to_store(*this, id, archetype->at(row, c));
+			}
+		}
+	}
+}
+
+void ecs::ecs_save(std::unique_ptr<std::ofstream> &lbfile, const bool compress) {
+	if (storage_mode == storage_mode_t::ARCHETYPE) stores_from_archetypes();
+	save_id = new_save_id();
+	save_sequence = 0;
+	write_snapshot(*lbfile, compress);
+	if (storage_mode == storage_mode_t::ARCHETYPE) component_store.clear();
+	if (delta_base) rebaseline();
+}
+
+std::future<void> ecs::ecs_save_async(const std::string &path, const bool compress) {
+	if (!async_capture || async_capture->writing.load(std::memory_order_acquire)) {
+		async_capture = std::make_shared<impl::snapshot_capture_t>();
+	}
+	std::shared_ptr<impl::snapshot_capture_t> capture = async_capture;
+	save_id = new_save_id();
+	save_sequence = 0;
+	if (storage_mode == storage_mode_t::ARCHETYPE) {
+		// The stores built from the archetypes are already a copy, so the save can simply take them
+		stores_from_archetypes();
+		capture_snapshot(*capture, false);
+		capture->owned = std::move(component_store);
+		component_store.clear();
+	} else {
+		capture_snapshot(*capture, true);
+	}
+	capture->writing.store(true);
+	if (delta_base) rebaseline();
+	const std::size_t threads = worker_threads;
+
+	// A detached thread rather than std::async, whose future would wait for the save when it was destroyed
+	std::promise<void> done;
+	std::future<void> result = done.get_future();
+	try {
+		std::thread([capture, path, compress, threads] (std::promise<void> done) {
+			std::exception_ptr error;
+			try {
+				std::unique_ptr<thread_pool> pool;
+				if (compress) pool = std::make_unique<thread_pool>(threads);
+				std::ostringstream out(std::ios::binary);
+				write_capture(*capture, out, pool.get());
+				write_file_atomically(path, out.str());
+			} catch (...) {
+				error = std::current_exception();
+			}
+			capture->writing.store(false, std::memory_order_release);
+			if (error) done.set_exception(error); else done.set_value();
+		}, std::move(done)).detach();
+	} catch (...) {
+		capture->writing.store(false, std::memory_order_release);
+		throw;
+	}
+	return result;
+}
+
+void ecs::enable_delta_saves() {
+	if (!delta_base) delta_base = std::make_unique<impl::delta_base_t>();
+}
+
+void ecs::ecs_save_delta(std::unique_ptr<std::ofstream> &lbfile) {
+	if (!delta_base || !delta_base->valid || save_id == 0) {
+		throw std::runtime_error("There is no full save for a delta to follow; call enable_delta_saves before ecs_save (or loading one).");
+	}
+	if (storage_mode == storage_mode_t::ARCHETYPE) stores_from_archetypes();
+	impl::delta_base_t &base = *delta_base;
+
+	// Entities that are new, recycled or have a different set of components get a row, and their new components are saved
+	std::vector<std::vector<std::size_t>> changed(impl::MAX_COMPONENTS);
+	std::vector<std::size_t> ids;
+	std::vector<std::uint32_t> generations;
+	std::vector<std::uint64_t> masks;
+	std::vector<std::uint8_t> seen(base.entities.size(), 0);
+	std::bitset<impl::MAX_COMPONENTS> used;
+	for (entity_t &e : entity_store) {
+		if (e.deleted) continue;
+		std::bitset<impl::MAX_COMPONENTS> gained = e.component_mask;
+		if (e.id < base.entities.size()) {
+			const impl::delta_base_t::entity_state_t &was = base.entities[e.id];
+			seen[e.id] = 1;
+			if (was.present && was.generation == e.generation) {
+				if (was.mask == e.component_mask) continue;
+				gained &= ~was.mask;
+			}
+		}
+		ids.push_back(e.id);
+		generations.push_back(e.generation);
+		masks.resize(masks.size() + MASK_WORDS);
+		mask_to_words(e.component_mask, &masks[masks.size() - MASK_WORDS]);
+		used |= e.component_mask;
+		for (std::size_t family_id=0; family_id<impl::MAX_COMPONENTS; ++family_id) {
+			if (gained.test(family_id)) changed[family_id].push_back(e.id);
+		}
+	}
+	std::vector<std::size_t> removed;
+	for (std::size_t id=0; id<base.entities.size(); ++id) {
+		if (base.entities[id].present && !seen[id]) removed.push_back(id);
+	}
+
+	// Components assigned or marked changed since the last save; every family in use then has a change log
+	for (std::size_t family_id=0; family_id<change_logs.size(); ++family_id) {
+		if (!change_logs[family_id]) continue;
+		change_logs[family_id]->since(base.tick, [this, family_id, &changed] (const entity_handle_t &handle) {
+			entity_t * e = entity(handle);
+			if (e && e->component_mask.test(family_id)) changed[family_id].push_back(e->id);
+		});
+	}
+
+	std::vector<std::uint64_t> section_families;
+	std::vector<impl::snapshot_writer_t> sections;
+	section_families.push_back(ENTITY_SECTION);
+	sections.emplace_back();
+	write_entity_rows(sections.back(), ids, generations, masks);
+	section_families.push_back(REMOVED_SECTION);
+	sections.emplace_back();
+	sections.back().write<std::uint64_t>(removed.size());
+	sections.back().write_ids(removed.data(), removed.size());
+	for (std::size_t family_id=0; family_id<impl::MAX_COMPONENTS; ++family_id) {
+		std::vector<std::size_t> &family = changed[family_id];
+		if (family.empty() || impl::tag_families().test(family_id)) continue;
+		if (mapped) materialise(family_id);
+		if (family_id >= component_store.size() || !component_store[family_id]) continue;
+		std::sort(family.begin(), family.end());
+		family.erase(std::unique(family.begin(), family.end()), family.end());
+		used.set(family_id);
+		section_families.push_back(family_id);
+		sections.emplace_back();
+		component_store[family_id]->snapshot_save_entities(sections.back(), family);
+	}
+	write_container(*lbfile, true, save_id, save_sequence + 1, entity_store.next_id.load(), used, section_families, sections);
+	++save_sequence;
+	if (storage_mode == storage_mode_t::ARCHETYPE) component_store.clear();
+
+	// The delta's rows and removals are exactly what changed in the base
+	if (base.entities.size() < entity_store.next_id.load()) base.entities.resize(entity_store.next_id.load());
+	for (std::size_t i=0; i<ids.size(); ++i) {
+		impl::delta_base_t::entity_state_t &state = base.entities[ids[i]];
+		state.present = true;
+		state.generation = generations[i];
+		state.mask = entity_store.find(ids[i])->component_mask;
+	}
+	for (const std::size_t &id : removed) base.entities[id].present = false;
+	track_families(used);
+	base.tick = change_checkpoint();
+}
+
+void ecs::ecs_apply_delta(std::unique_ptr<std::ifstream> &lbfile) {
+	lbfile->seekg(0, std::ios::end);
+	const std::streamoff size = lbfile->tellg();
+	lbfile->seekg(0, std::ios::beg);
+	std::string bytes(static_cast<std::size_t>(size), '\0');
+	lbfile->read(&bytes[0], size);
+	if (is_gzip(bytes.data(), bytes.size())) bytes = gunzip(bytes.data(), bytes.size());
+	if (!is_delta(bytes.data(), bytes.size())) throw std::runtime_error("The file is not a delta save.");
+
+	parsed_snapshot_t parsed = parse_snapshot(bytes.data(), bytes.size(), true);
+	if (parsed.packed) unpack_sections(parsed, workers());
+	if (save_id == 0 || parsed.save_id != save_id) throw std::runtime_error("The delta follows a different save.");
+	if (parsed.sequence != save_sequence + 1) {
+		throw std::runtime_error("Deltas must be applied in order: expected number " + std::to_string(save_sequence + 1) +
+			", but this is number " + std::to_string(parsed.sequence) + ".");
+	}
+
+	// Everything is checked before the world is touched
+	std::vector<std::size_t> ids;
+	std::vector<std::uint32_t> generations;
+	std::vector<std::bitset<impl::MAX_COMPONENTS>> masks;
+	std::vector<std::size_t> removed;
+	for (const section_t &section : parsed.sections) {
+		impl::snapshot_reader_t body = parsed.body(section);
+		if (section.family == ENTITY_SECTION) {
+			const entity_rows_t rows(body);
+			for (std::size_t i=0; i<rows.ids.size(); ++i) {
+				if (rows.ids[i] == 0) throw std::runtime_error("The snapshot is truncated or corrupt.");
+				ids.push_back(rows.ids[i]);
+				generations.push_back(rows.generation(i));
+				masks.push_back(parsed.mask(rows.mask(i)));
+			}
+		} else if (section.family == REMOVED_SECTION) {
+			body.read_ids(removed, static_cast<std::size_t>(body.read<std::uint64_t>()));
+		} else {
+			parsed.types[parsed.remap[section.family]].make_store()->snapshot_validate(body);
+		}
+	}
+
+	// Work on the stores alone, with nothing pending, as a load does
+	materialise_components();
 	ecs_garbage_collect();
+	if (storage_mode == storage_mode_t::ARCHETYPE) {
+		stores_from_archetypes();
+		archetypes.clear();
+	}
+	const auto drop_components = [this] (const std::size_t id, const std::bitset<impl::MAX_COMPONENTS> &families) {
+		for (std::size_t family_id=0; family_id<component_store.size(); ++family_id) {
+			if (families.test(family_id) && component_store[family_id]) component_store[family_id]->mark_deleted(id);
+		}
+	};
+	for (const std::size_t &id : removed) {
+		entity_t * e = entity_store.find(id);
+		if (!e) continue;
+		drop_components(id, e->component_mask);
+		entity_store.erase(id);
+	}
+	for (std::size_t i=0; i<ids.size(); ++i) {
+		entity_t * e = entity_store.find(ids[i]);
+		if (e && e->generation != generations[i]) {
+			// The ID was recycled: nothing of the old entity survives
+			drop_components(ids[i], e->component_mask);
+			entity_store.erase(ids[i]);
+			e = nullptr;
+		}
+		if (e) {
+			drop_components(ids[i], e->component_mask & ~masks[i]);
+		} else {
+			e = &entity_store.create(ids[i]);
+		}
+		entity_store.slot(ids[i]).generation = generations[i];
+		e->generation = generations[i];
+		e->component_mask = masks[i];
+	}
+	for (const section_t &section : parsed.sections) {
+		if (section.family == ENTITY_SECTION || section.family == REMOVED_SECTION) continue;
+		impl::snapshot_reader_t body = parsed.body(section);
+		const std::size_t family_id = parsed.remap[section.family];
+		if (component_store.size() < family_id+1) component_store.resize(family_id+1);
+		if (!component_store[family_id]) component_store[family_id] = parsed.types[family_id].make_store();
+		component_store[family_id]->snapshot_merge(body);
+	}
+	for (auto &store : component_store) {
+		if (store) store->really_delete();
+	}
+	pending_component_deletes = 0;
+	entity_store.next_id.store(std::max<std::size_t>(entity_store.next_id.load(), static_cast<std::size_t>(parsed.next_id)));
+	save_sequence = parsed.sequence;
+	finish_load();
 }
 
-void ecs::ecs_save(std::unique_ptr<std::ofstream> &lbfile) {
-    cereal::BinaryOutputArchive oarchive(*lbfile);
-    oarchive(*this);
+void ecs::capture_snapshot(impl::snapshot_capture_t &capture, const bool copy_stores) {
+	capture.save_id = save_id;
+	capture.next_id = entity_store.next_id.load();
+	capture.ids.resize(entity_store.size());
+	capture.generations.resize(entity_store.size());
+	capture.masks.resize(entity_store.size());
+	std::size_t count = 0;
+	for (entity_t &e : entity_store) {
+		if (e.deleted) continue;
+		capture.ids[count] = e.id;
+		capture.generations[count] = e.generation;
+		capture.masks[count] = e.component_mask;
+		++count;
+	}
+	capture.ids.resize(count);
+	capture.generations.resize(count);
+	capture.masks.resize(count);
+
+	capture.stores.clear();
+	capture.raw_sections.clear();
+	if (copy_stores && capture.owned.size() < component_store.size()) capture.owned.resize(component_store.size());
+
+	for (std::size_t family_id=0; family_id<component_store.size(); ++family_id) {
+		// A section still waiting in a mapped snapshot is copied across as it is, if the format hasn't changed
+		// (sections are the same from version 2 on)
+		if (mapped && family_id < impl::MAX_COMPONENTS && mapped->sections[family_id].waiting.load()) {
+			if (mapped->version >= 2) {
+				capture.raw_sections.emplace_back(family_id, impl::snapshot_writer_t{});
+				capture.raw_sections.back().second.write_bytes(mapped->sections[family_id].data, mapped->sections[family_id].size);
+				continue;
+			}
+			materialise(family_id);
+		}
+		if (!component_store[family_id]) continue;
+		if (copy_stores) {
+			component_store[family_id]->snapshot_copy(capture.owned[family_id]);
+			capture.stores.emplace_back(family_id, capture.owned[family_id].get());
+		} else {
+			capture.stores.emplace_back(family_id, component_store[family_id].get());
+		}
+	}
+}
+
+void ecs::write_snapshot(std::ostream &out, const bool compress) {
+	impl::snapshot_capture_t capture;
+	capture_snapshot(capture, false);
+	write_capture(capture, out, compress ? &workers() : nullptr);
 }
 
 void ecs::ecs_load(std::unique_ptr<std::ifstream> &lbfile) {
+	char magic[sizeof(SNAPSHOT_MAGIC)] = {};
+	lbfile->read(magic, sizeof(magic));
+	const std::size_t peeked = static_cast<std::size_t>(lbfile->gcount());
+	const bool snapshot = is_snapshot(magic, peeked);
+	const bool compressed = is_gzip(magic, peeked);
+	lbfile->clear();
+	lbfile->seekg(0, std::ios::end);
+	const std::streamoff size = lbfile->tellg();
+	lbfile->seekg(0, std::ios::beg);
+
+	if (snapshot || compressed) {
+		std::string bytes(static_cast<std::size_t>(size), '\0');
+		lbfile->read(&bytes[0], size);
+		if (compressed) {
+			bytes = gunzip(bytes.data(), bytes.size());
+			if (!is_snapshot(bytes.data(), bytes.size())) throw std::runtime_error("The compressed file is not a snapshot.");
+		}
+		read_snapshot(bytes.data(), bytes.size());
+		return;
+	}
+	if (is_delta(magic, peeked)) throw std::runtime_error("The file is a delta save; load the full save it follows, then ecs_apply_delta it.");
+
+	reset_for_load();
+	cereal::BinaryInputArchive iarchive(*lbfile);
+	iarchive(*this);
+	finish_load();
+}
+
+void ecs::ecs_load_mapped(const std::string &path) {
+	std::unique_ptr<mapped_file> file = std::make_unique<mapped_file>(path);
+	if (is_delta(file->data(), file->size())) {
+		throw std::runtime_error(path + " is a delta save; load the full save it follows, then ecs_apply_delta it.");
+	}
+	if (is_gzip(file->data(), file->size())) {
+		// Nothing to map into place; inflate it and load the lot
+		const std::string bytes = gunzip(file->data(), file->size());
+		if (!is_snapshot(bytes.data(), bytes.size())) throw std::runtime_error(path + " is not a snapshot.");
+		read_snapshot(bytes.data(), bytes.size());
+		return;
+	}
+	if (!is_snapshot(file->data(), file->size())) {
+		throw std::runtime_error(path + " is not a snapshot; older saves must be read with ecs_load.");
+	}
+	const char * data = file->data();
+	const std::size_t size = file->size();
+	if (storage_mode == storage_mode_t::ARCHETYPE) {
+		read_snapshot(data, size);
+	} else {
+		read_snapshot(data, size, std::move(file));
+	}
+}
+
+void ecs::materialise_components() {
+	if (!mapped) return;
+	for (std::size_t family_id=0; family_id<impl::MAX_COMPONENTS; ++family_id) materialise(family_id);
+	mapped.reset();
+}
+
+void ecs::materialise_section(const std::size_t family_id) {
+	// The section was checked by read_snapshot and is a raw copy, so only running out of memory fails here. The
+	// section stays waiting if it does, and snapshot_load starts its arrays afresh, so it can simply be tried again.
+	impl::mapped_snapshot_t::section_t &section = mapped->sections[family_id];
+	std::lock_guard<std::mutex> lock(mapped->mutex);
+	if (!section.waiting.load(std::memory_order_relaxed)) return;
+	impl::snapshot_reader_t in = mapped->reader(family_id);
+	section.store->snapshot_load(in);
+	component_store[family_id] = std::move(section.store);
+	section.waiting.store(false, std::memory_order_release);
+}
+
+void ecs::read_snapshot(const char * data, const std::size_t size, std::unique_ptr<mapped_file> lazy_file) {
+	// Everything is checked before the world is touched
+	parsed_snapshot_t parsed = parse_snapshot(data, size, false);
+	if (parsed.packed) unpack_sections(parsed, workers());
+
+	// Stores loaded lazily are made and checked now, so a bad section still fails the load up front. Only raw
+	// sections are left for later; anything saved through cereal could still fail to decode, so it is decoded here.
+	// Compressed sections have nothing to map into place, so load eagerly (lazy_file keeps the mapping until then).
+	const bool lazy = lazy_file && !parsed.packed;
+	std::vector<std::unique_ptr<impl::base_component_store>> lazy_stores(parsed.sections.size());
+	std::vector<bool> decoded(parsed.sections.size(), false);
+	if (lazy) {
+		for (std::size_t i=0; i<parsed.sections.size(); ++i) {
+			if (parsed.sections[i].family == ENTITY_SECTION) continue;
+			lazy_stores[i] = parsed.types[parsed.remap[parsed.sections[i].family]].make_store();
+			impl::snapshot_reader_t body = parsed.body(parsed.sections[i]);
+			if (lazy_stores[i]->snapshot_loads_raw()) {
+				lazy_stores[i]->snapshot_validate(body);
+			} else {
+				lazy_stores[i]->snapshot_load(body);
+				decoded[i] = true;
+			}
+		}
+	}
+
+	reset_for_load();
+	save_id = parsed.save_id;
+	save_sequence = 0;
+	if (lazy) {
+		mapped = std::make_unique<impl::mapped_snapshot_t>();
+		mapped->file = std::move(lazy_file);
+		mapped->version = parsed.version;
+	}
+	std::vector<std::size_t> eager;
+	for (std::size_t i=0; i<parsed.sections.size(); ++i) {
+		const section_t &section = parsed.sections[i];
+		impl::snapshot_reader_t body = parsed.body(section);
+		if (section.family == ENTITY_SECTION) {
+			const entity_rows_t rows(body);
+			for (std::size_t i=0; i<rows.ids.size(); ++i) {
+				entity_t &e = entity_store.create(rows.ids[i]);
+				entity_store.slot(rows.ids[i]).generation = rows.generation(i);
+				e.generation = rows.generation(i);
+				e.component_mask = parsed.mask(rows.mask(i));
+			}
+			continue;
+		}
+		const std::size_t family_id = parsed.remap[section.family];
+		if (component_store.size() < family_id+1) component_store.resize(family_id+1);
+		if (decoded[i]) {
+			component_store[family_id] = std::move(lazy_stores[i]);
+			continue;
+		}
+		if (mapped) {
+			impl::mapped_snapshot_t::section_t &waiting = mapped->sections[family_id];
+			waiting.store = std::move(lazy_stores[i]);
+			waiting.data = body.data;
+			waiting.size = body.size;
+			waiting.waiting.store(true);
+			continue;
+		}
+		component_store[family_id] = parsed.types[family_id].make_store();
+		eager.push_back(i);
+	}
+	// Each store only fills itself, so they load in parallel
+	const auto load_stores = [this, &parsed, &eager] (const std::size_t begin, const std::size_t end) {
+		for (std::size_t i=begin; i<end; ++i) {
+			impl::snapshot_reader_t body = parsed.body(parsed.sections[eager[i]]);
+			component_store[parsed.remap[parsed.sections[eager[i]].family]]->snapshot_load(body);
+		}
+	};
+	if (eager.size() > 1) {
+		workers().parallel_for(eager.size(), 1, load_stores);
+	} else {
+		load_stores(0, eager.size());
+	}
+	entity_store.next_id.store(std::max<std::size_t>(entity_store.next_id.load(), static_cast<std::size_t>(parsed.next_id)));
+	finish_load();
+}
+
+void ecs::reset_for_load() {
+	mapped.reset();
 	entity_store.clear();
 	component_store.clear();
-    cereal::BinaryInputArchive iarchive(*lbfile);
-    iarchive(*this);
-    std::cout << "Loaded " << entity_store.size() << " entities, and " << component_store.size() << " component types.\n";
+	archetypes.clear();
+	change_logs.clear();
+	for (auto &observer : observers) {
+		if (observer) {
+			observer->clear();
+			observer->queued = false;
+		}
+	}
+	dirty_observers.clear();
+	pending_entity_deletes.clear();
+	pending_component_deletes = 0;
+	save_id = 0;
+	save_sequence = 0;
+}
+
+void ecs::finish_load() {
+	// Saves can hold entities and components that were deleted but not yet collected; queue them up again
+	for (auto &store : component_store) {
+		if (store) pending_component_deletes += store->rebuild_index();
+	}
+	for (const entity_t &e : entity_store) {
+		if (e.deleted) pending_entity_deletes.push_back(e.id);
+	}
+	const std::size_t component_types = component_store.size();
+	if (storage_mode == storage_mode_t::ARCHETYPE) {
+		// Give each entity a row in the archetype for the components it actually has, then fill the rows in
+		for (auto &store : component_store) {
+			if (store) store->register_type(archetypes);
+		}
+		for (entity_t &e : entity_store) {
+			if (e.deleted) continue;
+			for (std::size_t family_id=0; family_id<impl::MAX_COMPONENTS; ++family_id) {
+				if (!e.component_mask.test(family_id) || impl::tag_families().test(family_id)) continue;
+				if (family_id >= component_store.size() || !component_store[family_id] || !component_store[family_id]->contains(e.id)) {
+					e.component_mask.reset(family_id);
+				}
+			}
+			if (e.component_mask.any()) archetypes.move(e.id, e.component_mask);
+		}
+		for (auto &store : component_store) {
+			if (store) store->copy_to(archetypes);
+		}
+		component_store.clear();
+		pending_component_deletes = 0;
+	}
+	for (auto &v : views) {
+		if (v) v->rebuild(entity_store);
+	}
+	if (positions) {
+		positions->clear();
+		positions->seed(*positions);
+		change_log(positions->family_id); // The load dropped the change logs; keep noticing mark_changed
+		positions->synced_tick = change_checkpoint();
+	}
+	if (delta_base) rebaseline();
+    std::cout << "Loaded " << entity_store.size() << " entities, and " << component_types << " component types.\n";
+}
+
+void ecs::rebaseline() {
+	impl::delta_base_t &base = *delta_base;
+	base.entities.assign(entity_store.next_id.load(), impl::delta_base_t::entity_state_t{});
+	std::bitset<impl::MAX_COMPONENTS> used;
+	for (entity_t &e : entity_store) {
+		if (e.deleted) continue;
+		impl::delta_base_t::entity_state_t &state = base.entities[e.id];
+		state.present = true;
+		state.generation = e.generation;
+		state.mask = e.component_mask;
+		used |= e.component_mask;
+	}
+	track_families(used);
+	base.tick = change_checkpoint();
+	base.valid = true;
+}
+
+void ecs::track_families(const std::bitset<impl::MAX_COMPONENTS> &families) {
+	for (std::size_t family_id=0; family_id<impl::MAX_COMPONENTS; ++family_id) {
+		if (families.test(family_id) && !impl::tag_families().test(family_id)) change_log(family_id);
+	}
 }
 
 std::string ecs::ecs_profile_dump() {
@@ -95,12 +1205,18 @@ std::string ecs::ecs_profile_dump() {
 	ss.precision(3);
 	ss << std::fixed;
 	ss << "SYSTEMS PERFORMANCE IN MICROSECONDS:\n";
-	ss << std::setw(20) << "System" << std::setw(20) << "Last" << std::setw(20) << "Best" << std::setw(20) << "Worst\n";
+	ss << std::setw(20) << "System" << std::setw(20) << "Last" << std::setw(20) << "Best" << std::setw(20) << "Worst" << std::setw(20) << "Thread\n";
 	for (std::size_t i=0; i<system_profiling.size(); ++i) {
 		ss << std::setw(20) << system_store[i]->system_name 
 			<< std::setw(20) << system_profiling[i].last 
 			<< std::setw(20) << system_profiling[i].best 
-			<< std::setw(20) << system_profiling[i].worst << "\n";
+			<< std::setw(20) << system_profiling[i].worst
+			<< std::setw(19) << system_profiling[i].thread << "\n";
+	}
+	ss << "THREAD TOTALS FOR LAST TICK:\n";
+	for (std::size_t i=0; i<thread_profiling.size(); ++i) {
+		ss << std::setw(20) << (i == 0 ? std::string("Main") : "Worker " + std::to_string(i-1))
+			<< std::setw(20) << thread_profiling[i] << "\n";
 	}
 	return ss.str();
 }
@@ -13,12 +13,27 @@
 #include <sstream>
 #include <iomanip>
 #include <queue>
+#include <deque>
+#include <cstdint>
 #include <future>
 #include <mutex>
 #include <typeinfo>
 #include <atomic>
+#include <array>
+#include <limits>
+#include <new>
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+#include <tuple>
+#include <type_traits>
+#include <utility>
 #include "serialization_utils.hpp"
 #include "xml.hpp"
+#include "thread_pool.hpp"
+#include "mpsc_queue.hpp"
+#include "mapped_file.hpp"
+#include "geometry.hpp"
 #include <cereal/types/polymorphic.hpp>
 #include "ecs_impl.hpp"
 
@@ -36,6 +51,14 @@ namespace rltk {
         return entity(default_ecs, id);
     }
 
+    inline entity_t * entity(ecs &ECS, const entity_handle_t &handle) noexcept {
+        return ECS.entity(handle);
+    }
+
+    inline entity_t * entity(const entity_handle_t &handle) noexcept {
+        return entity(default_ecs, handle);
+    }
+
     inline entity_t * create_entity(ecs &ECS) {
         return ECS.create_entity();
     }
@@ -52,37 +75,147 @@ namespace rltk {
         return create_entity(default_ecs, new_id);
     }
 
-    inline void delete_entity(ecs &ECS, const std::size_t id) noexcept {
+    inline entity_range_t create_entities(ecs &ECS, const std::size_t count) {
+        return ECS.create_entities(count);
+    }
+
+    inline entity_range_t create_entities(const std::size_t count) {
+        return create_entities(default_ecs, count);
+    }
+
+    template <class C>
+    inline void assign_batch(ecs &ECS, const entity_range_t &range, span_t<const C> components) {
+        ECS.assign_batch<C>(range, components);
+    }
+
+    template <class C>
+    inline void assign_batch(const entity_range_t &range, span_t<const C> components) {
+        assign_batch<C>(default_ecs, range, components);
+    }
+
+    template <class C>
+    inline void assign_batch(ecs &ECS, const entity_range_t &range, const C &component) {
+        ECS.assign_batch<C>(range, component);
+    }
+
+    template <class C>
+    inline void assign_batch(const entity_range_t &range, const C &component) {
+        assign_batch<C>(default_ecs, range, component);
+    }
+
+    template <class R>
+    inline R & set_resource(ecs &ECS, R value) {
+        return ECS.set_resource<R>(std::move(value));
+    }
+
+    template <class R>
+    inline R & set_resource(R value) {
+        return set_resource<R>(default_ecs, std::move(value));
+    }
+
+    template <class R>
+    inline R * resource(ecs &ECS) noexcept {
+        return ECS.resource<R>();
+    }
+
+    template <class R>
+    inline R * resource() noexcept {
+        return resource<R>(default_ecs);
+    }
+
+    template <class R>
+    inline void delete_resource(ecs &ECS) noexcept {
+        ECS.delete_resource<R>();
+    }
+
+    template <class R>
+    inline void delete_resource() noexcept {
+        delete_resource<R>(default_ecs);
+    }
+
+    inline prefab_t & define_prefab(ecs &ECS, const std::string &name) {
+        return ECS.define_prefab(name);
+    }
+
+    inline prefab_t & define_prefab(const std::string &name) {
+        return define_prefab(default_ecs, name);
+    }
+
+    inline prefab_t & define_prefab(ecs &ECS, const std::string &name, const prefab_t &prefab) {
+        return ECS.define_prefab(name, prefab);
+    }
+
+    inline prefab_t & define_prefab(const std::string &name, const prefab_t &prefab) {
+        return define_prefab(default_ecs, name, prefab);
+    }
+
+    inline prefab_t * prefab(ecs &ECS, const std::string &name) noexcept {
+        return ECS.prefab(name);
+    }
+
+    inline prefab_t * prefab(const std::string &name) noexcept {
+        return prefab(default_ecs, name);
+    }
+
+    inline void delete_all_prefabs(ecs &ECS) noexcept {
+        ECS.delete_all_prefabs();
+    }
+
+    inline void delete_all_prefabs() noexcept {
+        delete_all_prefabs(default_ecs);
+    }
+
+    template <typename P, typename... Os>
+    inline entity_t * instantiate(ecs &ECS, const P &prefab, Os &&... overrides) {
+        return ECS.instantiate(prefab, std::forward<Os>(overrides)...);
+    }
+
+    template <typename P, typename... Os>
+    inline typename std::enable_if<!std::is_same<typename std::decay<P>::type, ecs>::value, entity_t *>::type instantiate(const P &prefab, Os &&... overrides) {
+        return instantiate(default_ecs, prefab, std::forward<Os>(overrides)...);
+    }
+
+    template <typename P, typename... Os>
+    inline entity_range_t instantiate_batch(ecs &ECS, const P &prefab, const std::size_t count, const Os &... overrides) {
+        return ECS.instantiate_batch(prefab, count, overrides...);
+    }
+
+    template <typename P, typename... Os>
+    inline typename std::enable_if<!std::is_same<typename std::decay<P>::type, ecs>::value, entity_range_t>::type instantiate_batch(const P &prefab, const std::size_t count, const Os &... overrides) {
+        return instantiate_batch(default_ecs, prefab, count, overrides...);
+    }
+
+    inline void delete_entity(ecs &ECS, const std::size_t id) {
         ECS.delete_entity(id);
     }
 
-    inline void delete_entity(const std::size_t id) noexcept {
+    inline void delete_entity(const std::size_t id) {
         delete_entity(default_ecs, id);
     }
 
-    inline void delete_entity(ecs &ECS, entity_t &e) noexcept {
+    inline void delete_entity(ecs &ECS, entity_t &e) {
         ECS.delete_entity(e);
     }
 
-    inline void delete_entity(entity_t &e) noexcept {
+    inline void delete_entity(entity_t &e) {
         delete_entity(default_ecs, e);
     }
 
-    inline void delete_all_entities(ecs &ECS) noexcept {
+    inline void delete_all_entities(ecs &ECS) {
         ECS.delete_all_entities();
     }
 
-    inline void delete_all_entities() noexcept {
+    inline void delete_all_entities() {
         delete_all_entities(default_ecs);
     }
 
     template<class C>
-    inline void delete_component(ecs &ECS, const std::size_t entity_id, bool delete_entity_if_empty=false) noexcept {
+    inline void delete_component(ecs &ECS, const std::size_t entity_id, bool delete_entity_if_empty=false) {
         ECS.delete_component<C>(entity_id, delete_entity_if_empty);
     }
 
     template<class C>
-    inline void delete_component(const std::size_t entity_id, bool delete_entity_if_empty=false) noexcept {
+    inline void delete_component(const std::size_t entity_id, bool delete_entity_if_empty=false) {
         delete_component<C>(default_ecs, entity_id, delete_entity_if_empty);
     }
 
@@ -96,16 +229,36 @@ namespace rltk {
         return entities_with_component<C>(default_ecs);
     }
 
-    template <class C>
-    inline void all_components(ecs &ECS, typename std::function<void(entity_t &, C &)> func) {
+    template <class C, typename F>
+    inline void all_components(ecs &ECS, F func) {
         ECS.all_components<C>(func);
     }
 
-    template <class C>
-    inline void all_components(typename std::function<void(entity_t &, C &)> func) {
+    template <class C, typename F>
+    inline void all_components(F func) {
         all_components<C>(default_ecs, func);
     }
 
+    template <class C, typename F>
+    inline void read_components(ecs &ECS, F func) {
+        ECS.read_components<C>(func);
+    }
+
+    template <class C, typename F>
+    inline void read_components(F func) {
+        read_components<C>(default_ecs, func);
+    }
+
+    template <class C, typename F>
+    inline void each_chunk(ecs &ECS, F func) {
+        ECS.each_chunk<C>(func);
+    }
+
+    template <class C, typename F>
+    inline void each_chunk(F func) {
+        each_chunk<C>(default_ecs, func);
+    }
+
     template <typename... Cs, typename F>
     inline void each(ecs &ECS, F callback) {
         ECS.each<Cs...>(callback);
@@ -126,6 +279,148 @@ namespace rltk {
         each_if<Cs...>(default_ecs, predicate, callback);
     }
 
+    template <typename... Cs>
+    inline view_t<Cs...> view(ecs &ECS) {
+        return ECS.view<Cs...>();
+    }
+
+    template <typename... Cs>
+    inline view_t<Cs...> view() {
+        return view<Cs...>(default_ecs);
+    }
+
+    template <typename... Cs, typename F>
+    inline void parallel_each(ecs &ECS, F callback, const std::size_t grain = impl::DEFAULT_GRAIN) {
+        ECS.parallel_each<Cs...>(callback, grain);
+    }
+
+    template <typename... Cs, typename F>
+    inline void parallel_each(F callback, const std::size_t grain = impl::DEFAULT_GRAIN) {
+        parallel_each<Cs...>(default_ecs, callback, grain);
+    }
+
+    template <class C, typename F>
+    inline void parallel_all_components(ecs &ECS, F func, const std::size_t grain = impl::DEFAULT_GRAIN) {
+        ECS.parallel_all_components<C>(func, grain);
+    }
+
+    template <class C, typename F>
+    inline void parallel_all_components(F func, const std::size_t grain = impl::DEFAULT_GRAIN) {
+        parallel_all_components<C>(default_ecs, func, grain);
+    }
+
+    template <class C, typename F>
+    inline void parallel_each_chunk(ecs &ECS, F func, const std::size_t grain = impl::DEFAULT_GRAIN) {
+        ECS.parallel_each_chunk<C>(func, grain);
+    }
+
+    template <class C, typename F>
+    inline void parallel_each_chunk(F func, const std::size_t grain = impl::DEFAULT_GRAIN) {
+        parallel_each_chunk<C>(default_ecs, func, grain);
+    }
+
+    template <class C, class... Cs, typename F>
+    inline void each_changed(ecs &ECS, const std::size_t since, F func) {
+        ECS.each_changed<C, Cs...>(since, func);
+    }
+
+    template <class C, class... Cs, typename F>
+    inline void each_changed(const std::size_t since, F func) {
+        each_changed<C, Cs...>(default_ecs, since, func);
+    }
+
+    template <class C>
+    inline void mark_changed(ecs &ECS, entity_t &e) {
+        ECS.mark_changed<C>(e);
+    }
+
+    template <class C>
+    inline void mark_changed(entity_t &e) {
+        mark_changed<C>(default_ecs, e);
+    }
+
+    template <class C>
+    inline void track_changes(ecs &ECS) {
+        ECS.track_changes<C>();
+    }
+
+    template <class C>
+    inline void track_changes() {
+        track_changes<C>(default_ecs);
+    }
+
+    template <class C>
+    inline void on_add(ecs &ECS, std::function<void(entity_t &, const C &)> func) {
+        ECS.on_add<C>(func);
+    }
+
+    template <class C>
+    inline void on_add(std::function<void(entity_t &, const C &)> func) {
+        on_add<C>(default_ecs, func);
+    }
+
+    template <class C>
+    inline void on_replace(ecs &ECS, std::function<void(entity_t &, const C &, const C &)> func) {
+        ECS.on_replace<C>(func);
+    }
+
+    template <class C>
+    inline void on_replace(std::function<void(entity_t &, const C &, const C &)> func) {
+        on_replace<C>(default_ecs, func);
+    }
+
+    template <class C>
+    inline void on_remove(ecs &ECS, std::function<void(entity_t &, const C &)> func) {
+        ECS.on_remove<C>(func);
+    }
+
+    template <class C>
+    inline void on_remove(std::function<void(entity_t &, const C &)> func) {
+        on_remove<C>(default_ecs, func);
+    }
+
+    template <class C, class NAV = impl::xy_navigator<C>>
+    inline void index_positions(ecs &ECS, const int cell_size = 8) {
+        ECS.index_positions<C, NAV>(cell_size);
+    }
+
+    template <class C, class NAV = impl::xy_navigator<C>>
+    inline void index_positions(const int cell_size = 8) {
+        index_positions<C, NAV>(default_ecs, cell_size);
+    }
+
+    inline std::vector<entity_t *> entities_at(ecs &ECS, const int x, const int y) {
+        return ECS.entities_at(x, y);
+    }
+
+    inline std::vector<entity_t *> entities_at(const int x, const int y) {
+        return entities_at(default_ecs, x, y);
+    }
+
+    inline std::vector<entity_t *> entities_in_rect(ecs &ECS, const int x1, const int y1, const int x2, const int y2) {
+        return ECS.entities_in_rect(x1, y1, x2, y2);
+    }
+
+    inline std::vector<entity_t *> entities_in_rect(const int x1, const int y1, const int x2, const int y2) {
+        return entities_in_rect(default_ecs, x1, y1, x2, y2);
+    }
+
+    inline std::vector<entity_t *> entities_in_radius(ecs &ECS, const int x, const int y, const float radius) {
+        return ECS.entities_in_radius(x, y, radius);
+    }
+
+    inline std::vector<entity_t *> entities_in_radius(const int x, const int y, const float radius) {
+        return entities_in_radius(default_ecs, x, y, radius);
+    }
+
+    inline command_buffer_t & commands(ecs &ECS) {
+        return ECS.commands();
+    }
+
+    inline command_buffer_t & commands() {
+        return commands(default_ecs);
+    }
+
     inline void ecs_garbage_collect(ecs &ECS) {
         ECS.ecs_garbage_collect();
     }
@@ -188,12 +483,54 @@ namespace rltk {
         ecs_tick(default_ecs, duration_ms);
     }
 
-    inline void ecs_save(ecs &ECS, std::unique_ptr<std::ofstream> &lbfile) {
-        ECS.ecs_save(lbfile);
+    template <typename... Cs>
+    inline void register_components(ecs &ECS) {
+        ECS.register_components<Cs...>();
+    }
+
+    template <typename... Cs>
+    inline void register_components() {
+        register_components<Cs...>(default_ecs);
+    }
+
+    inline void ecs_save(ecs &ECS, std::unique_ptr<std::ofstream> &lbfile, const bool compress = false) {
+        ECS.ecs_save(lbfile, compress);
+    }
+
+    inline void ecs_save(std::unique_ptr<std::ofstream> &lbfile, const bool compress = false) {
+        ecs_save(default_ecs, lbfile, compress);
+    }
+
+    inline std::future<void> ecs_save_async(ecs &ECS, const std::string &path, const bool compress = true) {
+        return ECS.ecs_save_async(path, compress);
     }
 
-    inline void ecs_save(std::unique_ptr<std::ofstream> &lbfile) {
-        ecs_save(default_ecs, lbfile);
+    inline std::future<void> ecs_save_async(const std::string &path, const bool compress = true) {
+        return ecs_save_async(default_ecs, path, compress);
+    }
+
+    inline void enable_delta_saves(ecs &ECS) {
+        ECS.enable_delta_saves();
+    }
+
+    inline void enable_delta_saves() {
+        enable_delta_saves(default_ecs);
+    }
+
+    inline void ecs_save_delta(ecs &ECS, std::unique_ptr<std::ofstream> &lbfile) {
+        ECS.ecs_save_delta(lbfile);
+    }
+
+    inline void ecs_save_delta(std::unique_ptr<std::ofstream> &lbfile) {
+        ecs_save_delta(default_ecs, lbfile);
+    }
+
+    inline void ecs_apply_delta(ecs &ECS, std::unique_ptr<std::ifstream> &lbfile) {
+        ECS.ecs_apply_delta(lbfile);
+    }
+
+    inline void ecs_apply_delta(std::unique_ptr<std::ifstream> &lbfile) {
+        ecs_apply_delta(default_ecs, lbfile);
     }
 
     inline void ecs_load(ecs &ECS, std::unique_ptr<std::ifstream> &lbfile) {
@@ -204,6 +541,22 @@ namespace rltk {
         ecs_load(default_ecs, lbfile);
     }
 
+    inline void ecs_load_mapped(ecs &ECS, const std::string &path) {
+        ECS.ecs_load_mapped(path);
+    }
+
+    inline void ecs_load_mapped(const std::string &path) {
+        ecs_load_mapped(default_ecs, path);
+    }
+
+    inline void materialise_components(ecs &ECS) {
+        ECS.materialise_components();
+    }
+
+    inline void materialise_components() {
+        materialise_components(default_ecs);
+    }
+
     inline std::string ecs_profile_dump(ecs &ECS) {
         return ECS.ecs_profile_dump();
     }
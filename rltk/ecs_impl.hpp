@@ -5,11 +5,13 @@
 #include <cereal/types/unordered_map.hpp>
 #include <cereal/types/bitset.hpp>
 #include <cereal/types/vector.hpp>
+#include <cereal/archives/binary.hpp>
 
 namespace rltk {
 
     // Forward declarations
     class ecs;
+    template <class T> struct span_t;
     struct entity_t;
     struct base_system;
     extern ecs default_ecs;
@@ -20,15 +22,81 @@ namespace rltk {
         inline void assign(ecs &ECS, entity_t &E, C component);
 
         template <class C>
-        inline C * component(ecs &ECS, entity_t &E) noexcept;
+        inline C * component(ecs &ECS, entity_t &E);
+
+        template <class C>
+        inline void mark_changed(ecs &ECS, entity_t &E);
 
         template<class MSG>
         inline void subscribe(ecs &ECS, base_system &B, std::function<void(MSG &message)> destination);
 
+        template<class MSG>
+        inline void subscribe_batch(ecs &ECS, base_system &B, std::function<void(span_t<MSG> messages)> destination);
+
         template<class MSG>
         inline void subscribe_mbox(ecs &ECS, base_system &B);
 
-        inline void unset_component_mask(ecs &ECS, const std::size_t id, const std::size_t family_id, bool delete_if_empty=false);
+        template <class C>
+        inline void component_to_store(ecs &ECS, const std::size_t entity_id, void * component);
+
+    }
+
+    /*
+     * A non-owning view of a contiguous run of T. Batch message handlers receive one of these per delivery.
+     */
+    template <class T>
+    struct span_t {
+        span_t() noexcept {}
+        span_t(T * first, const std::size_t count) noexcept : first(first), count(count) {}
+
+        T * begin() const noexcept { return first; }
+        T * end() const noexcept { return first + count; }
+        T * data() const noexcept { return first; }
+        std::size_t size() const noexcept { return count; }
+        bool empty() const noexcept { return count == 0; }
+        T & operator[](const std::size_t i) const noexcept { return first[i]; }
+
+    private:
+        T * first = nullptr;
+        std::size_t count = 0;
+    };
+
+    /*
+     * A contiguous run of one component type's dense storage, handed out by ecs::each_chunk. components[i] belongs
+     * to entity entity_ids[i]; deleted[i] is non-zero if it has been deleted but not yet garbage collected.
+     */
+    template <class C>
+    struct component_chunk_t {
+        span_t<C> components;
+        span_t<const std::size_t> entity_ids;
+        span_t<const std::uint8_t> deleted;
+
+        std::size_t size() const noexcept { return components.size(); }
+        bool is_deleted(const std::size_t i) const noexcept { return deleted[i] != 0; }
+    };
+
+    /*
+     * Opt-in structure-of-arrays storage. Specialise soa_layout (most easily with RLTK_SOA_LAYOUT, at global scope)
+     * for a trivially copyable component, listing every data member, and its store keeps one array per member
+     * instead of one array of C:
+     *
+     *     RLTK_SOA_LAYOUT(position, &position::x, &position::y)
+     *
+     * each_chunk<position> then hands out soa_chunk_t<position>, whose field<0>() is every x and field<1>() every
+     * y, so numeric loops can run SIMD over them. Deleted flags are kept in a bitset.
+     *
+     * There is no C object in the store to point at, so entity_t::component<C>() does not compile for such a type.
+     * each, each_if, views, all_components and their parallel forms hand callbacks a C gathered from the arrays,
+     * and write it back when the callback returns.
+     */
+    template <class C>
+    struct soa_layout {
+        static constexpr bool enabled = false;
+    };
+
+    namespace impl {
+        template <class C, bool SOA = soa_layout<C>::enabled>
+        struct component_ref_t;
     }
 
     /*
@@ -43,6 +111,7 @@ namespace rltk {
         double last = 0.0;
         double best = 1000000.0;
         double worst = 0.0;
+        std::size_t thread = 0; // Thread that last ran the system: 0 is the ticking thread, n is pool worker n-1
     };
 
     struct base_system;
@@ -126,6 +195,59 @@ namespace rltk {
             }
         };
 
+        /*
+         * Tag components. An empty type (struct player_t {};) carries no data, so an entity's tags are kept only
+         * as bits in its component_mask: no store, no archetype column, and component<C>() hands back a shared
+         * instance. tag_families() holds the family IDs of every tag type seen so far, for the type-erased paths.
+         */
+        template <class C>
+        struct is_tag : std::integral_constant<bool, std::is_empty<C>::value && !soa_layout<C>::enabled> {};
+
+        inline std::bitset<MAX_COMPONENTS> & tag_families() noexcept {
+            static std::bitset<MAX_COMPONENTS> tags;
+            return tags;
+        }
+
+        template <class C>
+        inline C & tag_instance() noexcept {
+            static C instance;
+            return instance;
+        }
+
+        inline std::size_t new_component_family(const bool tag) noexcept {
+            const std::size_t family_id = base_component_t::type_counter++;
+            if (tag && family_id < MAX_COMPONENTS) tag_families().set(family_id);
+            return family_id;
+        }
+
+        /*
+         * Family IDs. Each component type is given a unique ID (its bit in component_mask and its slot in
+         * ecs::component_store) the first time any code asks for it. The ID lives in a function-local static,
+         * so looking it up never constructs a component - and it is fixed for the life of the program.
+         */
+        template<class C>
+        struct component_family {
+            static inline std::size_t id() noexcept {
+                static const std::size_t family_id = new_component_family(is_tag<C>::value);
+                return family_id;
+            }
+        };
+
+        /*
+         * The component_mask bits for a set of component types, computed once per type list. An entity has
+         * all of Cs if (mask & required_mask<Cs...>()) == required_mask<Cs...>().
+         */
+        template<class... Cs>
+        inline const std::bitset<MAX_COMPONENTS> & required_mask() {
+            static const std::bitset<MAX_COMPONENTS> mask = [] () {
+                std::bitset<MAX_COMPONENTS> result;
+                const std::size_t family_ids[] = { std::size_t(0), component_family<Cs>::id()... };
+                for (std::size_t i=1; i<sizeof(family_ids)/sizeof(family_ids[0]); ++i) result.set(family_ids[i]);
+                return result;
+            }();
+            return mask;
+        }
+
         /*
          * component_t is a handle class for components. It inherits from base_component, allowing
          * the component store to have vectors of base_component_t *, where each type is a concrete
@@ -135,6 +257,8 @@ namespace rltk {
          */
         template<class C>
         struct component_t : public base_component_t {
+            typedef C data_type;
+
             component_t() {
                 data = C{};
                 family();
@@ -152,8 +276,7 @@ namespace rltk {
             }
 
             inline void family() {
-                static std::size_t family_id_tmp = base_component_t::type_counter++;
-                family_id = family_id_tmp;
+                family_id = component_family<C>::id();
             }
 
             inline std::string xml_identity() {
@@ -168,304 +291,2481 @@ namespace rltk {
             }
         };
 
-        /*
-         * Base class for the component store. Concrete component stores derive from this.
-         */
-        struct base_component_store {
-            virtual void erase_by_entity_id(ecs &ECS, const std::size_t &id)=0;
-            virtual void really_delete()=0;
-            virtual void save(xml_node * xml)=0;
-            virtual std::size_t size()=0;
-
-            template<class Archive>
-            void serialize(Archive & archive)
-            {
-            }
-        };
+        struct archetype_storage_t;
 
         /*
-         * Component stores are just a vector of type C (the component). They inherit from
-         * base_component_store, to allow for a vector of base_component_store*, with each
-         * casting to a concrete vector of that type. The types are indexed by the family_id
-         * created for a type with component_t<C>. This guarantees that each component type
-         * is stored in a big contiguous vector, with only one de-reference required to find
-         * the right store.
+         * Byte buffers for the native snapshot format (see ecs::ecs_save). Values are written in the host's byte
+         * order: snapshots are save games for the same platform, not an interchange format.
+         *
+         * Version 2 pads each section to a 64-byte boundary in the file, and each raw value block to a 16-byte
+         * boundary in its section, so a mapped snapshot's arrays can be read in place (see ecs::ecs_load_mapped).
+         * Version 1 snapshots, which are unpadded, still load.
+         *
+         * Version 3 lets a section be stored zlib-compressed, as independently compressed chunks of
+         * SNAPSHOT_CHUNK_SIZE bytes, so a save can be packed and unpacked in parallel; the section table records
+         * each section's packed size alongside its size. The sections themselves are unchanged.
          */
-        template<class C>
-        struct component_store_t : public base_component_store {
-            std::vector<C> components;
+        constexpr std::uint32_t SNAPSHOT_VERSION = 3;
+        constexpr std::size_t SNAPSHOT_SECTION_ALIGNMENT = 64;
+        constexpr std::size_t SNAPSHOT_VALUE_ALIGNMENT = 16;
+        constexpr std::size_t SNAPSHOT_CHUNK_SIZE = std::size_t(1) << 20;
 
-            virtual void erase_by_entity_id(ecs &ECS, const std::size_t &id) override final {
-                for (auto &item : components) {
-                    if (item.entity_id == id) {
-                        item.deleted=true;
-                        impl::unset_component_mask(ECS, id, item.family_id);
-                    }
-                }
-            }
+        struct snapshot_writer_t {
+            std::string bytes;
 
-            virtual void really_delete() override final {
-                components.erase(std::remove_if(components.begin(), components.end(),
-                                                [] (auto x) { return x.deleted; }),
-                                 components.end());
+            inline void write_bytes(const void * data, const std::size_t size) {
+                bytes.append(static_cast<const char *>(data), size);
             }
 
-            virtual void save(xml_node * xml) override final {
-                for (auto &item : components) {
-                    xml_node * body = xml->add_node(item.xml_identity());
-                    item.to_xml(body);
-                    body->add_value("entity_id", rltk::serial::to_string(item.entity_id));
-                }
+            template <class T>
+            inline void write(const T &value) {
+                static_assert(std::is_trivially_copyable<T>::value, "Only trivially copyable values are written raw");
+                write_bytes(&value, sizeof(T));
             }
 
-            virtual std::size_t size() override final {
-                return components.size();
+            inline void write_string(const std::string &text) {
+                write<std::uint32_t>(static_cast<std::uint32_t>(text.size()));
+                write_bytes(text.data(), text.size());
             }
 
-            template<class Archive>
-            void serialize(Archive & archive)
-            {
-                archive( cereal::base_class<base_component_store>(this), components ); // serialize things by passing them to the archive
+            /* Pads with zeroes up to the next multiple of alignment, counted from the start of the buffer */
+            inline void align(const std::size_t alignment) {
+                bytes.append((alignment - bytes.size() % alignment) % alignment, '\0');
             }
 
+            /* Entity IDs are always written as 64-bit values */
+            inline void write_ids(const std::size_t * ids, const std::size_t count) {
+                if (sizeof(std::size_t) == sizeof(std::uint64_t)) {
+                    write_bytes(ids, count * sizeof(std::size_t));
+                } else {
+                    for (std::size_t i=0; i<count; ++i) write<std::uint64_t>(ids[i]);
+                }
+            }
         };
 
-        /*
-         * Handle class for messages
-         */
-        template<class C>
-        struct message_t : public base_message_t {
-            message_t() {
-                C empty;
-                data = empty;
-                family();
-            }
-            message_t(C comp) : data(comp) {
-                family();
+        struct snapshot_reader_t {
+            const char * data;
+            std::size_t size;
+            std::size_t position = 0;
+            std::uint32_t version = SNAPSHOT_VERSION;
+
+            snapshot_reader_t(const char * bytes, const std::size_t length) noexcept : data(bytes), size(length) {}
+
+            /* Skips the padding snapshot_writer_t::align wrote; version 1 snapshots have none */
+            inline void align(const std::size_t alignment) {
+                if (version < 2) return;
+                take((alignment - position % alignment) % alignment);
             }
-            std::size_t family_id;
-            C data;
 
-            inline void family() {
-                static std::size_t family_id_tmp = base_message_t::type_counter++;
-                family_id = family_id_tmp;
+            /* Returns the next count bytes, and moves past them */
+            inline const char * take(const std::size_t count) {
+                if (count > size - position) throw std::runtime_error("The snapshot is truncated or corrupt.");
+                const char * result = data + position;
+                position += count;
+                return result;
             }
-        };
 
-        /*
-         * Base class for storing subscriptions to messages
-         */
-        struct subscription_base_t {
-            virtual void deliver_messages()=0;
-        };
+            inline void read_bytes(void * destination, const std::size_t count) {
+                if (count > 0) std::memcpy(destination, take(count), count);
+            }
 
-        /* Base class for subscription mailboxes */
-        struct subscription_mailbox_t {
-        };
+            template <class T>
+            inline T read() {
+                T value;
+                read_bytes(&value, sizeof(T));
+                return value;
+            }
 
-        /* Implementation class for mailbox subscriptions; stores a queue */
-        template <class C>
-        struct mailbox_t : subscription_mailbox_t {
-            std::queue<C> messages;
-        };
+            inline std::string read_string() {
+                const std::uint32_t length = read<std::uint32_t>();
+                return std::string(take(length), length);
+            }
 
-        /*
-         * Class that holds subscriptions, and determines delivery mechanism.
-         */
-        template <class C>
-        struct subscription_holder_t : subscription_base_t {
-            std::queue<C> delivery_queue;
-            std::mutex delivery_mutex;
-            std::vector<std::tuple<bool,std::function<void(C& message)>,base_system *>> subscriptions;
+            /* Moves past count IDs without reading them, and returns where they start */
+            inline const char * skip_ids(const std::size_t count) {
+                if (count > (size - position) / sizeof(std::uint64_t)) throw std::runtime_error("The snapshot is truncated or corrupt.");
+                return take(count * sizeof(std::uint64_t));
+            }
 
-            virtual void deliver_messages() override {
-                std::lock_guard<std::mutex> guard(delivery_mutex);
-                while (!delivery_queue.empty()) {
-                    C message = delivery_queue.front();
-                    delivery_queue.pop();
-                    message_t<C> handle(message);
-
-                    for (auto &func : subscriptions) {
-                        if (std::get<0>(func) && std::get<1>(func)) {
-                            std::get<1>(func)(message);
-                        } else {
-                            // It is destined for the system's mailbox queue.
-                            auto finder = std::get<2>(func)->mailboxes.find(handle.family_id);
-                            if (finder != std::get<2>(func)->mailboxes.end()) {
-                                static_cast<mailbox_t<C> *>(finder->second.get())->messages.push(message);
-                            }
-                        }
-                    }
+            inline void read_ids(std::vector<std::size_t> &ids, const std::size_t count) {
+                if (count > (size - position) / sizeof(std::uint64_t)) throw std::runtime_error("The snapshot is truncated or corrupt.");
+                ids.resize(count);
+                if (sizeof(std::size_t) == sizeof(std::uint64_t)) {
+                    read_bytes(ids.data(), count * sizeof(std::size_t));
+                } else {
+                    for (std::size_t i=0; i<count; ++i) ids[i] = static_cast<std::size_t>(read<std::uint64_t>());
                 }
             }
         };
 
-    } // End impl namespace
-
-    /*
-     * All entities are of type entity_t. They should be created with create_entity (below).
-     */
-    struct entity_t {
-
         /*
-         * Default constructor - use the next available entity id #.
+         * Writes count values as one block: a straight byte copy for trivially copyable types, and through the
+         * type's cereal serialize otherwise. The element size is recorded, so a changed layout is caught on load.
          */
-        entity_t() {
-            ++entity_t::entity_counter;
-            id = entity_t::entity_counter;
+        template <class T>
+        inline void write_snapshot_values(snapshot_writer_t &out, const T * values, const std::size_t count) {
+            if (std::is_trivially_copyable<T>::value) {
+                out.write<std::uint32_t>(static_cast<std::uint32_t>(sizeof(T)));
+                out.align(SNAPSHOT_VALUE_ALIGNMENT);
+                out.write_bytes(values, count * sizeof(T));
+                return;
+            }
+            out.write<std::uint32_t>(0);
+            std::ostringstream stream(std::ios::binary);
+            {
+                cereal::BinaryOutputArchive archive(stream);
+                for (std::size_t i=0; i<count; ++i) archive(const_cast<T &>(values[i]));
+            }
+            const std::string bytes = stream.str();
+            out.write<std::uint64_t>(bytes.size());
+            out.write_bytes(bytes.data(), bytes.size());
         }
 
         /*
-         * Construct with a specified entity #. Moves the next available entity # to this id+1.
+         * Moves past a block written by write_snapshot_values, checking it was written for T, and returns the
+         * block's bytes: count raw values if T is trivially copyable, cereal output (length bytes) otherwise.
          */
-        entity_t(const std::size_t ID) {
-            entity_t::entity_counter = ID+1;
-            id = ID;
+        template <class T>
+        inline const char * skip_snapshot_values(snapshot_reader_t &in, const std::size_t count, std::size_t &length) {
+            const std::uint32_t element_size = in.read<std::uint32_t>();
+            if (element_size != (std::is_trivially_copyable<T>::value ? sizeof(T) : 0)) {
+                throw std::runtime_error("A component's layout has changed since the snapshot was saved.");
+            }
+            if (element_size == 0) {
+                const std::uint64_t serialized = in.read<std::uint64_t>();
+                if (serialized > in.size - in.position) throw std::runtime_error("The snapshot is truncated or corrupt.");
+                length = static_cast<std::size_t>(serialized);
+            } else {
+                in.align(SNAPSHOT_VALUE_ALIGNMENT);
+                if (count > (in.size - in.position) / sizeof(T)) throw std::runtime_error("The snapshot is truncated or corrupt.");
+                length = count * sizeof(T);
+            }
+            return in.take(length);
         }
 
-        /*
-         * Static ID counter - used to ensure that entity IDs are unique. This would need to be atomic
-         * in a threaded app.
-         */
-        static std::size_t entity_counter;
+        template <class T>
+        inline void read_snapshot_values(snapshot_reader_t &in, std::vector<T> &values, const std::size_t count) {
+            std::size_t length;
+            const char * block = skip_snapshot_values<T>(in, count, length);
+            values.clear();
+            values.resize(count);
+            if (std::is_trivially_copyable<T>::value) {
+                if (length > 0) std::memcpy(static_cast<void *>(values.data()), block, length);
+                return;
+            }
+            std::istringstream stream(std::string(block, length), std::ios::binary);
+            cereal::BinaryInputArchive archive(stream);
+            for (std::size_t i=0; i<count; ++i) archive(values[i]);
+        }
 
         /*
-         * The entities ID number. Used to identify the entity. These should be unique.
+         * Base class for the component store. Concrete component stores derive from this.
          */
-        std::size_t id;
+        struct base_component_store {
+            virtual ~base_component_store() {}
+            virtual bool mark_deleted(const std::size_t &id)=0;
+            virtual void reserve(const std::size_t additional)=0;
+            virtual void really_delete()=0;
+            virtual std::size_t rebuild_index()=0; // Returns how many deleted components it queued for garbage collection
+            virtual void save(xml_node * xml)=0;
+            virtual std::size_t size()=0;
 
-        /*
-         * Overload == and != to allow entities to be compared for likeness.
-         */
-        bool operator == (const entity_t &other) const { return other.id == id; }
-        bool operator != (const entity_t &other) const { return other.id != id; }
+            // Used to move loaded components into archetype storage (see ecs::ecs_load)
+            virtual bool contains(const std::size_t entity_id)=0;
+            virtual void register_type(archetype_storage_t &storage)=0;
+            virtual void copy_to(archetype_storage_t &storage)=0;
 
-        bool deleted = false;
+            // Native snapshot section: the live components, with their entity IDs (see ecs::ecs_save)
+            virtual void snapshot_save(snapshot_writer_t &out)=0;
+            virtual void snapshot_load(snapshot_reader_t &in)=0;
+            // Walks a section as snapshot_load would, throwing on the same errors, without copying anything
+            virtual void snapshot_validate(snapshot_reader_t &in)=0;
+            // True if snapshot_load is a byte copy of what snapshot_validate checks, so only memory can run out
+            virtual bool snapshot_loads_raw()=0;
+            // Copies the dense arrays into copy (making it if null), enough to snapshot_save from on another thread
+            virtual void snapshot_copy(std::unique_ptr<base_component_store> &copy)=0;
+            // Delta sections (see ecs::ecs_save_delta): the live components of just the listed entities, in the
+            // snapshot_save format, and loading one over the top of what is already stored
+            virtual void snapshot_save_entities(snapshot_writer_t &out, const std::vector<std::size_t> &ids)=0;
+            virtual void snapshot_merge(snapshot_reader_t &in)=0;
+
+            template<class Archive>
+            void serialize(Archive & archive)
+            {
+            }
+        };
 
         /*
-         * A bitset storing whether or not an entity has each component type. These are set with the family_id
-         * determined in the component_t system above.
+         * Marker for "no dense slot" in a sparse_index_t.
          */
-        std::bitset<impl::MAX_COMPONENTS> component_mask;
+        constexpr std::size_t NO_INDEX = std::numeric_limits<std::size_t>::max();
 
         /*
-         * Assign a component to this entity. Determines the family_id of the component type, sets the bitmask to
-         * include the component, marks the component as belonging to the entity, and puts it in the appropriate
-         * component store.
+         * Paged sparse array, mapping entity IDs to a position in a dense component vector. Pages
+         * are only allocated when an ID in their range is used, so high or scattered entity IDs
+         * don't require a full-sized array.
          */
-        template<class C>
-        inline entity_t * assign(ecs &ECS, C component) {
-            if (deleted) throw std::runtime_error("Cannot assign to a deleted entity");
-            impl::assign<C>(ECS, *this, component);
-            return this;
-        }
+        struct sparse_index_t {
+            static constexpr std::size_t PAGE_SHIFT = 12;
+            static constexpr std::size_t PAGE_SIZE = std::size_t(1) << PAGE_SHIFT;
+            std::vector<std::unique_ptr<std::size_t[]>> pages;
 
-        template<class C>
-        inline entity_t * assign(C component) {
-            return assign<C>(default_ecs, component);
-        }
+            inline std::size_t get(const std::size_t id) const noexcept {
+                const std::size_t page = id >> PAGE_SHIFT;
+                if (page >= pages.size() || !pages[page]) return NO_INDEX;
+                return pages[page][id & (PAGE_SIZE-1)];
+            }
+
+            inline void set(const std::size_t id, const std::size_t index) {
+                const std::size_t page = id >> PAGE_SHIFT;
+                if (page >= pages.size()) pages.resize(page+1);
+                if (!pages[page]) {
+                    pages[page] = std::unique_ptr<std::size_t[]>(new std::size_t[PAGE_SIZE]);
+                    std::fill(pages[page].get(), pages[page].get() + PAGE_SIZE, NO_INDEX);
+                }
+                pages[page][id & (PAGE_SIZE-1)] = index;
+            }
+
+            /* Maps the count IDs from first_id to first_index onwards; the page list grows once, a page at a time */
+            inline void set_range(const std::size_t first_id, const std::size_t count, const std::size_t first_index) {
+                if (count == 0) return;
+                const std::size_t last_page = (first_id + count - 1) >> PAGE_SHIFT;
+                if (last_page >= pages.size()) pages.resize(last_page+1);
+                for (std::size_t i=0; i<count;) {
+                    const std::size_t page = (first_id + i) >> PAGE_SHIFT;
+                    if (!pages[page]) {
+                        pages[page] = std::unique_ptr<std::size_t[]>(new std::size_t[PAGE_SIZE]);
+                        std::fill(pages[page].get(), pages[page].get() + PAGE_SIZE, NO_INDEX);
+                    }
+                    const std::size_t offset = (first_id + i) & (PAGE_SIZE-1);
+                    const std::size_t run = std::min(count - i, PAGE_SIZE - offset);
+                    std::size_t * target = pages[page].get() + offset;
+                    for (std::size_t j=0; j<run; ++j) target[j] = first_index + i + j;
+                    i += run;
+                }
+            }
+
+            inline void reset(const std::size_t id) noexcept {
+                const std::size_t page = id >> PAGE_SHIFT;
+                if (page < pages.size() && pages[page]) pages[page][id & (PAGE_SIZE-1)] = NO_INDEX;
+            }
+
+            inline void clear() noexcept {
+                pages.clear();
+            }
+        };
 
         /*
-         * Find a component of the specified type that belongs to the entity.
+         * What archetype storage needs to know about a component type, to move and destroy values it only knows
+         * as raw memory.
          */
-        template <class C>
-        inline C * component(ecs &ECS) noexcept {
-            return impl::component<C>(ECS, *this);
-        }
+        struct component_type_info_t {
+            std::size_t family_id;
+            std::size_t size;
+            std::size_t align;
+            void (*relocate)(void * destination, void * source); // Move-constructs destination, then destroys source
+            void (*destroy)(void * component);
+            void (*to_store)(ecs &ECS, const std::size_t entity_id, void * component); // Copies into the ECS's store for C
+        };
 
         template <class C>
-        inline C * component() noexcept {
-            return component<C>(default_ecs);
+        inline const component_type_info_t * component_type_info() {
+            static_assert(alignof(C) <= alignof(std::max_align_t), "Over-aligned components are not supported in archetype storage");
+            static const component_type_info_t info{
+                component_family<C>::id(), sizeof(C), alignof(C),
+                [] (void * destination, void * source) {
+                    C * from = static_cast<C *>(source);
+                    new (destination) C(std::move(*from));
+                    from->~C();
+                },
+                [] (void * component) { static_cast<C *>(component)->~C(); },
+                &component_to_store<C>
+            };
+            return &info;
         }
 
-        template<class Archive>
-        void serialize(Archive & archive)
-        {
-            archive( component_mask, id, deleted ); // serialize things by passing them to the archive
-        }
-    };
+        /* Target size of an archetype chunk; the number of entities per chunk is worked out from the row size */
+        constexpr std::size_t ARCHETYPE_CHUNK_BYTES = 16 * 1024;
+        constexpr std::uint8_t NO_COLUMN = 0xFF;
 
-    /*
-     * Systems should inherit from this class.
-     */
-    struct base_system {
-        virtual void configure() {}
-        virtual void update(const double duration_ms)=0;
-        std::string system_name = "Unnamed System";
-        std::unordered_map<std::size_t, std::unique_ptr<impl::subscription_mailbox_t>> mailboxes;
+        /*
+         * All entities with one exact component mask. Rows are spread over chunks of capacity entities; each chunk is
+         * a single allocation holding the entity IDs, one array per component type, and a stale flag per row (set
+         * when the entity has been deleted or lost a component, and is waiting to move out). Rows are kept packed:
+         * removing one moves the last row into the hole.
+         */
+        struct archetype_t {
+            struct chunk_t {
+                std::unique_ptr<unsigned char[]> memory;
+                std::size_t count = 0;
+            };
 
-        template<class MSG>
-        void subscribe(ecs &ECS, std::function<void(MSG &message)> destination) {
-            impl::subscribe<MSG>(ECS, *this, destination);
-        }
+            std::bitset<MAX_COMPONENTS> mask;
+            std::vector<const component_type_info_t *> columns;
+            std::vector<std::size_t> offsets;
+            std::array<std::uint8_t, MAX_COMPONENTS> column_of;
+            std::size_t capacity = 1;
+            std::size_t chunk_bytes = 0;
+            std::size_t stale_offset = 0;
+            std::size_t size = 0;
+            std::vector<chunk_t> chunks;
 
-        template<class MSG>
-        void subscribe(std::function<void(MSG &message)> destination) {
-            subscribe<MSG>(default_ecs, destination);
-        }
+            archetype_t(const std::bitset<MAX_COMPONENTS> &component_mask, const std::vector<const component_type_info_t *> &types) : mask(component_mask) {
+                column_of.fill(NO_COLUMN);
+                std::size_t row_bytes = sizeof(std::size_t) + 1;
+                for (std::size_t family_id=0; family_id<MAX_COMPONENTS; ++family_id) {
+                    if (!mask.test(family_id) || tag_families().test(family_id)) continue; // Tags have no column
+                    column_of[family_id] = static_cast<std::uint8_t>(columns.size());
+                    columns.push_back(types[family_id]);
+                    row_bytes += types[family_id]->size;
+                }
+                capacity = std::max(std::size_t(1), ARCHETYPE_CHUNK_BYTES / row_bytes);
+                std::size_t cursor = capacity * sizeof(std::size_t);
+                for (const component_type_info_t * type : columns) {
+                    cursor = (cursor + type->align - 1) / type->align * type->align;
+                    offsets.push_back(cursor);
+                    cursor += capacity * type->size;
+                }
+                stale_offset = cursor;
+                chunk_bytes = cursor + capacity;
+            }
 
-        template<class MSG>
-        void subscribe_mbox(ecs &ECS) {
-            impl::subscribe_mbox<MSG>(ECS, *this);
-        }
+            ~archetype_t() {
+                for (std::size_t row=0; row<size; ++row) {
+                    for (std::size_t c=0; c<columns.size(); ++c) columns[c]->destroy(at(row, c));
+                }
+            }
 
-        template<class MSG>
-        void subscribe_mbox() {
-            subscribe_mbox<MSG>(default_ecs);
-        }
+            archetype_t(const archetype_t &) = delete;
+            archetype_t & operator=(const archetype_t &) = delete;
 
-        template<class MSG>
-        std::queue<MSG> * mbox() {
-            impl::message_t<MSG> handle(MSG{});
-            auto finder = mailboxes.find(handle.family_id);
-            if (finder != mailboxes.end()) {
-                return &static_cast<impl::mailbox_t<MSG> *>(finder->second.get())->messages;
-            } else {
-                return nullptr;
+            inline std::size_t * ids(const chunk_t &chunk) const noexcept {
+                return reinterpret_cast<std::size_t *>(chunk.memory.get());
             }
-        }
 
-        template<class MSG>
-        void each_mbox(const std::function<void(const MSG&)> &func) {
-            std::queue<MSG> * mailbox = mbox<MSG>();
-            while (!mailbox->empty()) {
-                MSG msg = mailbox->front();
-                mailbox->pop();
-                func(msg);
+            inline std::uint8_t * stale(const chunk_t &chunk) const noexcept {
+                return chunk.memory.get() + stale_offset;
             }
-        }
-    };
 
-    /* A pre-implemented simple system for systems that only handle messages. */
-    template <class MSG>
-    struct mailbox_system : public base_system {
-        virtual void configure() override final {
-            subscribe_mbox<MSG>();
-        }
+            template <class C>
+            inline C * column(const chunk_t &chunk, const std::size_t c) const noexcept {
+                return reinterpret_cast<C *>(chunk.memory.get() + offsets[c]);
+            }
 
-        virtual void update(const double duration_ms) override final {
-            std::queue<MSG> * mailbox = base_system::mbox<MSG>();
-            while (!mailbox->empty()) {
-                MSG msg = mailbox->front();
-                mailbox->pop();
-                on_message(msg);
+            inline void * at(const std::size_t row, const std::size_t c) const noexcept {
+                return chunks[row / capacity].memory.get() + offsets[c] + (row % capacity) * columns[c]->size;
             }
-        }
 
-        virtual void on_message(const MSG &msg)=0;
-    };
+            inline std::size_t & id_at(const std::size_t row) noexcept {
+                return ids(chunks[row / capacity])[row % capacity];
+            }
+
+            inline std::uint8_t & stale_at(const std::size_t row) noexcept {
+                return stale(chunks[row / capacity])[row % capacity];
+            }
+
+            /* Adds a row for entity_id and returns it. The component columns are left unconstructed. */
+            inline std::size_t push(const std::size_t entity_id) {
+                if (size == chunks.size() * capacity) {
+                    chunks.emplace_back();
+                    chunks.back().memory.reset(new unsigned char[chunk_bytes]);
+                }
+                const std::size_t row = size++;
+                ++chunks.back().count;
+                id_at(row) = entity_id;
+                stale_at(row) = 0;
+                return row;
+            }
+
+            /*
+             * Removes a row whose components have already been moved out or destroyed, moving the last row into the
+             * hole. Returns the ID of the entity that moved (or NO_INDEX if none did).
+             */
+            inline std::size_t erase(const std::size_t row) {
+                const std::size_t last = size - 1;
+                std::size_t moved = NO_INDEX;
+                if (row != last) {
+                    for (std::size_t c=0; c<columns.size(); ++c) columns[c]->relocate(at(row, c), at(last, c));
+                    moved = id_at(last);
+                    id_at(row) = moved;
+                    stale_at(row) = stale_at(last);
+                }
+                --size;
+                if (--chunks.back().count == 0) chunks.pop_back();
+                return moved;
+            }
+        };
+
+        template <class C>
+        inline void register_snapshot_type();
+
+        /*
+         * The component data of an ecs in ARCHETYPE mode: the archetypes, which archetype and row holds each entity,
+         * and the type information for every component type it has seen.
+         */
+        struct archetype_storage_t {
+            std::vector<std::unique_ptr<archetype_t>> archetypes;
+            std::unordered_map<std::bitset<MAX_COMPONENTS>, std::size_t> by_mask;
+            sparse_index_t archetype_of;
+            sparse_index_t row_of;
+            std::vector<const component_type_info_t *> types;
+            std::atomic<int> iterating{0}; // Atomic, as systems in a parallel wave can walk the archetypes at once
+            std::vector<std::size_t> pending; // Entities whose move was held back by iteration
+
+            template <class C>
+            inline void register_type() {
+                const std::size_t family_id = component_family<C>::id();
+                if (types.size() < family_id+1) types.resize(family_id+1, nullptr);
+                if (!types[family_id]) {
+                    types[family_id] = component_type_info<C>();
+                    register_snapshot_type<C>();
+                }
+            }
+
+            inline std::size_t get_or_create(const std::bitset<MAX_COMPONENTS> &mask) {
+                auto finder = by_mask.find(mask);
+                if (finder != by_mask.end()) return finder->second;
+                const std::size_t index = archetypes.size();
+                archetypes.push_back(std::make_unique<archetype_t>(mask, types));
+                by_mask[mask] = index;
+                return index;
+            }
+
+            /* The archetype holding an entity, or nullptr if it has no components stored */
+            inline archetype_t * archetype(const std::size_t entity_id) const noexcept {
+                const std::size_t index = archetype_of.get(entity_id);
+                return index == NO_INDEX ? nullptr : archetypes[index].get();
+            }
+
+            template <class C>
+            inline C * find(const std::size_t entity_id) const noexcept {
+                if (is_tag<C>::value) return archetype(entity_id) ? &tag_instance<C>() : nullptr;
+                return static_cast<C *>(locate(entity_id, component_family<C>::id()));
+            }
+
+            /*
+             * Moves an entity's components to the archetype for mask: components it keeps are relocated, those it
+             * loses are destroyed. Columns new to the entity are left unconstructed, for the caller to fill. Returns
+             * the new row (NO_INDEX if mask is empty).
+             */
+            inline std::size_t move(const std::size_t entity_id, const std::bitset<MAX_COMPONENTS> &mask) {
+                archetype_t * source = archetype(entity_id);
+                if (source && source->mask == mask) {
+                    const std::size_t row = row_of.get(entity_id);
+                    source->stale_at(row) = 0;
+                    return row;
+                }
+                archetype_t * destination = nullptr;
+                std::size_t destination_index = NO_INDEX;
+                std::size_t destination_row = NO_INDEX;
+                if (mask.any()) {
+                    destination_index = get_or_create(mask);
+                    destination = archetypes[destination_index].get();
+                    destination_row = destination->push(entity_id);
+                }
+                if (source) {
+                    const std::size_t source_row = row_of.get(entity_id);
+                    for (std::size_t c=0; c<source->columns.size(); ++c) {
+                        const component_type_info_t * type = source->columns[c];
+                        const std::uint8_t target = destination ? destination->column_of[type->family_id] : NO_COLUMN;
+                        if (target != NO_COLUMN) {
+                            type->relocate(destination->at(destination_row, target), source->at(source_row, c));
+                        } else {
+                            type->destroy(source->at(source_row, c));
+                        }
+                    }
+                    const std::size_t moved = source->erase(source_row);
+                    if (moved != NO_INDEX) row_of.set(moved, source_row);
+                }
+                if (destination) {
+                    archetype_of.set(entity_id, destination_index);
+                    row_of.set(entity_id, destination_row);
+                } else {
+                    archetype_of.reset(entity_id);
+                    row_of.reset(entity_id);
+                }
+                return destination_row;
+            }
+
+            /* Destroys an entity's components and frees its row */
+            inline void remove(const std::size_t entity_id) {
+                move(entity_id, std::bitset<MAX_COMPONENTS>());
+            }
+
+            /* Raw address of an entity's component of the given family, or nullptr */
+            inline void * locate(const std::size_t entity_id, const std::size_t family_id) const noexcept {
+                archetype_t * a = archetype(entity_id);
+                if (!a || a->column_of[family_id] == NO_COLUMN) return nullptr;
+                return a->at(row_of.get(entity_id), a->column_of[family_id]);
+            }
+
+            /* Flags an entity's row as stale and queues it to be moved once iteration ends */
+            inline void defer(const std::size_t entity_id) {
+                archetype_t * a = archetype(entity_id);
+                if (a) a->stale_at(row_of.get(entity_id)) = 1;
+                pending.push_back(entity_id);
+            }
+
+            inline void clear() {
+                archetypes.clear();
+                by_mask.clear();
+                archetype_of.clear();
+                row_of.clear();
+                pending.clear();
+            }
+        };
+
+        /*
+         * Component stores are a sparse set of type C (the component handle). They inherit from
+         * base_component_store, to allow for a vector of base_component_store*, with each
+         * casting to a concrete store of that type. The types are indexed by the family_id
+         * created for a type with component_t<C>. Each component type is stored in big contiguous
+         * vectors (the dense arrays): the component data itself, and alongside it the owning entity IDs
+         * and deleted flags. A sparse index maps entity ID to dense position - so finding, adding or
+         * removing an entity's component is O(1), iteration stays linear, and a loop over the data
+         * touches nothing but the data.
+         */
+        template<class C>
+        struct component_store_t : public base_component_store {
+            typedef typename C::data_type value_type;
+
+            std::vector<value_type> components;
+            std::vector<std::size_t> entity_ids;
+            std::vector<std::uint8_t> deleted;
+            sparse_index_t index;
+            std::vector<std::size_t> pending_deletes;
+
+            /*
+             * Returns an entity's component, or nullptr if it has none. Components that are marked
+             * as deleted (but not yet garbage collected) are still returned.
+             */
+            inline value_type * find(const std::size_t &entity_id) noexcept {
+                const std::size_t idx = index.get(entity_id);
+                return idx == NO_INDEX ? nullptr : &components[idx];
+            }
+
+            /*
+             * Adds a component to the store. If the entity already has one (even one pending
+             * deletion), it is replaced in-place rather than duplicated.
+             */
+            inline value_type & insert(const std::size_t entity_id, const value_type &component) {
+                const std::size_t idx = index.get(entity_id);
+                if (idx != NO_INDEX) {
+                    components[idx] = component;
+                    deleted[idx] = 0;
+                    return components[idx];
+                }
+                index.set(entity_id, components.size());
+                components.push_back(component);
+                entity_ids.push_back(entity_id);
+                deleted.push_back(0);
+                return components.back();
+            }
+
+            /*
+             * Adds components for the count entities with consecutive IDs from first_id, none of which may have
+             * one already (not even one pending deletion). values points to count components - or, if repeat is
+             * set, to one component that every entity gets a copy of. The arrays grow once, and are filled with
+             * a block copy.
+             */
+            inline void append(const std::size_t first_id, const std::size_t count, const value_type * values, const bool repeat) {
+                const std::size_t base = components.size();
+                if (repeat) {
+                    components.insert(components.end(), count, *values);
+                } else {
+                    components.insert(components.end(), values, values + count);
+                }
+                deleted.insert(deleted.end(), count, 0);
+                entity_ids.resize(base + count);
+                for (std::size_t i=0; i<count; ++i) entity_ids[base + i] = first_id + i;
+                index.set_range(first_id, count, base);
+            }
+
+            /*
+             * Flags an entity's component as deleted, and queues it for removal by really_delete. It stays in
+             * place until then, so deleting during iteration is safe.
+             */
+            virtual bool mark_deleted(const std::size_t &id) override final {
+                const std::size_t idx = index.get(id);
+                if (idx == NO_INDEX || deleted[idx]) return false;
+                deleted[idx] = 1;
+                pending_deletes.push_back(id);
+                return true;
+            }
+
+            virtual void reserve(const std::size_t additional) override final {
+                components.reserve(components.size() + additional);
+                entity_ids.reserve(entity_ids.size() + additional);
+                deleted.reserve(deleted.size() + additional);
+            }
+
+            /*
+             * Removes the components queued by mark_deleted, by moving the last component into each hole. This
+             * only touches queued entries, so it costs nothing when nothing was deleted.
+             */
+            virtual void really_delete() override final {
+                for (const std::size_t &id : pending_deletes) {
+                    const std::size_t idx = index.get(id);
+                    if (idx == NO_INDEX || !deleted[idx]) continue; // Re-assigned since it was deleted
+                    const std::size_t last = components.size() - 1;
+                    if (idx != last) {
+                        components[idx] = std::move(components[last]);
+                        entity_ids[idx] = entity_ids[last];
+                        deleted[idx] = deleted[last];
+                        index.set(entity_ids[idx], idx);
+                    }
+                    components.pop_back();
+                    entity_ids.pop_back();
+                    deleted.pop_back();
+                    index.reset(id);
+                }
+                pending_deletes.clear();
+            }
+
+            /* Re-queues anything still flagged as deleted (e.g. loaded from a save), so garbage collection removes it */
+            virtual std::size_t rebuild_index() override final {
+                index.clear();
+                pending_deletes.clear();
+                for (std::size_t i=0; i<entity_ids.size(); ++i) {
+                    index.set(entity_ids[i], i);
+                    if (deleted[i]) pending_deletes.push_back(entity_ids[i]);
+                }
+                return pending_deletes.size();
+            }
+
+            virtual void save(xml_node * xml) override final {
+                for (std::size_t i=0; i<components.size(); ++i) {
+                    std::string identity;
+                    _calc_xml_identity<value_type>().test(components[i], identity);
+                    xml_node * body = xml->add_node(identity);
+                    _ecs_check_for_to_xml<value_type>().test(body, components[i]);
+                    body->add_value("entity_id", rltk::serial::to_string(entity_ids[i]));
+                }
+            }
+
+            virtual std::size_t size() override final {
+                return components.size();
+            }
+
+            /*
+             * Saved games hold a vector of component handles (C), as they always have; they are unpacked into the
+             * dense arrays on load.
+             */
+            template<class Archive>
+            void serialize(Archive & archive)
+            {
+                std::vector<C> records;
+                if (!Archive::is_loading::value) {
+                    records.reserve(components.size());
+                    for (std::size_t i=0; i<components.size(); ++i) {
+                        records.emplace_back(components[i]);
+                        records.back().entity_id = entity_ids[i];
+                        records.back().deleted = deleted[i] != 0;
+                    }
+                }
+                archive( cereal::base_class<base_component_store>(this), records ); // serialize things by passing them to the archive
+                if (Archive::is_loading::value) {
+                    components.clear();
+                    entity_ids.clear();
+                    deleted.clear();
+                    for (C &record : records) {
+                        components.push_back(std::move(record.data));
+                        entity_ids.push_back(record.entity_id);
+                        deleted.push_back(record.deleted ? 1 : 0);
+                    }
+                }
+            }
+
+            virtual bool contains(const std::size_t entity_id) override final {
+                const std::size_t idx = index.get(entity_id);
+                return idx != NO_INDEX && !deleted[idx];
+            }
+
+            virtual void register_type(archetype_storage_t &storage) override final {
+                storage.register_type<value_type>();
+            }
+
+            virtual void copy_to(archetype_storage_t &storage) override final {
+                for (std::size_t i=0; i<components.size(); ++i) {
+                    if (deleted[i]) continue;
+                    void * destination = storage.locate(entity_ids[i], component_family<value_type>::id());
+                    if (destination) new (destination) value_type(components[i]);
+                }
+            }
+
+            /* The dense arrays are written as they are - unless deletions are pending, when the survivors are copied out */
+            virtual void snapshot_save(snapshot_writer_t &out) override final {
+                if (std::find(deleted.begin(), deleted.end(), 1) == deleted.end()) {
+                    out.write<std::uint64_t>(components.size());
+                    out.write_ids(entity_ids.data(), entity_ids.size());
+                    write_snapshot_values(out, components.data(), components.size());
+                    return;
+                }
+                std::vector<value_type> live;
+                std::vector<std::size_t> live_ids;
+                for (std::size_t i=0; i<components.size(); ++i) {
+                    if (deleted[i]) continue;
+                    live.push_back(components[i]);
+                    live_ids.push_back(entity_ids[i]);
+                }
+                out.write<std::uint64_t>(live.size());
+                out.write_ids(live_ids.data(), live_ids.size());
+                write_snapshot_values(out, live.data(), live.size());
+            }
+
+            virtual void snapshot_load(snapshot_reader_t &in) override final {
+                const std::size_t count = static_cast<std::size_t>(in.read<std::uint64_t>());
+                in.read_ids(entity_ids, count);
+                read_snapshot_values(in, components, count);
+                deleted.assign(count, 0);
+                rebuild_index();
+            }
+
+            virtual void snapshot_validate(snapshot_reader_t &in) override final {
+                const std::size_t count = static_cast<std::size_t>(in.read<std::uint64_t>());
+                in.skip_ids(count);
+                std::size_t length;
+                skip_snapshot_values<value_type>(in, count, length);
+            }
+
+            virtual bool snapshot_loads_raw() override final {
+                return std::is_trivially_copyable<value_type>::value;
+            }
+
+            virtual void snapshot_copy(std::unique_ptr<base_component_store> &copy) override final {
+                if (!copy) copy = std::make_unique<component_store_t<C>>();
+                component_store_t<C> * target = static_cast<component_store_t<C> *>(copy.get());
+                target->components = components;
+                target->entity_ids = entity_ids;
+                target->deleted = deleted;
+            }
+
+            virtual void snapshot_save_entities(snapshot_writer_t &out, const std::vector<std::size_t> &ids) override final {
+                std::vector<value_type> live;
+                std::vector<std::size_t> live_ids;
+                for (const std::size_t &id : ids) {
+                    const std::size_t idx = index.get(id);
+                    if (idx == NO_INDEX || deleted[idx]) continue;
+                    live.push_back(components[idx]);
+                    live_ids.push_back(id);
+                }
+                out.write<std::uint64_t>(live.size());
+                out.write_ids(live_ids.data(), live_ids.size());
+                write_snapshot_values(out, live.data(), live.size());
+            }
+
+            virtual void snapshot_merge(snapshot_reader_t &in) override final {
+                component_store_t<C> loaded;
+                loaded.snapshot_load(in);
+                reserve(loaded.components.size());
+                for (std::size_t i=0; i<loaded.components.size(); ++i) {
+                    insert(loaded.entity_ids[i], loaded.components[i]);
+                }
+            }
+
+            /* Calls func(C &) on the component at dense position idx */
+            template <typename F>
+            inline void visit(const std::size_t idx, F &&func) {
+                func(components[idx]);
+            }
+
+            inline bool is_deleted(const std::size_t idx) const noexcept {
+                return deleted[idx] != 0;
+            }
+
+            typedef component_chunk_t<value_type> chunk_type;
+
+            inline chunk_type chunk(const std::size_t begin, const std::size_t end) noexcept {
+                return chunk_type{
+                    span_t<value_type>(components.data() + begin, end - begin),
+                    span_t<const std::size_t>(entity_ids.data() + begin, end - begin),
+                    span_t<const std::uint8_t>(deleted.data() + begin, end - begin)
+                };
+            }
+        };
+
+        /* Maps a tuple of member pointers (M C::*...) to a tuple of std::vector<M>... */
+        template <class Fields>
+        struct soa_arrays;
+
+        template <class C, class... Ms>
+        struct soa_arrays<std::tuple<Ms C::*...>> {
+            typedef std::tuple<std::vector<Ms>...> type;
+        };
+
+        /*
+         * The store used for components with an soa_layout: one vector per listed member, plus the owning entity
+         * IDs and a deleted bitset. It has the same interface as component_store_t (less find, as there is no C
+         * to return a pointer to); visit gathers a C, and scatters it back after the call.
+         */
+        template<class C>
+        struct soa_component_store_t : public base_component_store {
+            static_assert(std::is_trivially_copyable<C>::value, "soa_layout is only supported for trivially copyable components");
+
+            typedef C value_type;
+            typedef decltype(soa_layout<C>::fields()) fields_t;
+            typedef typename soa_arrays<fields_t>::type arrays_t;
+            static constexpr std::size_t FIELD_COUNT = std::tuple_size<fields_t>::value;
+
+            arrays_t arrays;
+            std::vector<std::size_t> entity_ids;
+            std::vector<std::uint64_t> deleted; // One bit per dense position
+            sparse_index_t index;
+            std::vector<std::size_t> pending_deletes;
+
+            /* Calls func(M C::* member, std::vector<M> &array) for each listed member */
+            template <typename F>
+            inline void each_field(F &&func) {
+                each_field(func, std::make_index_sequence<FIELD_COUNT>{});
+            }
+
+            inline C gather(const std::size_t idx) {
+                C result{};
+                each_field([&result, idx] (auto member, auto &array) { result.*member = array[idx]; });
+                return result;
+            }
+
+            inline void scatter(const std::size_t idx, const C &component) {
+                each_field([&component, idx] (auto member, auto &array) { array[idx] = component.*member; });
+            }
+
+            inline bool is_deleted(const std::size_t idx) const noexcept {
+                return (deleted[idx >> 6] >> (idx & 63)) & 1;
+            }
+
+            inline void set_deleted(const std::size_t idx, const bool value) noexcept {
+                const std::uint64_t bit = std::uint64_t(1) << (idx & 63);
+                if (value) {
+                    deleted[idx >> 6] |= bit;
+                } else {
+                    deleted[idx >> 6] &= ~bit;
+                }
+            }
+
+            /* Position of an entity's component in the arrays, or NO_INDEX */
+            inline std::size_t find_index(const std::size_t entity_id) const noexcept {
+                return index.get(entity_id);
+            }
+
+            inline void insert(const std::size_t entity_id, const C &component) {
+                std::size_t idx = index.get(entity_id);
+                if (idx == NO_INDEX) {
+                    idx = entity_ids.size();
+                    index.set(entity_id, idx);
+                    entity_ids.push_back(entity_id);
+                    each_field([] (auto, auto &array) { array.emplace_back(); });
+                    if ((idx >> 6) >= deleted.size()) deleted.push_back(0);
+                }
+                scatter(idx, component);
+                set_deleted(idx, false);
+            }
+
+            /* As component_store_t::append, filling each member array in turn */
+            inline void append(const std::size_t first_id, const std::size_t count, const C * values, const bool repeat) {
+                const std::size_t base = entity_ids.size();
+                each_field([count, values, repeat] (auto member, auto &array) {
+                    if (repeat) {
+                        array.insert(array.end(), count, values->*member);
+                    } else {
+                        for (std::size_t i=0; i<count; ++i) array.push_back(values[i].*member);
+                    }
+                });
+                deleted.resize((base + count + 63) >> 6, 0);
+                entity_ids.resize(base + count);
+                for (std::size_t i=0; i<count; ++i) entity_ids[base + i] = first_id + i;
+                index.set_range(first_id, count, base);
+            }
+
+            virtual bool mark_deleted(const std::size_t &id) override final {
+                const std::size_t idx = index.get(id);
+                if (idx == NO_INDEX || is_deleted(idx)) return false;
+                set_deleted(idx, true);
+                pending_deletes.push_back(id);
+                return true;
+            }
+
+            virtual void reserve(const std::size_t additional) override final {
+                const std::size_t wanted = entity_ids.size() + additional;
+                entity_ids.reserve(wanted);
+                each_field([wanted] (auto, auto &array) { array.reserve(wanted); });
+                deleted.reserve((wanted + 63) >> 6);
+            }
+
+            virtual void really_delete() override final {
+                for (const std::size_t &id : pending_deletes) {
+                    const std::size_t idx = index.get(id);
+                    if (idx == NO_INDEX || !is_deleted(idx)) continue; // Re-assigned since it was deleted
+                    const std::size_t last = entity_ids.size() - 1;
+                    if (idx != last) {
+                        each_field([idx, last] (auto, auto &array) { array[idx] = array[last]; });
+                        entity_ids[idx] = entity_ids[last];
+                        set_deleted(idx, is_deleted(last));
+                        index.set(entity_ids[idx], idx);
+                    }
+                    set_deleted(last, false);
+                    each_field([] (auto, auto &array) { array.pop_back(); });
+                    entity_ids.pop_back();
+                    if ((entity_ids.size() + 63) >> 6 < deleted.size()) deleted.pop_back();
+                    index.reset(id);
+                }
+                pending_deletes.clear();
+            }
+
+            /* Re-queues anything still flagged as deleted (e.g. loaded from a save), so garbage collection removes it */
+            virtual std::size_t rebuild_index() override final {
+                index.clear();
+                pending_deletes.clear();
+                for (std::size_t i=0; i<entity_ids.size(); ++i) {
+                    index.set(entity_ids[i], i);
+                    if (is_deleted(i)) pending_deletes.push_back(entity_ids[i]);
+                }
+                return pending_deletes.size();
+            }
+
+            virtual void save(xml_node * xml) override final {
+                for (std::size_t i=0; i<entity_ids.size(); ++i) {
+                    C component = gather(i);
+                    std::string identity;
+                    _calc_xml_identity<C>().test(component, identity);
+                    xml_node * body = xml->add_node(identity);
+                    _ecs_check_for_to_xml<C>().test(body, component);
+                    body->add_value("entity_id", rltk::serial::to_string(entity_ids[i]));
+                }
+            }
+
+            virtual std::size_t size() override final {
+                return entity_ids.size();
+            }
+
+            /* Saved in the same vector<component_t<C>> form as component_store_t */
+            template<class Archive>
+            void serialize(Archive & archive)
+            {
+                std::vector<component_t<C>> records;
+                if (!Archive::is_loading::value) {
+                    records.reserve(entity_ids.size());
+                    for (std::size_t i=0; i<entity_ids.size(); ++i) {
+                        records.emplace_back(gather(i));
+                        records.back().entity_id = entity_ids[i];
+                        records.back().deleted = is_deleted(i);
+                    }
+                }
+                archive( cereal::base_class<base_component_store>(this), records ); // serialize things by passing them to the archive
+                if (Archive::is_loading::value) {
+                    arrays = arrays_t{};
+                    entity_ids.clear();
+                    deleted.clear();
+                    index.clear();
+                    for (component_t<C> &record : records) {
+                        insert(record.entity_id, record.data);
+                        set_deleted(entity_ids.size()-1, record.deleted);
+                    }
+                }
+            }
+
+            virtual bool contains(const std::size_t entity_id) override final {
+                const std::size_t idx = index.get(entity_id);
+                return idx != NO_INDEX && !is_deleted(idx);
+            }
+
+            virtual void register_type(archetype_storage_t &storage) override final {
+                storage.register_type<C>();
+            }
+
+            virtual void copy_to(archetype_storage_t &storage) override final {
+                for (std::size_t i=0; i<entity_ids.size(); ++i) {
+                    if (is_deleted(i)) continue;
+                    void * destination = storage.locate(entity_ids[i], component_family<C>::id());
+                    if (destination) new (destination) C(gather(i));
+                }
+            }
+
+            /* One block per member array, as for component_store_t */
+            virtual void snapshot_save(snapshot_writer_t &out) override final {
+                const bool compact = std::find_if(deleted.begin(), deleted.end(), [] (const std::uint64_t bits) { return bits != 0; }) != deleted.end();
+                std::vector<std::size_t> live_ids;
+                if (compact) {
+                    for (std::size_t i=0; i<entity_ids.size(); ++i) {
+                        if (!is_deleted(i)) live_ids.push_back(entity_ids[i]);
+                    }
+                }
+                const std::vector<std::size_t> &ids = compact ? live_ids : entity_ids;
+                out.write<std::uint64_t>(ids.size());
+                out.write_ids(ids.data(), ids.size());
+                each_field([this, &out, compact] (auto, auto &array) {
+                    if (!compact) {
+                        write_snapshot_values(out, array.data(), array.size());
+                        return;
+                    }
+                    typename std::decay<decltype(array)>::type live;
+                    for (std::size_t i=0; i<array.size(); ++i) {
+                        if (!is_deleted(i)) live.push_back(array[i]);
+                    }
+                    write_snapshot_values(out, live.data(), live.size());
+                });
+            }
+
+            virtual void snapshot_load(snapshot_reader_t &in) override final {
+                const std::size_t count = static_cast<std::size_t>(in.read<std::uint64_t>());
+                in.read_ids(entity_ids, count);
+                each_field([&in, count] (auto, auto &array) { read_snapshot_values(in, array, count); });
+                deleted.assign((count + 63) >> 6, 0);
+                rebuild_index();
+            }
+
+            virtual void snapshot_validate(snapshot_reader_t &in) override final {
+                const std::size_t count = static_cast<std::size_t>(in.read<std::uint64_t>());
+                in.skip_ids(count);
+                each_field([&in, count] (auto, auto &array) {
+                    std::size_t length;
+                    skip_snapshot_values<typename std::decay<decltype(array)>::type::value_type>(in, count, length);
+                });
+            }
+
+            virtual bool snapshot_loads_raw() override final {
+                return true; // The fields of an soa_layout type are trivially copyable
+            }
+
+            virtual void snapshot_copy(std::unique_ptr<base_component_store> &copy) override final {
+                if (!copy) copy = std::make_unique<soa_component_store_t<C>>();
+                soa_component_store_t<C> * target = static_cast<soa_component_store_t<C> *>(copy.get());
+                target->arrays = arrays;
+                target->entity_ids = entity_ids;
+                target->deleted = deleted;
+            }
+
+            virtual void snapshot_save_entities(snapshot_writer_t &out, const std::vector<std::size_t> &ids) override final {
+                std::vector<std::size_t> live_ids;
+                std::vector<std::size_t> positions;
+                for (const std::size_t &id : ids) {
+                    const std::size_t idx = index.get(id);
+                    if (idx == NO_INDEX || is_deleted(idx)) continue;
+                    live_ids.push_back(id);
+                    positions.push_back(idx);
+                }
+                out.write<std::uint64_t>(live_ids.size());
+                out.write_ids(live_ids.data(), live_ids.size());
+                each_field([&out, &positions] (auto, auto &array) {
+                    typename std::decay<decltype(array)>::type live;
+                    live.reserve(positions.size());
+                    for (const std::size_t &idx : positions) live.push_back(array[idx]);
+                    write_snapshot_values(out, live.data(), live.size());
+                });
+            }
+
+            virtual void snapshot_merge(snapshot_reader_t &in) override final {
+                soa_component_store_t<C> loaded;
+                loaded.snapshot_load(in);
+                reserve(loaded.entity_ids.size());
+                for (std::size_t i=0; i<loaded.entity_ids.size(); ++i) {
+                    insert(loaded.entity_ids[i], loaded.gather(i));
+                }
+            }
+
+            template <typename F>
+            inline void visit(const std::size_t idx, F &&func) {
+                C component = gather(idx);
+                func(component);
+                scatter(idx, component);
+            }
+
+            /*
+             * A run of the arrays, handed out by ecs::each_chunk. field<I>() is the array for the I'th member listed
+             * in the soa_layout; entity_ids[i] owns position i.
+             */
+            struct chunk_type {
+                soa_component_store_t<C> * store;
+                std::size_t first;
+                span_t<const std::size_t> entity_ids;
+
+                std::size_t size() const noexcept { return entity_ids.size(); }
+                bool is_deleted(const std::size_t i) const noexcept { return store->is_deleted(first + i); }
+
+                template <std::size_t I>
+                auto field() const noexcept -> span_t<typename std::tuple_element<I, arrays_t>::type::value_type> {
+                    return { std::get<I>(store->arrays).data() + first, size() };
+                }
+            };
+
+            inline chunk_type chunk(const std::size_t begin, const std::size_t end) noexcept {
+                return chunk_type{ this, begin, span_t<const std::size_t>(entity_ids.data() + begin, end - begin) };
+            }
+
+        private:
+            template <typename F, std::size_t... I>
+            inline void each_field(F &func, std::index_sequence<I...>) {
+                const fields_t fields = soa_layout<C>::fields();
+                int expand[] = { 0, (func(std::get<I>(fields), std::get<I>(arrays)), 0)... };
+                (void)expand;
+            }
+        };
+
+        /* The store type used for component type C */
+        template <class C>
+        struct store_for {
+            typedef typename std::conditional<soa_layout<C>::enabled, soa_component_store_t<C>, component_store_t<component_t<C>>>::type type;
+        };
+
+        /*
+         * The component types a native snapshot can hold, indexed by family: the name each is saved under (its
+         * xml_identity, or the RTTI name) and how to make an empty store for it (none for tags). A type is added
+         * the first time it is assigned or given a store, or by ecs::register_components - a program loading a
+         * snapshot must have registered every type the snapshot holds.
+         */
+        struct snapshot_type_t {
+            std::string name;
+            std::unique_ptr<base_component_store> (*make_store)() = nullptr;
+        };
+
+        inline std::vector<snapshot_type_t> & snapshot_types() {
+            static std::vector<snapshot_type_t> types;
+            return types;
+        }
+
+        inline std::mutex & snapshot_types_mutex() {
+            static std::mutex mutex;
+            return mutex;
+        }
+
+        template <class C>
+        inline std::unique_ptr<base_component_store> make_store() {
+            return std::make_unique<typename store_for<C>::type>();
+        }
+
+        template <class C>
+        inline void register_snapshot_type() {
+            static const bool registered = [] () {
+                const std::size_t family_id = component_family<C>::id();
+                C sample{};
+                std::string name;
+                _calc_xml_identity<C>().test(sample, name);
+                std::lock_guard<std::mutex> lock(snapshot_types_mutex());
+                std::vector<snapshot_type_t> &types = snapshot_types();
+                if (types.size() < family_id+1) types.resize(family_id+1);
+                types[family_id].name = name;
+                types[family_id].make_store = is_tag<C>::value ? nullptr : &make_store<C>;
+                return true;
+            }();
+            (void)registered;
+        }
+
+        /*
+         * A snapshot loaded with ecs::ecs_load_mapped: the mapped file, and each family's section that has been
+         * checked but not yet copied into its store. The store is only filled in the first time it is needed.
+         */
+        struct mapped_snapshot_t {
+            struct section_t {
+                std::atomic<bool> waiting{false};
+                std::unique_ptr<base_component_store> store;
+                const char * data = nullptr;
+                std::size_t size = 0;
+            };
+
+            std::unique_ptr<mapped_file> file;
+            std::uint32_t version = SNAPSHOT_VERSION;
+            std::unique_ptr<section_t[]> sections{new section_t[MAX_COMPONENTS]};
+            std::mutex mutex;
+
+            inline snapshot_reader_t reader(const std::size_t family_id) const noexcept {
+                snapshot_reader_t in(sections[family_id].data, sections[family_id].size);
+                in.version = version;
+                return in;
+            }
+        };
+
+        // What a snapshot is written from; defined in ecs.cpp
+        struct snapshot_capture_t;
+
+        /*
+         * What the last save held, for ecs::ecs_save_delta to compare the world against: each entity's
+         * generation and component mask, indexed by ID, and the change tick the save was taken at.
+         */
+        struct delta_base_t {
+            struct entity_state_t {
+                bool present = false;
+                std::uint32_t generation = 0;
+                std::bitset<MAX_COMPONENTS> mask;
+            };
+
+            std::vector<entity_state_t> entities;
+            std::size_t tick = 0;
+            bool valid = false; // Not until the first save or load
+        };
+    }
+
+    /* The chunk type each_chunk hands out for a component with an soa_layout */
+    template <class C>
+    using soa_chunk_t = typename impl::soa_component_store_t<C>::chunk_type;
+
+    namespace impl {
+
+        /*
+         * Family IDs for message types; see component_family.
+         */
+        template<class C>
+        struct message_family {
+            static inline std::size_t id() noexcept {
+                static const std::size_t family_id = base_message_t::type_counter++;
+                return family_id;
+            }
+        };
+
+        /*
+         * Handle class for messages
+         */
+        template<class C>
+        struct message_t : public base_message_t {
+            message_t() {
+                C empty;
+                data = empty;
+                family();
+            }
+            message_t(C comp) : data(comp) {
+                family();
+            }
+            std::size_t family_id;
+            C data;
+
+            inline void family() {
+                family_id = message_family<C>::id();
+            }
+        };
+
+        /*
+         * Base class for storing subscriptions to messages
+         */
+        struct subscription_base_t {
+            virtual ~subscription_base_t() {}
+            virtual void deliver_messages()=0;
+
+            // Set when the first deferred message lands in an idle holder, so it is put on the ecs's dirty list once
+            std::atomic<bool> queued{false};
+        };
+
+        /* Base class for subscription mailboxes */
+        struct subscription_mailbox_t {
+            virtual ~subscription_mailbox_t() {}
+        };
+
+        /*
+         * Implementation class for mailbox subscriptions. Deliveries go into a lock-free inbox, so any thread may
+         * post; the owning system moves them into its messages queue when it asks for its mailbox. Deferred
+         * deliveries happen between systems, while nothing else can touch the mailbox, so they skip the inbox.
+         */
+        template <class C>
+        struct mailbox_t : subscription_mailbox_t {
+            mpsc_queue<C> inbox;
+            std::queue<C> messages;
+
+            inline void post(const span_t<C> &batch) {
+                for (const C &message : batch) inbox.push(message);
+            }
+
+            inline void deliver(const span_t<C> &batch) {
+                collect(); // Keep anything emitted immediately ahead of this batch
+                for (const C &message : batch) messages.push(message);
+            }
+
+            inline std::queue<C> & collect() {
+                inbox.drain([this] (C &message) { messages.push(std::move(message)); });
+                return messages;
+            }
+        };
+
+        /*
+         * Class that holds subscriptions, and determines delivery mechanism. Subscribers are kept in one list per
+         * kind, and mailboxes are resolved when the subscription is made, so delivery is a straight walk.
+         */
+        template <class C>
+        struct subscription_holder_t : subscription_base_t {
+            mpsc_queue<C> delivery_queue;
+            std::vector<std::function<void(C& message)>> handlers;
+            std::vector<std::function<void(span_t<C> messages)>> batch_handlers;
+            std::vector<mailbox_t<C> *> mailboxes;
+            std::vector<C> batch;
+
+            /*
+             * Hands a run of messages to every subscriber: batch handlers are called once with the whole run,
+             * per-message handlers once per message, and each mailbox receives the run. deferred is true when
+             * called from deliver_messages, between systems.
+             */
+            inline void dispatch(const span_t<C> &messages, const bool deferred) {
+                for (auto &handler : batch_handlers) handler(messages);
+                for (auto &handler : handlers) {
+                    for (C &message : messages) handler(message);
+                }
+                for (mailbox_t<C> * mailbox : mailboxes) {
+                    if (deferred) {
+                        mailbox->deliver(messages);
+                    } else {
+                        mailbox->post(messages);
+                    }
+                }
+            }
+
+            /*
+             * Drains the deferred queue in batches: everything queued so far is moved out into contiguous storage,
+             * then dispatched. Messages emitted during delivery are picked up by the next batch.
+             */
+            virtual void deliver_messages() override {
+                queued.store(false);
+                while (delivery_queue.drain([this] (C &message) { batch.push_back(std::move(message)); }) > 0) {
+                    dispatch(span_t<C>(batch.data(), batch.size()), true);
+                    batch.clear();
+                }
+            }
+        };
+
+        /*
+         * Holder for a resource - world-global data stored once per ecs (see ecs::set_resource). Resource types
+         * get their own family IDs, which index ecs::resources.
+         */
+        struct base_resource_t {
+            static std::size_t type_counter;
+            virtual ~base_resource_t() {}
+        };
+
+        template <class R>
+        struct resource_t : public base_resource_t {
+            explicit resource_t(R value) : data(std::move(value)) {}
+            R data;
+        };
+
+        template <class R>
+        struct resource_family {
+            static inline std::size_t id() noexcept {
+                static const std::size_t family_id = base_resource_t::type_counter++;
+                return family_id;
+            }
+        };
+
+    } // End impl namespace
+
+    /*
+     * A generational handle to an entity. The id is the entity's (possibly recycled) ID number; the
+     * generation is bumped every time that ID is freed, so a handle kept past its entity's deletion
+     * resolves to nullptr rather than to whichever entity re-used the ID.
+     */
+    struct entity_handle_t {
+        std::size_t id = 0;
+        std::uint32_t generation = 0;
+
+        bool operator == (const entity_handle_t &other) const { return other.id == id && other.generation == generation; }
+        bool operator != (const entity_handle_t &other) const { return !(*this == other); }
+    };
+
+    /*
+     * A run of consecutive entity IDs, as returned by ecs::create_entities: first, first+1 ... first+count-1.
+     */
+    struct entity_range_t {
+        std::size_t first = 0;
+        std::size_t count = 0;
+
+        inline std::size_t size() const noexcept { return count; }
+        inline std::size_t operator[](const std::size_t i) const noexcept { return first + i; }
+    };
+
+    /*
+     * All entities are of type entity_t. They should be created with create_entity (below).
+     */
+    struct entity_t {
+
+        /*
+         * Default constructor - the entity store assigns the ID when the entity is created.
+         */
+        entity_t() : id(0) {}
+
+        /*
+         * Construct with a specified entity #.
+         */
+        entity_t(const std::size_t ID) : id(ID) {}
+
+        /*
+         * The entities ID number. Used to identify the entity. These are unique among live entities,
+         * but are recycled once an entity has been garbage collected.
+         */
+        std::size_t id;
+
+        /*
+         * How many times this entity's ID has been recycled; together with the id, this forms a handle.
+         */
+        std::uint32_t generation = 0;
+
+        inline entity_handle_t handle() const noexcept {
+            return entity_handle_t{ id, generation };
+        }
+
+        /*
+         * Overload == and != to allow entities to be compared for likeness.
+         */
+        bool operator == (const entity_t &other) const { return other.id == id; }
+        bool operator != (const entity_t &other) const { return other.id != id; }
+
+        bool deleted = false;
+
+        /*
+         * A bitset storing whether or not an entity has each component type. These are set with the family_id
+         * determined in the component_t system above.
+         */
+        std::bitset<impl::MAX_COMPONENTS> component_mask;
+
+        /*
+         * Assign a component to this entity. Determines the family_id of the component type, sets the bitmask to
+         * include the component, marks the component as belonging to the entity, and puts it in the appropriate
+         * component store.
+         */
+        template<class C>
+        inline entity_t * assign(ecs &ECS, C component) {
+            if (deleted) throw std::runtime_error("Cannot assign to a deleted entity");
+            impl::assign<C>(ECS, *this, component);
+            return this;
+        }
+
+        template<class C>
+        inline entity_t * assign(C component) {
+            return assign<C>(default_ecs, component);
+        }
+
+        /*
+         * Find a component of the specified type that belongs to the entity.
+         */
+        template <class C>
+        inline C * component(ecs &ECS) {
+            return impl::component<C>(ECS, *this);
+        }
+
+        template <class C>
+        inline C * component() {
+            return component<C>(default_ecs);
+        }
+
+        /*
+         * Records that this entity's component of the specified type was modified in place, for each_changed.
+         * Assigning a component records it automatically.
+         */
+        template <class C>
+        inline void mark_changed(ecs &ECS) {
+            impl::mark_changed<C>(ECS, *this);
+        }
+
+        template <class C>
+        inline void mark_changed() {
+            mark_changed<C>(default_ecs);
+        }
+
+        template<class Archive>
+        void serialize(Archive & archive)
+        {
+            archive( component_mask, id, deleted ); // serialize things by passing them to the archive
+        }
+    };
+
+    namespace impl {
+
+        /*
+         * The entity store is a generational slot map. Slots are indexed by entity ID and live in fixed-size
+         * pages, so an entity_t * remains valid until that entity is garbage collected. Live IDs are also kept
+         * in a packed "dense" vector, which is what iteration walks. Freed IDs are recycled first-in-first-out,
+         * bumping the slot generation so that stale entity_handle_t values can be detected.
+         */
+        struct entity_store_t {
+            static constexpr std::size_t PAGE_SHIFT = 10;
+            static constexpr std::size_t PAGE_SIZE = std::size_t(1) << PAGE_SHIFT;
+
+            struct slot_t {
+                entity_t entity;
+                std::size_t dense = NO_INDEX;
+                std::uint32_t generation = 0;
+            };
+
+            /* Iterates live (including pending-deletion) entities in dense order */
+            struct iterator {
+                entity_store_t * store;
+                std::size_t position;
+
+                inline entity_t & operator*() const noexcept { return store->slot(store->dense[position]).entity; }
+                inline entity_t * operator->() const noexcept { return &store->slot(store->dense[position]).entity; }
+                inline iterator & operator++() noexcept { ++position; return *this; }
+                inline bool operator == (const iterator &other) const noexcept { return position == other.position; }
+                inline bool operator != (const iterator &other) const noexcept { return position != other.position; }
+            };
+
+            std::vector<std::unique_ptr<slot_t[]>> pages;
+            std::vector<std::size_t> dense;
+            std::deque<std::size_t> free_ids;
+            std::atomic<std::size_t> next_id{1}; // Not using zero since it is used as null so often
+
+            inline iterator begin() noexcept { return iterator{ this, 0 }; }
+            inline iterator end() noexcept { return iterator{ this, dense.size() }; }
+            inline std::size_t size() const noexcept { return dense.size(); }
+
+            /* Returns the entity with a given ID, or nullptr if there isn't one. */
+            inline entity_t * find(const std::size_t id) noexcept {
+                slot_t * s = existing_slot(id);
+                return (s && s->dense != NO_INDEX) ? &s->entity : nullptr;
+            }
+
+            /* Returns the entity referred to by a handle, or nullptr if it is gone or the ID was recycled. */
+            inline entity_t * find(const entity_handle_t &handle) noexcept {
+                entity_t * result = find(handle.id);
+                return (result && result->generation == handle.generation) ? result : nullptr;
+            }
+
+            /* Creates an entity, re-using a freed ID if one is available. */
+            inline entity_t & create() {
+                std::size_t id = 0;
+                while (id == 0 && !free_ids.empty()) {
+                    id = free_ids.front();
+                    free_ids.pop_front();
+                    if (find(id)) id = 0; // Claimed by create(id) since it was freed
+                }
+                while (id == 0) {
+                    const std::size_t candidate = next_id.fetch_add(1);
+                    if (!find(candidate)) id = candidate;
+                }
+                return occupy(id);
+            }
+
+            /*
+             * Creates count entities with consecutive IDs, and returns the first ID. If the next count freed IDs
+             * are a consecutive run (as they are once a batch created this way has been deleted and collected),
+             * they are re-used; otherwise the range comes from never-used IDs.
+             */
+            inline std::size_t create_range(const std::size_t count) {
+                if (count == 0) return 0;
+                dense.reserve(dense.size() + count);
+                if (free_ids.size() >= count) {
+                    const std::size_t first = free_ids.front();
+                    auto it = free_ids.begin();
+                    std::size_t i = 0;
+                    while (i < count && *it == first + i) {
+                        ++it;
+                        ++i;
+                    }
+                    // Unless part of the run was claimed by create(id) since it was freed
+                    for (i=0; i<count && !find(first + i); ++i) {}
+                    if (i == count) {
+                        occupy_range(first, count);
+                        free_ids.erase(free_ids.begin(), free_ids.begin() + count);
+                        return first;
+                    }
+                }
+                const std::size_t first = next_id.fetch_add(count);
+                occupy_range(first, count);
+                return first;
+            }
+
+            /*
+             * Claims a never-used ID without creating the entity; safe to call from any thread. The caller must
+             * later create(id) it (command buffers do this on playback).
+             */
+            inline std::size_t reserve_id() noexcept {
+                return next_id.fetch_add(1);
+            }
+
+            /* Creates an entity with a specific ID. Throws if the ID is in use. */
+            inline entity_t & create(const std::size_t id) {
+                if (id == 0 || find(id)) {
+                    throw std::runtime_error("WARNING: Duplicate entity ID. Odd things will happen\n");
+                }
+                if (id >= next_id) next_id = id+1;
+                return occupy(id);
+            }
+
+            /* Removes an entity (swap-and-pop from the dense list), and frees its ID for re-use. */
+            inline void erase(const std::size_t id) {
+                slot_t * s = existing_slot(id);
+                if (!s || s->dense == NO_INDEX) return;
+                const std::size_t moved = dense.back();
+                dense[s->dense] = moved;
+                slot(moved).dense = s->dense;
+                dense.pop_back();
+                s->dense = NO_INDEX;
+                ++s->generation;
+                s->entity = entity_t{};
+                free_ids.push_back(id);
+            }
+
+            inline void clear() noexcept {
+                pages.clear();
+                dense.clear();
+                free_ids.clear();
+                next_id.store(1);
+            }
+
+            /*
+             * Cereal support. This is written in the same shape as the old std::unordered_map<std::size_t, entity_t>
+             * entity store, so existing save games still load.
+             */
+            template<class Archive>
+            void save(Archive & archive) const
+            {
+                std::unordered_map<std::size_t, entity_t> entities;
+                for (const std::size_t &id : dense) {
+                    entities.emplace(id, const_cast<entity_store_t *>(this)->slot(id).entity);
+                }
+                archive( entities );
+            }
+
+            template<class Archive>
+            void load(Archive & archive)
+            {
+                std::unordered_map<std::size_t, entity_t> entities;
+                archive( entities );
+                clear();
+                for (auto &e : entities) {
+                    create(e.first) = e.second;
+                }
+            }
+
+            inline slot_t & slot(const std::size_t id) noexcept {
+                return pages[id >> PAGE_SHIFT][id & (PAGE_SIZE-1)];
+            }
+
+        private:
+            inline slot_t * existing_slot(const std::size_t id) noexcept {
+                const std::size_t page = id >> PAGE_SHIFT;
+                if (page >= pages.size() || !pages[page]) return nullptr;
+                return &pages[page][id & (PAGE_SIZE-1)];
+            }
+
+            inline entity_t & occupy(const std::size_t id) {
+                const std::size_t page = id >> PAGE_SHIFT;
+                if (page >= pages.size()) pages.resize(page+1);
+                if (!pages[page]) pages[page] = std::unique_ptr<slot_t[]>(new slot_t[PAGE_SIZE]);
+                slot_t &s = slot(id);
+                s.dense = dense.size();
+                s.entity = entity_t{id};
+                s.entity.generation = s.generation;
+                dense.push_back(id);
+                return s.entity;
+            }
+
+            /* As occupy, for the count free IDs from first: the page list and the dense list each grow once */
+            inline void occupy_range(const std::size_t first, const std::size_t count) {
+                const std::size_t last_page = (first + count - 1) >> PAGE_SHIFT;
+                if (last_page >= pages.size()) pages.resize(last_page+1);
+                for (std::size_t page = first >> PAGE_SHIFT; page <= last_page; ++page) {
+                    if (!pages[page]) pages[page] = std::unique_ptr<slot_t[]>(new slot_t[PAGE_SIZE]);
+                }
+                const std::size_t base = dense.size();
+                dense.resize(base + count);
+                for (std::size_t i=0; i<count; ++i) {
+                    slot_t &s = slot(first + i);
+                    s.dense = base + i;
+                    s.entity = entity_t{first + i};
+                    s.entity.generation = s.generation;
+                    dense[base + i] = first + i;
+                }
+            }
+        };
+    }
+
+    namespace impl {
+
+        /*
+         * Change tracking for one component type: which entities had theirs assigned or marked changed, and at
+         * which change tick. An entity is logged at most once per tick, and entries stay in tick order, so the
+         * changes since a given tick are found with a binary search and cost O(changes) to visit. Marking is
+         * thread-safe; reading is not.
+         */
+        struct change_log_t {
+            struct entry_t {
+                std::size_t tick;
+                entity_handle_t entity;
+            };
+
+            std::mutex mutex;
+            sparse_index_t latest; // Entity ID -> tick of its newest entry
+            sparse_index_t latest_generation; // Entity ID -> generation of its newest entry
+            std::vector<entry_t> entries;
+
+            /* The newest entry is matched on the whole handle, so an ID recycled within a tick is still logged */
+            inline bool is_latest(const entity_handle_t &entity, const std::size_t tick) const noexcept {
+                return latest.get(entity.id) == tick && latest_generation.get(entity.id) == entity.generation;
+            }
+
+            inline void mark(const entity_handle_t &entity, const std::size_t tick) {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (is_latest(entity, tick)) return;
+                latest.set(entity.id, tick);
+                latest_generation.set(entity.id, entity.generation);
+                entries.push_back(entry_t{ tick, entity });
+            }
+
+            /* As mark, for every entity in range (which must all exist); the lock is taken once */
+            inline void mark_range(entity_store_t &store, const entity_range_t &range, const std::size_t tick) {
+                std::lock_guard<std::mutex> lock(mutex);
+                entries.reserve(entries.size() + range.size());
+                for (std::size_t i=0; i<range.size(); ++i) {
+                    const entity_handle_t entity = store.find(range[i])->handle();
+                    if (is_latest(entity, tick)) continue;
+                    latest.set(entity.id, tick);
+                    latest_generation.set(entity.id, entity.generation);
+                    entries.push_back(entry_t{ tick, entity });
+                }
+            }
+
+            /*
+             * Calls func(const entity_handle_t &) once for every entity marked after tick, oldest change first.
+             * Entities marked during the loop are left for the next call.
+             */
+            template <typename F>
+            inline void since(const std::size_t tick, F &&func) {
+                const std::size_t count = entries.size();
+                std::size_t i = std::upper_bound(entries.begin(), entries.end(), tick, [] (const std::size_t t, const entry_t &entry) {
+                    return t < entry.tick;
+                }) - entries.begin();
+                for (; i<count; ++i) {
+                    const entry_t entry = entries[i];
+                    if (is_latest(entry.entity, entry.tick)) func(entry.entity);
+                }
+            }
+
+            /* Drops the entries at or before tick */
+            inline void trim(const std::size_t tick) {
+                auto first = std::upper_bound(entries.begin(), entries.end(), tick, [] (const std::size_t t, const entry_t &entry) {
+                    return t < entry.tick;
+                });
+                entries.erase(entries.begin(), first);
+            }
+        };
+
+        /* The untyped part of an observer_t, so the ecs can reach one by family ID */
+        struct base_observer_t {
+            virtual ~base_observer_t() {}
+            virtual void removing(ecs &ECS, entity_t &e) = 0;
+            virtual void deliver(ecs &ECS) = 0;
+            virtual void clear() = 0;
+            bool queued = false;
+        };
+
+        /*
+         * The observers of one component type, and the events waiting for them. Events carry copies of the
+         * component values involved, so a removal can still be handled after the component is gone.
+         */
+        template <class C>
+        struct observer_t : public base_observer_t {
+            enum class event_kind_t : std::uint8_t { ADDED, REPLACED, REMOVED };
+
+            struct event_t {
+                event_kind_t kind;
+                entity_handle_t entity;
+                std::size_t value; // Index into values; a REPLACED event uses value (old) and value+1 (new)
+            };
+
+            std::vector<std::function<void(entity_t &, const C &)>> on_add;
+            std::vector<std::function<void(entity_t &, const C &, const C &)>> on_replace;
+            std::vector<std::function<void(entity_t &, const C &)>> on_remove;
+            std::vector<event_t> events;
+            std::vector<C> values;
+
+            /* Records an assign that is about to happen; component is the new value */
+            inline void assigning(ecs &ECS, entity_t &e, const C &component);
+
+            /* Forgets the last assigning call, for an assign that was queued rather than made */
+            inline void retract() {
+                values.erase(values.begin() + events.back().value, values.end());
+                events.pop_back();
+            }
+
+            virtual void removing(ecs &ECS, entity_t &e) override final;
+            virtual void deliver(ecs &ECS) override final;
+
+            virtual void clear() override final {
+                events.clear();
+                values.clear();
+            }
+        };
+
+        /* The default navigator for index_positions: reads the component's x and y members */
+        template <class C>
+        struct xy_navigator {
+            static inline int get_x(const C &c) noexcept { return c.x; }
+            static inline int get_y(const C &c) noexcept { return c.y; }
+        };
+
+        /*
+         * A spatial hash of entity positions: the world is cut into square cells of cell_size tiles, and each
+         * cell lists the entities in it. Each entity's exact position is kept too, so queries only look at the
+         * cells they overlap and never need to read a component.
+         */
+        struct spatial_index_t {
+            struct point_t {
+                std::size_t id;
+                int x, y;
+            };
+
+            int cell_size = 8;
+            std::size_t family_id = 0;
+            std::unordered_map<std::uint64_t, std::vector<std::size_t>> cells; // Cell key -> entity IDs
+            std::vector<point_t> points;
+            sparse_index_t point_of; // Entity ID -> position in points
+            std::function<void(spatial_index_t &)> seed; // Re-adds every current position, after a load
+            std::function<void(spatial_index_t &, std::size_t)> resync; // Re-reads positions changed after a tick
+            std::size_t synced_tick = 0; // Change tick the index last caught up to
+
+            inline int cell_of(const int n) const noexcept {
+                return (n >= 0) ? n / cell_size : -((-n - 1) / cell_size) - 1;
+            }
+
+            inline std::uint64_t key(const int cell_x, const int cell_y) const noexcept {
+                return (std::uint64_t(std::uint32_t(cell_x)) << 32) | std::uint32_t(cell_y);
+            }
+
+            inline void insert(const std::size_t id, const int x, const int y) {
+                const std::size_t idx = point_of.get(id);
+                if (idx != NO_INDEX) {
+                    point_t &p = points[idx];
+                    if (cell_of(p.x) == cell_of(x) && cell_of(p.y) == cell_of(y)) {
+                        p.x = x;
+                        p.y = y;
+                        return;
+                    }
+                    remove(id);
+                }
+                point_of.set(id, points.size());
+                points.push_back(point_t{ id, x, y });
+                cells[key(cell_of(x), cell_of(y))].push_back(id);
+            }
+
+            inline void remove(const std::size_t id) {
+                const std::size_t idx = point_of.get(id);
+                if (idx == NO_INDEX) return;
+                auto cell = cells.find(key(cell_of(points[idx].x), cell_of(points[idx].y)));
+                std::vector<std::size_t> &ids = cell->second;
+                *std::find(ids.begin(), ids.end(), id) = ids.back();
+                ids.pop_back();
+                if (ids.empty()) cells.erase(cell);
+                if (idx != points.size() - 1) {
+                    points[idx] = points.back();
+                    point_of.set(points[idx].id, idx);
+                }
+                points.pop_back();
+                point_of.reset(id);
+            }
+
+            inline void clear() noexcept {
+                cells.clear();
+                points.clear();
+                point_of.clear();
+            }
+
+            /* Calls func(id, x, y) for every indexed entity in the rectangle (inclusive) */
+            template <typename F>
+            inline void in_rect(const int x1, const int y1, const int x2, const int y2, F &&func) const {
+                const int min_x = std::min(x1, x2), max_x = std::max(x1, x2);
+                const int min_y = std::min(y1, y2), max_y = std::max(y1, y2);
+                for (int cell_y = cell_of(min_y); cell_y <= cell_of(max_y); ++cell_y) {
+                    for (int cell_x = cell_of(min_x); cell_x <= cell_of(max_x); ++cell_x) {
+                        auto cell = cells.find(key(cell_x, cell_y));
+                        if (cell == cells.end()) continue;
+                        for (const std::size_t &id : cell->second) {
+                            const point_t &p = points[point_of.get(id)];
+                            if (p.x >= min_x && p.x <= max_x && p.y >= min_y && p.y <= max_y) func(id, p.x, p.y);
+                        }
+                    }
+                }
+            }
+        };
+
+        /*
+         * The untyped part of a cached query (see view_t below). It holds the list of entities whose component_mask
+         * includes every bit in required, and is kept up to date by the ecs whenever a mask changes - so iterating
+         * costs O(matches), not O(entities). Additions are immediate; removals just flag the list as stale, and it
+         * is compacted before the next iteration. That keeps it safe to add/remove components and delete entities
+         * from inside a callback. Systems in one parallel wave of ecs_tick can iterate the same view at once: the
+         * depth count is atomic, and held stops compaction until the wave is over.
+         */
+        struct view_cache_t {
+            static std::size_t type_counter;
+            std::bitset<MAX_COMPONENTS> required;
+            std::vector<std::size_t> entities;
+            sparse_index_t position;
+            bool stale = false;
+            bool held = false;
+            std::atomic<int> iterating{0};
+
+            inline bool matches(const entity_t &e) const noexcept {
+                return !e.deleted && (e.component_mask & required) == required;
+            }
+
+            inline void on_mask_set(const entity_t &e, const std::size_t family_id) {
+                if (!required.test(family_id) || !matches(e) || position.get(e.id) != NO_INDEX) return;
+                position.set(e.id, entities.size());
+                entities.push_back(e.id);
+            }
+
+            /* As on_mask_set, for every entity in range (which must all exist); the list grows once */
+            inline void on_range_set(entity_store_t &store, const entity_range_t &range, const std::size_t family_id) {
+                if (!required.test(family_id)) return;
+                entities.reserve(entities.size() + range.size());
+                for (std::size_t i=0; i<range.size(); ++i) {
+                    const entity_t &e = *store.find(range[i]);
+                    if (!matches(e) || position.get(e.id) != NO_INDEX) continue;
+                    position.set(e.id, entities.size());
+                    entities.push_back(e.id);
+                }
+            }
+
+            inline void on_mask_unset(const entity_t &e, const std::size_t family_id) noexcept {
+                if (required.test(family_id) && position.get(e.id) != NO_INDEX) stale = true;
+            }
+
+            inline void on_entity_deleted(const entity_t &e) noexcept {
+                if (position.get(e.id) != NO_INDEX) stale = true;
+            }
+
+            inline void compact(entity_store_t &store) {
+                if (!stale || held || iterating > 0) return;
+                std::size_t write = 0;
+                for (std::size_t read=0; read<entities.size(); ++read) {
+                    const std::size_t id = entities[read];
+                    entity_t * e = store.find(id);
+                    if (e && matches(*e)) {
+                        entities[write] = id;
+                        position.set(id, write);
+                        ++write;
+                    } else {
+                        position.reset(id);
+                    }
+                }
+                entities.resize(write);
+                stale = false;
+            }
+
+            inline void rebuild(entity_store_t &store) {
+                entities.clear();
+                position.clear();
+                stale = false;
+                if (required.none()) return;
+                for (entity_t &e : store) {
+                    if (matches(e)) {
+                        position.set(e.id, entities.size());
+                        entities.push_back(e.id);
+                    }
+                }
+            }
+
+            /*
+             * Calls func(entity_t &) for every matching entity. Entities that start matching during the loop are
+             * picked up on the next iteration, not this one.
+             */
+            template <typename F>
+            inline void each(entity_store_t &store, F &&func) {
+                if (required.none()) {
+                    // An empty type list matches everything, and creating an entity doesn't touch a mask.
+                    const std::size_t count = store.size();
+                    for (std::size_t i=0; i<count; ++i) {
+                        entity_t &e = store.slot(store.dense[i]).entity;
+                        if (!e.deleted) func(e);
+                    }
+                    return;
+                }
+                compact(store);
+                struct iteration_guard_t {
+                    std::atomic<int> &depth;
+                    ~iteration_guard_t() { --depth; }
+                } guard{ iterating };
+                ++iterating;
+                const std::size_t count = entities.size();
+                for (std::size_t i=0; i<count; ++i) {
+                    entity_t * e = store.find(entities[i]);
+                    if (e && matches(*e)) func(*e);
+                }
+            }
+
+            /*
+             * As each, but the entity list is split into ranges of grain entities which are processed on the
+             * thread pool. func must be safe to call concurrently for different entities.
+             */
+            template <typename F>
+            inline void parallel_each(thread_pool &pool, entity_store_t &store, const std::size_t grain, F &&func) {
+                if (required.none()) {
+                    pool.parallel_for(store.size(), grain, [&store, &func] (const std::size_t begin, const std::size_t end) {
+                        for (std::size_t i=begin; i<end; ++i) {
+                            entity_t &e = store.slot(store.dense[i]).entity;
+                            if (!e.deleted) func(e);
+                        }
+                    });
+                    return;
+                }
+                compact(store);
+                struct iteration_guard_t {
+                    std::atomic<int> &depth;
+                    ~iteration_guard_t() { --depth; }
+                } guard{ iterating };
+                ++iterating;
+                pool.parallel_for(entities.size(), grain, [this, &store, &func] (const std::size_t begin, const std::size_t end) {
+                    for (std::size_t i=begin; i<end; ++i) {
+                        entity_t * e = store.find(entities[i]);
+                        if (e && matches(*e)) func(*e);
+                    }
+                });
+            }
+        };
+
+        /* Default number of entities/components handed to a worker at a time by the parallel iterators */
+        constexpr std::size_t DEFAULT_GRAIN = 256;
+
+        /* Assigns each distinct type list a slot in ecs::views */
+        template <typename... Cs>
+        struct view_family {
+            static inline std::size_t id() {
+                static std::size_t family_id = view_cache_t::type_counter++;
+                return family_id;
+            }
+        };
+    }
+
+    /*
+     * A persistent query over every entity that has all of the components Cs. Obtain one with ecs.view<Cs...>();
+     * it is cheap to copy, and every copy for the same type list shares one cached entity list inside the ecs.
+     */
+    template <typename... Cs>
+    struct view_t {
+        ecs * ECS;
+        impl::view_cache_t * cache;
+
+        /*
+         * Calls callback(entity_t &, Cs &...) for every matching entity.
+         */
+        template <typename F>
+        inline void each(F callback);
+
+        /*
+         * Calls callback(entity_t &, Cs &...) for every matching entity for which predicate (with the same signature)
+         * returns true.
+         */
+        template <typename P, typename F>
+        inline void each_if(P&& predicate, F callback);
+
+        /*
+         * As each, but spread across the ecs worker pool in ranges of grain entities. See ecs::parallel_each for
+         * what callbacks may safely do.
+         */
+        template <typename F>
+        inline void parallel_each(F callback, const std::size_t grain = impl::DEFAULT_GRAIN);
+
+        /* Number of matching entities (may briefly include entities that stopped matching mid-tick) */
+        inline std::size_t size() const noexcept {
+            return cache->entities.size();
+        }
+    };
+
+    namespace impl {
+        /* Type-erased holder for the components queued by a command buffer, one per component family */
+        struct base_command_payload_t {
+            virtual ~base_command_payload_t() {}
+            virtual void clear() noexcept=0;
+        };
+
+        template <class C>
+        struct command_payload_t : public base_command_payload_t {
+            std::vector<C> items;
+
+            virtual void clear() noexcept override final {
+                items.clear();
+            }
+        };
+    }
+
+    /*
+     * A command buffer records structural changes - creating and deleting entities, and assigning and deleting
+     * components - so that they can be made later, in one batch, at a sync point. ecs_tick plays them back after
+     * each wave of systems (and before garbage collection); ecs::play_back_commands() does it on demand.
+     *
+     * Each pool worker has its own buffer (see ecs::commands()), so systems and parallel_each callbacks can
+     * change the world from worker threads without locking. Changes are not visible until playback.
+     */
+    struct command_buffer_t {
+        enum class command_kind_t : std::uint8_t { CREATE_ENTITY, ASSIGN_COMPONENT, DELETE_COMPONENT, DELETE_ENTITY };
+
+        struct command_t {
+            command_kind_t kind;
+            bool delete_entity_if_empty;
+            std::size_t entity_id;
+            std::size_t family_id;
+            std::size_t payload_index;
+            void (*apply)(ecs &ECS, entity_t &e, command_buffer_t &buffer, const std::size_t payload_index);
+        };
+
+        explicit command_buffer_t(ecs &world) : ECS(&world) {}
+
+        /*
+         * Reserves a new entity ID, and records its creation. The ID can be used in further commands straight away.
+         */
+        inline std::size_t create_entity();
+
+        /*
+         * Records assigning a component to an entity (replacing any it already has of that type).
+         */
+        template<class C>
+        inline void assign(const std::size_t entity_id, C component) {
+            const std::size_t family_id = impl::component_family<C>::id();
+            if (payloads.size() < family_id+1) payloads.resize(family_id+1);
+            if (!payloads[family_id]) payloads[family_id] = std::make_unique<impl::command_payload_t<C>>();
+            std::vector<C> &items = static_cast<impl::command_payload_t<C> *>(payloads[family_id].get())->items;
+            commands.push_back(command_t{ command_kind_t::ASSIGN_COMPONENT, false, entity_id, family_id, items.size(), &apply_assign<C> });
+            items.push_back(std::move(component));
+        }
+
+        /*
+         * Records deleting an entity's component of type C.
+         */
+        template<class C>
+        inline void delete_component(const std::size_t entity_id, bool delete_entity_if_empty=false) {
+            commands.push_back(command_t{ command_kind_t::DELETE_COMPONENT, delete_entity_if_empty, entity_id, impl::component_family<C>::id(), 0, nullptr });
+        }
+
+        /*
+         * Records deleting an entity.
+         */
+        inline void delete_entity(const std::size_t entity_id) {
+            commands.push_back(command_t{ command_kind_t::DELETE_ENTITY, false, entity_id, 0, 0, nullptr });
+        }
+
+        inline bool empty() const noexcept {
+            return commands.empty();
+        }
+
+        inline void clear() noexcept {
+            commands.clear();
+            for (auto &payload : payloads) {
+                if (payload) payload->clear();
+            }
+        }
+
+        ecs * ECS;
+        std::vector<command_t> commands;
+        std::vector<std::unique_ptr<impl::base_command_payload_t>> payloads;
+
+    private:
+        template<class C>
+        static void apply_assign(ecs &world, entity_t &e, command_buffer_t &buffer, const std::size_t payload_index) {
+            std::vector<C> &items = static_cast<impl::command_payload_t<C> *>(buffer.payloads[impl::component_family<C>::id()].get())->items;
+            e.assign<C>(world, std::move(items[payload_index]));
+        }
+    };
+
+    namespace impl {
+        /* Type-erased component held by a prefab, which stamps copies of itself onto entities */
+        struct base_prefab_component_t {
+            explicit base_prefab_component_t(const std::size_t family) : family_id(family) {}
+            virtual ~base_prefab_component_t() {}
+            virtual std::unique_ptr<base_prefab_component_t> clone() const=0;
+            virtual void instantiate(ecs &ECS, entity_t &e) const=0;
+            virtual void instantiate(ecs &ECS, const entity_range_t &range) const=0;
+
+            const std::size_t family_id;
+        };
+
+        template <class C>
+        struct prefab_component_t : public base_prefab_component_t {
+            explicit prefab_component_t(C c) : base_prefab_component_t(component_family<C>::id()), component(std::move(c)) {}
+
+            virtual std::unique_ptr<base_prefab_component_t> clone() const override final {
+                return std::make_unique<prefab_component_t<C>>(component);
+            }
+
+            inline virtual void instantiate(ecs &ECS, entity_t &e) const override final;
+            inline virtual void instantiate(ecs &ECS, const entity_range_t &range) const override final;
+
+            C component;
+        };
+
+        /* The component type an instantiate override stands for: C itself, or the C of a span_t<const C> */
+        template <class T>
+        struct override_type {
+            typedef T type;
+        };
+
+        template <class C>
+        struct override_type<span_t<const C>> {
+            typedef C type;
+        };
+
+    }
+
+    /*
+     * A prefab is a pre-built set of components - one of each type - that can be stamped onto new entities with
+     * ecs::instantiate, instead of assigning each component by hand on every spawn. Build it once (typically when
+     * loading your data files) and register it with ecs::define_prefab:
+     *
+     * ECS.define_prefab("orc").with(monster{ 10, 2 }).with(renderable{ 'o', colors::GREEN });
+     * ECS.instantiate("orc", position{ x, y });
+     *
+     * Prefabs don't belong to any particular ecs; a prefab_t built on its own can be instantiated anywhere.
+     */
+    struct prefab_t {
+        prefab_t() {}
+        prefab_t(prefab_t &&) = default;
+        prefab_t & operator=(prefab_t &&) = default;
+
+        /* Copies are deep, so a variant can be made from a base prefab and then adjusted */
+        prefab_t(const prefab_t &other) {
+            components.reserve(other.components.size());
+            for (const auto &c : other.components) components.push_back(c->clone());
+        }
+
+        prefab_t & operator=(const prefab_t &other) {
+            if (this != &other) *this = prefab_t(other);
+            return *this;
+        }
+
+        /* Adds component to the prefab, replacing any C it already has. Returns the prefab for chaining. */
+        template <class C>
+        inline prefab_t & with(C component) {
+            const std::size_t family_id = impl::component_family<C>::id();
+            auto found = find(family_id);
+            if (found != components.end() && (*found)->family_id == family_id) {
+                static_cast<impl::prefab_component_t<C> *>(found->get())->component = std::move(component);
+            } else {
+                components.insert(found, std::make_unique<impl::prefab_component_t<C>>(std::move(component)));
+            }
+            return *this;
+        }
+
+        /* Removes the prefab's C, if it has one */
+        template <class C>
+        inline prefab_t & without() {
+            const std::size_t family_id = impl::component_family<C>::id();
+            auto found = find(family_id);
+            if (found != components.end() && (*found)->family_id == family_id) components.erase(found);
+            return *this;
+        }
+
+        /* The prefab's C, or nullptr if it doesn't have one */
+        template <class C>
+        inline C * get() noexcept {
+            const std::size_t family_id = impl::component_family<C>::id();
+            auto found = find(family_id);
+            if (found == components.end() || (*found)->family_id != family_id) return nullptr;
+            return &static_cast<impl::prefab_component_t<C> *>(found->get())->component;
+        }
+
+        template <class C>
+        inline const C * get() const noexcept {
+            return const_cast<prefab_t *>(this)->get<C>();
+        }
+
+        inline std::size_t size() const noexcept {
+            return components.size();
+        }
+
+        // Sorted by component family, one per family
+        std::vector<std::unique_ptr<impl::base_prefab_component_t>> components;
+
+    private:
+        inline std::vector<std::unique_ptr<impl::base_prefab_component_t>>::iterator find(const std::size_t family_id) {
+            return std::lower_bound(components.begin(), components.end(), family_id,
+                [] (const std::unique_ptr<impl::base_prefab_component_t> &c, const std::size_t id) { return c->family_id < id; });
+        }
+    };
+
+    /*
+     * Systems should inherit from this class.
+     */
+    struct base_system {
+        virtual ~base_system() {}
+        virtual void configure() {}
+        virtual void update(const double duration_ms)=0;
+        std::string system_name = "Unnamed System";
+        std::unordered_map<std::size_t, std::unique_ptr<impl::subscription_mailbox_t>> mailboxes;
+
+        /*
+         * Access declarations, used by ecs_tick to run systems in parallel. A system that calls none of reads,
+         * writes or emits is assumed to touch everything, and runs on its own - as all systems used to. Once a
+         * system declares anything, the declarations must be complete: every component type it reads or writes,
+         * and every message it emits (immediately or deferred). Declared systems that run alongside others must
+         * not create or delete entities, or assign or delete components, directly - record them with
+         * ecs::commands() instead. Call these from the constructor or configure().
+         */
+        template<class... Cs>
+        void reads() {
+            access_declared = true;
+            reads_mask |= impl::required_mask<Cs...>();
+        }
+
+        template<class... Cs>
+        void writes() {
+            access_declared = true;
+            writes_mask |= impl::required_mask<Cs...>();
+        }
+
+        template<class... MSGs>
+        void emits() {
+            access_declared = true;
+            const std::size_t family_ids[] = { std::size_t(0), impl::message_family<MSGs>::id()... };
+            emitted_messages.insert(std::begin(family_ids)+1, std::end(family_ids));
+        }
+
+        /*
+         * Change ticks (see ecs::each_changed): the tick this system last ran at, and the one it ran at before
+         * that - which is what each_changed compares against during update.
+         */
+        std::size_t last_run_tick = 0;
+        std::size_t changes_since = 0;
+
+        /*
+         * Calls func(entity_t &, C &, Cs &...) for every entity whose C was assigned or marked changed since this
+         * system's previous update (other than by this system), and that has all of Cs.
+         */
+        template <class C, class... Cs, typename F>
+        void each_changed(ecs &ECS, F func);
+
+        template <class C, class... Cs, typename F>
+        void each_changed(F func) {
+            each_changed<C, Cs...>(default_ecs, func);
+        }
+
+        bool access_declared = false;
+        std::bitset<impl::MAX_COMPONENTS> reads_mask;
+        std::bitset<impl::MAX_COMPONENTS> writes_mask;
+        std::unordered_set<std::size_t> emitted_messages;
+        std::unordered_set<std::size_t> subscribed_messages;
+
+        /*
+         * Two systems conflict - and so run one after the other, in the order they were added - if either is
+         * undeclared, either writes a component the other reads or writes, either emits a message the other
+         * subscribes to, or both emit the same message (subscriber callbacks would then run concurrently).
+         */
+        inline bool conflicts_with(const base_system &other) const {
+            if (!access_declared || !other.access_declared) return true;
+            if ((writes_mask & (other.reads_mask | other.writes_mask)).any()) return true;
+            if ((other.writes_mask & reads_mask).any()) return true;
+            for (const std::size_t &family_id : emitted_messages) {
+                if (other.subscribed_messages.count(family_id) || other.emitted_messages.count(family_id)) return true;
+            }
+            for (const std::size_t &family_id : other.emitted_messages) {
+                if (subscribed_messages.count(family_id)) return true;
+            }
+            return false;
+        }
+
+        template<class MSG>
+        void subscribe(ecs &ECS, std::function<void(MSG &message)> destination) {
+            impl::subscribe<MSG>(ECS, *this, destination);
+        }
+
+        template<class MSG>
+        void subscribe(std::function<void(MSG &message)> destination) {
+            subscribe<MSG>(default_ecs, destination);
+        }
+
+        /*
+         * Subscribes a handler that is called once per delivery with every message of that type delivered
+         * together, rather than once per message. Immediate emits arrive as a batch of one.
+         */
+        template<class MSG>
+        void subscribe_batch(ecs &ECS, std::function<void(span_t<MSG> messages)> destination) {
+            impl::subscribe_batch<MSG>(ECS, *this, destination);
+        }
+
+        template<class MSG>
+        void subscribe_batch(std::function<void(span_t<MSG> messages)> destination) {
+            subscribe_batch<MSG>(default_ecs, destination);
+        }
+
+        template<class MSG>
+        void subscribe_mbox(ecs &ECS) {
+            impl::subscribe_mbox<MSG>(ECS, *this);
+        }
+
+        template<class MSG>
+        void subscribe_mbox() {
+            subscribe_mbox<MSG>(default_ecs);
+        }
+
+        template<class MSG>
+        std::queue<MSG> * mbox() {
+            auto finder = mailboxes.find(impl::message_family<MSG>::id());
+            if (finder != mailboxes.end()) {
+                return &static_cast<impl::mailbox_t<MSG> *>(finder->second.get())->collect();
+            } else {
+                return nullptr;
+            }
+        }
+
+        template<class MSG, typename F>
+        void each_mbox(F func) {
+            std::queue<MSG> * mailbox = mbox<MSG>();
+            if (!mailbox) return;
+            while (!mailbox->empty()) {
+                MSG msg = mailbox->front();
+                mailbox->pop();
+                func(msg);
+            }
+        }
+    };
+
+    /* A pre-implemented simple system for systems that only handle messages. */
+    template <class MSG>
+    struct mailbox_system : public base_system {
+        virtual void configure() override final {
+            subscribe_mbox<MSG>();
+        }
+
+        virtual void update(const double duration_ms) override final {
+            std::queue<MSG> * mailbox = base_system::mbox<MSG>();
+            while (!mailbox->empty()) {
+                MSG msg = mailbox->front();
+                mailbox->pop();
+                on_message(msg);
+            }
+        }
+
+        virtual void on_message(const MSG &msg)=0;
+    };
+
+    /*
+     * How an ecs lays out component data. SPARSE_SET (the default) keeps one store per component type. ARCHETYPE
+     * keeps entities with the same component mask together, in fixed-size chunks holding an array per component,
+     * so each<A, B, C> is a linear scan over the matching chunks rather than a lookup per component per entity.
+     *
+     * In ARCHETYPE mode adding or removing a component moves the entity's components to another archetype, so
+     * component pointers are only good until the entity's component set changes. Changes made while an each is
+     * running are held back until the outermost each returns: removals hide the component at once, and a new
+     * component becomes visible when the iteration ends.
+     */
+    enum class storage_mode_t { SPARSE_SET, ARCHETYPE };
 
     /*
  * Class that holds an entity-component-system. This was moved to a class to allow for multiple instances.
  */
     class ecs {
     public:
+        explicit ecs(const storage_mode_t mode = storage_mode_t::SPARSE_SET) : storage_mode(mode) {}
+
+        /*
+         * Switches how component data is laid out (see storage_mode_t). This can only be done while the ecs has
+         * no entities.
+         */
+        inline void set_storage_mode(const storage_mode_t mode) {
+            if (mode == storage_mode) return;
+            if (entity_store.size() > 0) throw std::runtime_error("The storage mode can only be changed while the ECS is empty.");
+            component_store.clear();
+            mapped.reset();
+            archetypes.clear();
+            storage_mode = mode;
+        }
+
+        inline storage_mode_t get_storage_mode() const noexcept {
+            return storage_mode;
+        }
+
         /*
          * entity(ID) is used to reference an entity. So you can, for example, do:
          * entity(12)->component<position_component>()->x = 3;
          */
         entity_t * entity(const std::size_t id) noexcept;
 
+        /*
+         * entity(handle) is like entity(ID), but returns nullptr if the handle's entity has been deleted - even
+         * if its ID has since been recycled.
+         */
+        entity_t * entity(const entity_handle_t &handle) noexcept;
+
         /*
          * Creates an entity with a new ID #. Returns a pointer to the entity, to enable
          * call chaining. For example create_entity()->assign(foo)->assign(bar)
@@ -477,32 +2777,192 @@ namespace rltk {
          */
         entity_t * create_entity(const std::size_t new_id);
 
+        /*
+         * Creates count entities at once, with consecutive IDs, and returns their range. This skips the search
+         * for a free ID that create_entity does, and grows the entity store once. Pair it with assign_batch:
+         * auto wave = create_entities(10000); assign_batch<monster>(wave, monster_template);
+         */
+        entity_range_t create_entities(const std::size_t count);
+
+        /*
+         * Assigns components[i] to entity range[i], for every entity in the range. The single-component form gives
+         * every entity in the range a copy of it. The result is exactly what assigning one at a time would give
+         * (entities that have been deleted are skipped) - but for a range of entities that don't have a C yet, in
+         * SPARSE_SET mode, the components are block-copied into the store rather than added one by one.
+         */
+        template <class C>
+        inline void assign_batch(const entity_range_t &range, span_t<const C> components) {
+            if (components.size() != range.size()) throw std::runtime_error("assign_batch needs one component for each entity in the range.");
+            if (range.size() == 0) return;
+            if (batch_claim<C>(range)) {
+                if (!impl::is_tag<C>::value) get_or_create_store<C>()->append(range.first, range.size(), components.data(), false);
+                batch_appended<C>(range);
+                return;
+            }
+            for (std::size_t i=0; i<range.size(); ++i) {
+                entity_t * e = entity(range[i]);
+                if (e) impl::assign<C>(*this, *e, components[i]);
+            }
+        }
+
+        template <class C>
+        inline void assign_batch(const entity_range_t &range, const C &component) {
+            if (range.size() == 0) return;
+            if (batch_claim<C>(range)) {
+                if (!impl::is_tag<C>::value) get_or_create_store<C>()->append(range.first, range.size(), &component, true);
+                batch_appended<C>(range);
+                return;
+            }
+            for (std::size_t i=0; i<range.size(); ++i) {
+                entity_t * e = entity(range[i]);
+                if (e) impl::assign<C>(*this, *e, component);
+            }
+        }
+
+        /*
+         * Resources: world-global data - the game clock, the current map, the RNG - held once by the ecs rather
+         * than faked as a component on a dummy entity. set_resource<R>(value) stores an R (replacing the value of
+         * one already there, so references to it stay valid); resource<R>() returns it in O(1), or nullptr if none
+         * has been set. Setting and deleting resources is not thread-safe; reading them is. Resources are not
+         * written by ecs_save.
+         */
+        template <class R>
+        inline R & set_resource(R value) {
+            const std::size_t family_id = impl::resource_family<R>::id();
+            if (resources.size() < family_id+1) resources.resize(family_id+1);
+            if (resources[family_id]) {
+                R &existing = static_cast<impl::resource_t<R> *>(resources[family_id].get())->data;
+                existing = std::move(value);
+                return existing;
+            }
+            resources[family_id] = std::make_unique<impl::resource_t<R>>(std::move(value));
+            return static_cast<impl::resource_t<R> *>(resources[family_id].get())->data;
+        }
+
+        template <class R>
+        inline R * resource() noexcept {
+            const std::size_t family_id = impl::resource_family<R>::id();
+            if (family_id >= resources.size() || !resources[family_id]) return nullptr;
+            return &static_cast<impl::resource_t<R> *>(resources[family_id].get())->data;
+        }
+
+        template <class R>
+        inline void delete_resource() noexcept {
+            const std::size_t family_id = impl::resource_family<R>::id();
+            if (family_id < resources.size()) resources[family_id].reset();
+        }
+
+        /*
+         * Prefabs. define_prefab(name) registers a new, empty prefab under name (replacing any already there) and
+         * returns it, ready for prefab_t::with calls; define_prefab(name, prefab) registers a copy of one built
+         * elsewhere. prefab(name) finds a registered prefab (nullptr if there isn't one). References stay valid
+         * until the prefab is redefined or delete_all_prefabs is called, so hot spawn paths can look a prefab up
+         * once and keep it.
+         */
+        inline prefab_t & define_prefab(const std::string &name) {
+            std::unique_ptr<prefab_t> &slot = prefabs[name];
+            slot = std::make_unique<prefab_t>();
+            return *slot;
+        }
+
+        inline prefab_t & define_prefab(const std::string &name, const prefab_t &prefab) {
+            return define_prefab(name) = prefab;
+        }
+
+        inline prefab_t * prefab(const std::string &name) noexcept {
+            auto finder = prefabs.find(name);
+            return finder == prefabs.end() ? nullptr : finder->second.get();
+        }
+
+        inline void delete_all_prefabs() noexcept {
+            prefabs.clear();
+        }
+
+        /*
+         * Creates an entity with a copy of each of the prefab's components. Any components passed as overrides
+         * are assigned in place of the prefab's component of the same type (or in addition to the prefab's
+         * components, if it has none of that type): instantiate(orc, position{ 3, 4 }). Observers see one
+         * on_add per component, exactly as for assigning them by hand.
+         */
+        template <typename... Os>
+        inline entity_t * instantiate(const prefab_t &source, Os &&... overrides) {
+            entity_t * e = create_entity();
+            const std::bitset<impl::MAX_COMPONENTS> overridden = override_mask<Os...>();
+            for (const auto &c : source.components) {
+                if (!overridden.test(c->family_id)) c->instantiate(*this, *e);
+            }
+            int unused[] = { 0, (impl::assign<typename std::decay<Os>::type>(*this, *e, std::forward<Os>(overrides)), 0)... };
+            (void)unused;
+            return e;
+        }
+
+        template <typename... Os>
+        inline entity_t * instantiate(const std::string &name, Os &&... overrides) {
+            return instantiate(registered_prefab(name), std::forward<Os>(overrides)...);
+        }
+
+        /*
+         * Creates count entities from a prefab with create_entities, and gives each component to the whole range
+         * with assign_batch. Overrides are either a single component, which every entity gets, or a
+         * span_t<const C> with one C per entity: instantiate_batch(orc, 100, span_t<const position>(spots)).
+         */
+        template <typename... Os>
+        inline entity_range_t instantiate_batch(const prefab_t &source, const std::size_t count, const Os &... overrides) {
+            const entity_range_t range = create_entities(count);
+            const std::bitset<impl::MAX_COMPONENTS> overridden = override_mask<Os...>();
+            for (const auto &c : source.components) {
+                if (!overridden.test(c->family_id)) c->instantiate(*this, range);
+            }
+            int unused[] = { 0, (assign_batch<typename impl::override_type<Os>::type>(range, overrides), 0)... };
+            (void)unused;
+            return range;
+        }
+
+        template <typename... Os>
+        inline entity_range_t instantiate_batch(const std::string &name, const std::size_t count, const Os &... overrides) {
+            return instantiate_batch(registered_prefab(name), count, overrides...);
+        }
+
         /*
          * Marks an entity (specified by ID#) as deleted.
          */
-        inline void delete_entity(const std::size_t id) noexcept {
+        inline void delete_entity(const std::size_t id) {
             auto e = entity(id);
             if (!e) return;
 
+            if (storage_mode == storage_mode_t::ARCHETYPE) {
+                // Drop the whole row at once, rather than moving through an archetype per component
+                for (std::size_t family_id=0; family_id<impl::MAX_COMPONENTS; ++family_id) {
+                    if (!e->component_mask.test(family_id)) continue;
+                    observe_removal(*e, family_id);
+                    unset_component_mask(id, family_id, false);
+                }
+            } else {
+                for (std::size_t family_id=0; family_id<impl::MAX_COMPONENTS && e->component_mask.any(); ++family_id) {
+                    if (e->component_mask.test(family_id)) delete_component(id, family_id, false);
+                }
+            }
             e->deleted = true;
-            for (auto &store : component_store) {
-                if (store) store->erase_by_entity_id(*this, id);
+            for (auto &v : views) {
+                if (v) v->on_entity_deleted(*e);
             }
+            pending_entity_deletes.push_back(id);
+            if (storage_mode == storage_mode_t::ARCHETYPE) archetype_changed(id);
         }
 
         /*
          * Marks an entity as deleted.
          */
-        inline void delete_entity(entity_t &e) noexcept {
+        inline void delete_entity(entity_t &e) {
             delete_entity(e.id);
         }
 
         /*
          * Deletes all entities
          */
-        inline void delete_all_entities() noexcept  {
-            for (auto it=entity_store.begin(); it!=entity_store.end(); ++it) {
-                delete_entity(it->first);
+        inline void delete_all_entities() {
+            for (entity_t &e : entity_store) {
+                delete_entity(e.id);
             }
         }
 
@@ -510,19 +2970,8 @@ namespace rltk {
          * Marks an entity's component as deleted.
          */
         template<class C>
-        inline void delete_component(const std::size_t entity_id, bool delete_entity_if_empty=false) noexcept {
-            auto eptr = entity(entity_id);
-            if (!eptr) return;
-            entity_t e = *entity(entity_id);
-            C empty_component;
-            impl::component_t<C> temp(empty_component);
-            if (!e.component_mask.test(temp.family_id)) return;
-            for (impl::component_t<C> &component : static_cast<impl::component_store_t<impl::component_t<C>> *>(component_store[temp.family_id].get())->components) {
-                if (component.entity_id == entity_id) {
-                    component.deleted = true;
-                    unset_component_mask(entity_id, temp.family_id, delete_entity_if_empty);
-                }
-            }
+        inline void delete_component(const std::size_t entity_id, bool delete_entity_if_empty=false) {
+            delete_component(entity_id, impl::component_family<C>::id(), delete_entity_if_empty);
         }
 
         /*
@@ -531,12 +2980,11 @@ namespace rltk {
          */
         template<class C>
         inline std::vector<entity_t *> entities_with_component() {
-            C empty_component;
             std::vector<entity_t *> result;
-            impl::component_t<C> temp(empty_component);
-            for (auto it=entity_store.begin(); it!=entity_store.end(); ++it) {
-                if (!it->second.deleted && it->second.component_mask.test(temp.family_id)) {
-                    result.push_back(&it->second);
+            const std::size_t family_id = impl::component_family<C>::id();
+            for (entity_t &e : entity_store) {
+                if (!e.deleted && e.component_mask.test(family_id)) {
+                    result.push_back(&e);
                 }
             }
             return result;
@@ -548,96 +2996,414 @@ namespace rltk {
          * all_components<position>([] (entity_t &e, position &p) {...}) would execute the
          * function body (...) for every entity/component position pair.
          */
+        template <class C, typename F>
+        inline void all_components(F func) {
+            if (impl::is_tag<C>::value) return each<C>(func); // Tags have no store to walk
+            if (storage_mode == storage_mode_t::ARCHETYPE) {
+                archetype_iteration_t guard(*this);
+                archetype_chunks(impl::required_mask<C>(), [this, &func] (impl::archetype_t &archetype, const impl::archetype_t::chunk_t &chunk) {
+                    each_archetype_row<C>(archetype, chunk, func);
+                });
+                return;
+            }
+            typename impl::store_for<C>::type * store = get_store<C>();
+            if (!store) return;
+            const std::size_t count = store->size();
+            for (std::size_t i=0; i<count; ++i) {
+                if (store->is_deleted(i)) continue;
+                entity_t * e = entity(store->entity_ids[i]);
+                if (e) store->visit(i, [&func, e] (C &component) { func(*e, component); });
+            }
+        }
+
+        /*
+         * each_chunk hands func(component_chunk_t<C> &) the raw dense arrays for component type C, so a simple
+         * per-component loop can be written over plain arrays (and vectorised). Types with an soa_layout get an
+         * soa_chunk_t<C> instead, with one array per member. Check chunk.is_deleted(i) if deletions may be
+         * pending. func may delete components, but must not assign a C (that can move the arrays). In archetype
+         * mode func is called once per archetype chunk holding a C (soa_layout types are not supported there).
+         */
+        template <class C, typename F>
+        inline void each_chunk(F func) {
+            static_assert(!impl::is_tag<C>::value, "Tag components have no data to chunk; use each or all_components");
+            if (storage_mode == storage_mode_t::ARCHETYPE) {
+                archetype_iteration_t guard(*this);
+                archetype_chunks(impl::required_mask<C>(), [this, &func] (impl::archetype_t &archetype, const impl::archetype_t::chunk_t &chunk) {
+                    auto component_chunk = archetype_chunk<C>(archetype, chunk, std::integral_constant<bool, soa_layout<C>::enabled>());
+                    func(component_chunk);
+                });
+                return;
+            }
+            typename impl::store_for<C>::type * store = get_store<C>();
+            if (!store || store->size() == 0) return;
+            auto chunk = store->chunk(0, store->size());
+            func(chunk);
+        }
+
+        /*
+         * Variadic each. Use this to call a function for all entities having a discrete set of components. For example,
+         * each<position, ai>([] (entity_t &e, position &pos, ai &brain) { ... code ... });
+         * With no component types, each([] (entity_t &e) { ... }) calls the function on _every_ entity in the system.
+         */
+        template <typename... Cs, typename F>
+        inline void each(F callback) {
+            view<Cs...>().each(callback);
+        }
+
+        /*
+         * Variadic each_if. Use this to call a function for all entities having a discrete set of components. For example,
+         * each<position, ai>([] (entity_t &e, position &pos, ai &brain) { ... code returns true if needs processing ... },
+         * [] (entity_t &e, position &pos, ai &brain) { ... code ... });
+         */
+        template <typename... Cs, typename P, typename F>
+        inline void each_if(P&& predicate, F callback) {
+            view<Cs...>().each_if(predicate, callback);
+        }
+
+        /*
+         * Parallel variadic each. Calls callback(entity_t &, Cs &...) for every entity having all of Cs, with the
+         * matching entities split into ranges of grain and spread over the worker pool. Returns when all are done.
+         *
+         * This is safe as long as callbacks only read the world and mutate the components they are handed: they
+         * must not create or delete entities, or assign or delete components (record those with commands()
+         * instead), emit (emit_deferred is fine), or touch components of other entities that another callback may
+         * be writing.
+         */
+        template <typename... Cs, typename F>
+        inline void parallel_each(F callback, const std::size_t grain = impl::DEFAULT_GRAIN) {
+            view<Cs...>().parallel_each(callback, grain);
+        }
+
+        /*
+         * Parallel all_components. Calls func(entity_t &, C &) for every live component of type C, splitting the
+         * dense component array into ranges of grain across the worker pool. The same rules as parallel_each apply.
+         */
+        template <class C, typename F>
+        inline void parallel_all_components(F func, const std::size_t grain = impl::DEFAULT_GRAIN) {
+            if (impl::is_tag<C>::value) return parallel_each<C>(func, grain);
+            if (storage_mode == storage_mode_t::ARCHETYPE) {
+                parallel_archetype_chunks(impl::required_mask<C>(), [this, &func] (impl::archetype_t &archetype, const impl::archetype_t::chunk_t &chunk) {
+                    each_archetype_row<C>(archetype, chunk, func);
+                });
+                return;
+            }
+            typename impl::store_for<C>::type * store = get_store<C>();
+            if (!store) return;
+            workers().parallel_for(store->size(), grain, [this, store, &func] (const std::size_t begin, const std::size_t end) {
+                for (std::size_t i=begin; i<end; ++i) {
+                    if (store->is_deleted(i)) continue;
+                    entity_t * e = entity(store->entity_ids[i]);
+                    if (e) store->visit(i, [&func, e] (C &component) { func(*e, component); });
+                }
+            });
+        }
+
+        /*
+         * Parallel each_chunk. The dense arrays for C are cut into chunks of grain components, and func is called
+         * with each chunk on the worker pool. The same rules as parallel_each apply.
+         */
+        template <class C, typename F>
+        inline void parallel_each_chunk(F func, const std::size_t grain = impl::DEFAULT_GRAIN) {
+            static_assert(!impl::is_tag<C>::value, "Tag components have no data to chunk; use parallel_each");
+            if (storage_mode == storage_mode_t::ARCHETYPE) {
+                parallel_archetype_chunks(impl::required_mask<C>(), [this, &func] (impl::archetype_t &archetype, const impl::archetype_t::chunk_t &chunk) {
+                    auto component_chunk = archetype_chunk<C>(archetype, chunk, std::integral_constant<bool, soa_layout<C>::enabled>());
+                    func(component_chunk);
+                });
+                return;
+            }
+            typename impl::store_for<C>::type * store = get_store<C>();
+            if (!store) return;
+            workers().parallel_for(store->size(), grain, [store, &func] (const std::size_t begin, const std::size_t end) {
+                auto chunk = store->chunk(begin, end);
+                func(chunk);
+            });
+        }
+
+        /*
+         * Change tracking. Assigning a component, or calling mark_changed, stamps it with the current change tick.
+         * each_changed<C>(since, func) then visits only the entities whose C was stamped after since - so a system
+         * that reacts to changes costs O(changes) rather than O(entities). ecs_tick advances the tick before and
+         * after each wave of systems, and each system remembers the tick of its previous update; see
+         * base_system::each_changed. Modifying a component through a reference (from each, component<C> and so
+         * on) is not noticed: call mark_changed.
+         *
+         * A component type is tracked from the first each_changed (or track_changes) call for it, at which point
+         * every existing C counts as changed. That first call is not thread-safe, so call track_changes<C>() up
+         * front (for example in a system's configure) if the systems using each_changed<C> can run in parallel.
+         * Changes are kept until every system has run since, and for at least one ecs_garbage_collect.
+         */
+        template <class C>
+        inline void track_changes() {
+            change_log<C>();
+        }
+
+        /* Stamps an entity's component as changed; safe from parallel callbacks once C is tracked. */
+        template <class C>
+        inline void mark_changed(entity_t &e) {
+            stamp_change(e, impl::component_family<C>::id());
+        }
+
+        /*
+         * Returns a tick to pass to each_changed later, to visit what changes after this call. The tick is advanced,
+         * so nothing changed afterwards is stamped with the returned value. Don't call it while systems are running.
+         */
+        inline std::size_t change_checkpoint() noexcept {
+            return change_tick++;
+        }
+
+        /*
+         * Calls func(entity_t &, C &, Cs &...) for every live entity whose C has changed since the given tick and
+         * that has all of Cs, oldest change first.
+         */
+        template <class C, class... Cs, typename F>
+        inline void each_changed(const std::size_t since, F func) {
+            impl::change_log_t &log = change_log<C>();
+            const std::bitset<impl::MAX_COMPONENTS> &required = impl::required_mask<C, Cs...>();
+            if (storage_mode == storage_mode_t::ARCHETYPE) {
+                archetype_iteration_t guard(*this);
+                log.since(since, [this, &required, &func] (const entity_handle_t &handle) {
+                    entity_t * e = entity(handle);
+                    if (e && (e->component_mask & required) == required) func(*e, *archetypes.find<C>(e->id), *archetypes.find<Cs>(e->id)...);
+                });
+                return;
+            }
+            log.since(since, [this, &required, &func] (const entity_handle_t &handle) {
+                entity_t * e = entity(handle);
+                if (e && (e->component_mask & required) == required) {
+                    func(*e, impl::component_ref_t<C>(*this, *e).get(), impl::component_ref_t<Cs>(*this, *e).get()...);
+                }
+            });
+        }
+
+        /*
+         * Observers. on_add<C>(func) has func(entity_t &, const C &) called whenever an entity gains a C;
+         * on_replace<C> gets func(entity_t &, const C &old, const C &now) when an existing C is re-assigned;
+         * on_remove<C> gets func(entity_t &, const C &) when a C is deleted (including by deleting its entity).
+         * Use them to keep derived indices - spatial hashes, lookup tables - up to date without rescanning.
+         *
+         * Calls are not made on the spot: events are queued, with copies of the values involved, and delivered
+         * in batches at sync points - after each wave of systems in ecs_tick, at the start of ecs_garbage_collect
+         * (so entities removed by it are still there to be handed over), or whenever notify_observers is called.
+         * Each type's events arrive in the order they happened; there is no ordering between types. Observers
+         * may change the world; any events that causes are delivered in the same batch. In-place modifications
+         * through references are not assignments, and are not observed.
+         */
+        template <class C>
+        inline void on_add(std::function<void(entity_t &, const C &)> func) {
+            if (func) observer<C>(true)->on_add.push_back(func);
+        }
+
+        template <class C>
+        inline void on_replace(std::function<void(entity_t &, const C &, const C &)> func) {
+            if (func) observer<C>(true)->on_replace.push_back(func);
+        }
+
         template <class C>
-        inline void all_components(typename std::function<void(entity_t &, C &)> func) {
-            C empty_component;
-            impl::component_t<C> temp(empty_component);
-            for (impl::component_t<C> &component : static_cast<impl::component_store_t<impl::component_t<C>> *>(component_store[temp.family_id].get())->components) {
-                entity_t e = *entity(component.entity_id);
-                if (!e.deleted && !component.deleted) {
-                    func(e, component.data);
+        inline void on_remove(std::function<void(entity_t &, const C &)> func) {
+            if (func) observer<C>(true)->on_remove.push_back(func);
+        }
+
+        /*
+         * Delivers every queued observer event, then re-reads the positions marked changed for index_positions.
+         * Call only when no system or parallel iteration is running.
+         */
+        void notify_observers();
+
+        /*
+         * Spatial queries. index_positions<C>(cell_size) designates C as the position component: from then on
+         * every entity with a C is kept in a spatial hash, so entities_at, entities_in_rect and entities_in_radius
+         * only visit the cells they cover instead of scanning the world. C needs int x and y members, or pass a
+         * navigator with static get_x(const C &) and get_y(const C &) (as for path finding and visibility).
+         *
+         * The index is maintained by observers (see on_add), so it reflects assigns and deletions as of the last
+         * sync point - call notify_observers to catch up sooner. C is change-tracked too (see track_changes), and
+         * positions modified in place are re-read at the same points, as long as they were marked with
+         * mark_changed. Only one component type can be indexed per ecs.
+         */
+        template <class C, class NAV = impl::xy_navigator<C>>
+        inline void index_positions(const int cell_size = 8) {
+            const std::size_t family_id = impl::component_family<C>::id();
+            if (cell_size < 1) throw std::runtime_error("index_positions needs a cell size of at least 1.");
+            if (positions) {
+                if (positions->family_id != family_id) throw std::runtime_error("Only one component type can be used for positions.");
+                return;
+            }
+            positions = std::make_unique<impl::spatial_index_t>();
+            positions->cell_size = cell_size;
+            positions->family_id = family_id;
+            positions->seed = [this] (impl::spatial_index_t &index) {
+                all_components<C>([&index] (entity_t &e, C &pos) { index.insert(e.id, NAV::get_x(pos), NAV::get_y(pos)); });
+            };
+            positions->seed(*positions);
+            positions->resync = [this] (impl::spatial_index_t &index, const std::size_t since) {
+                change_log<C>().since(since, [this, &index] (const entity_handle_t &handle) {
+                    entity_t * e = entity(handle);
+                    const C * pos = e ? impl::component<C>(*this, *e) : nullptr;
+                    if (pos) index.insert(e->id, NAV::get_x(*pos), NAV::get_y(*pos));
+                });
+            };
+            track_changes<C>();
+            positions->synced_tick = change_checkpoint();
+            on_add<C>([this] (entity_t &e, const C &pos) {
+                if (!e.deleted) positions->insert(e.id, NAV::get_x(pos), NAV::get_y(pos));
+            });
+            on_replace<C>([this] (entity_t &e, const C &, const C &pos) {
+                if (!e.deleted) positions->insert(e.id, NAV::get_x(pos), NAV::get_y(pos));
+            });
+            on_remove<C>([this] (entity_t &e, const C &) {
+                positions->remove(e.id);
+            });
+        }
+
+        /* Live entities whose position is exactly x,y */
+        inline std::vector<entity_t *> entities_at(const int x, const int y) {
+            return entities_in_rect(x, y, x, y);
+        }
+
+        /* Live entities positioned inside the rectangle x1,y1 - x2,y2 (inclusive) */
+        inline std::vector<entity_t *> entities_in_rect(const int x1, const int y1, const int x2, const int y2) {
+            std::vector<entity_t *> result;
+            if (!positions) return result;
+            positions->in_rect(x1, y1, x2, y2, [this, &result] (const std::size_t id, const int, const int) {
+                entity_t * e = entity(id);
+                if (e) result.push_back(e);
+            });
+            return result;
+        }
+
+        /* Live entities positioned within radius of x,y */
+        inline std::vector<entity_t *> entities_in_radius(const int x, const int y, const float radius) {
+            std::vector<entity_t *> result;
+            if (!positions || radius < 0.0F) return result;
+            const int reach = static_cast<int>(std::ceil(radius));
+            const float radius_squared = radius * radius;
+            positions->in_rect(x - reach, y - reach, x + reach, y + reach, [this, &result, x, y, radius_squared] (const std::size_t id, const int px, const int py) {
+                if (distance2d_squared(x, y, px, py) > radius_squared) return;
+                entity_t * e = entity(id);
+                if (e) result.push_back(e);
+            });
+            return result;
+        }
+
+        /* Removes every observer (and drops their queued events), including those keeping index_positions up to date */
+        inline void delete_all_observers() noexcept {
+            observers.clear();
+            dirty_observers.clear();
+            positions.reset();
+        }
+
+        /*
+         * The worker pool used by the parallel iterators; it is started on first use.
+         */
+        inline thread_pool & workers() {
+            if (!worker_pool) {
+                worker_pool = std::make_unique<thread_pool>(worker_threads);
+                while (command_buffers.size() < worker_pool->size() + 1) {
+                    command_buffers.push_back(std::make_unique<command_buffer_t>(*this));
                 }
             }
+            return *worker_pool;
+        }
+
+        /*
+         * Sets the number of worker threads (0 = one less than the number of hardware threads). Takes effect by
+         * restarting the pool, so don't call it from inside a parallel iteration.
+         */
+        inline void set_worker_threads(const std::size_t threads) {
+            play_back_commands();
+            worker_threads = threads;
+            worker_pool.reset();
+        }
+
+        /*
+         * Returns the command buffer for the calling thread: one per pool worker, plus one shared by every other
+         * thread (normally just the one calling ecs_tick).
+         */
+        inline command_buffer_t & commands() {
+            const std::size_t worker = worker_pool ? worker_pool->worker_index() : thread_pool::NOT_A_WORKER;
+            if (command_buffers.empty()) command_buffers.push_back(std::make_unique<command_buffer_t>(*this));
+            return *command_buffers[worker == thread_pool::NOT_A_WORKER ? 0 : worker + 1];
         }
 
         /*
-         * each, overloaded with a function/lambda that accepts an entity, will call the provided
-         * function on _every_ entity in the system.
+         * Applies every recorded command, from all buffers, and clears them. Commands are sorted by entity (then by
+         * buffer and recording order), so each entity's changes apply in the order they were made, and stores are
+         * grown once per batch rather than once per component. Call only when no system or parallel iteration is
+         * running.
          */
-        void each(std::function<void(entity_t &)> &&func);
+        void play_back_commands();
 
         /*
-         * Variadic each. Use this to call a function for all entities having a discrete set of components. For example,
-         * each<position, ai>([] (entity_t &e, position &pos, ai &brain) { ... code ... });
+         * Deletes a component by family ID; the type-erased form of delete_component<C>.
          */
-        template <typename... Cs, typename F>
-        inline void each(F callback) {
-            std::array<size_t, sizeof...(Cs)> family_ids{ {impl::component_t<Cs>{}.family_id...} };
-            for (auto it=entity_store.begin(); it!=entity_store.end(); ++it) {
-                if (!it->second.deleted) {
-                    bool matches = true;
-                    for (const std::size_t &compare : family_ids) {
-                        if (!it->second.component_mask.test(compare)) {
-                            matches = false;
-                            break;
-                        }
-                    }
-                    if (matches) {
-                        // Call the functor
-                        callback(it->second, *it->second.component<Cs>()...);
-                    }
-                }
+        inline void delete_component(const std::size_t entity_id, const std::size_t family_id, bool delete_entity_if_empty) {
+            entity_t * e = entity(entity_id);
+            if (!e || !e->component_mask.test(family_id)) return;
+            observe_removal(*e, family_id);
+            if (storage_mode == storage_mode_t::ARCHETYPE) {
+                unset_component_mask(entity_id, family_id, delete_entity_if_empty);
+                archetype_changed(entity_id);
+                return;
+            }
+            if (impl::tag_families().test(family_id)) {
+                unset_component_mask(entity_id, family_id, delete_entity_if_empty);
+                return;
+            }
+            if (mapped) materialise(family_id);
+            if (family_id < component_store.size() && component_store[family_id] && component_store[family_id]->mark_deleted(entity_id)) {
+                ++pending_component_deletes;
+                unset_component_mask(entity_id, family_id, delete_entity_if_empty);
             }
         }
 
         /*
-         * Variadic each_if. Use this to call a function for all entities having a discrete set of components. For example,
-         * each<position, ai>([] (entity_t &e, position &pos, ai &brain) { ... code returns true if needs processing ... },
-         * [] (entity_t &e, position &pos, ai &brain) { ... code ... });
+         * Returns a cached query for entities having all of the components Cs. The first call for a given set of
+         * types scans the entity store; after that the list is maintained as components are assigned and removed,
+         * so iterating it only visits matching entities. For example:
+         * auto renderables = view<position, renderable>();
+         * renderables.each([] (entity_t &e, position &pos, renderable &r) { ... });
          */
-        template <typename... Cs, typename P, typename F>
-        inline void each_if(P&& predicate, F callback) {
-            std::array<size_t, sizeof...(Cs)> family_ids{ {impl::component_t<Cs>{}.family_id...} };
-            for (auto it=entity_store.begin(); it!=entity_store.end(); ++it) {
-                if (!it->second.deleted) {
-                    bool matches = true;
-                    for (const std::size_t &compare : family_ids) {
-                        if (!it->second.component_mask.test(compare)) {
-                            matches = false;
-                            break;
-                        }
-                    }
-                    if (matches && predicate(it->second, *it->second.component<Cs>()...)) {
-                        // Call the functor
-                        callback(it->second, *it->second.component<Cs>()...);
-                    }
-                }
+        template <typename... Cs>
+        inline view_t<Cs...> view() {
+            std::unique_lock<std::mutex> lock(views_mutex, std::defer_lock);
+            if (in_parallel_wave) lock.lock(); // Systems in the wave may ask for (and create) views at the same time
+            const std::size_t view_id = impl::view_family<Cs...>::id();
+            if (views.size() < view_id+1) {
+                views.resize(view_id+1);
+            }
+            if (!views[view_id]) {
+                std::unique_ptr<impl::view_cache_t> cache = std::make_unique<impl::view_cache_t>();
+                cache->required = impl::required_mask<Cs...>();
+                cache->rebuild(entity_store);
+                cache->held = in_parallel_wave;
+                views[view_id] = std::move(cache);
             }
+            return view_t<Cs...>{ this, views[view_id].get() };
         }
 
         /*
          * This should be called periodically to actually erase all entities and components that are marked as deleted.
+         * Deletions are queued as they happen, so this only visits what was deleted - and returns straight away when
+         * nothing was.
          */
         inline void ecs_garbage_collect() {
-            std::unordered_set<std::size_t> entities_to_delete;
+            if (storage_mode == storage_mode_t::ARCHETYPE) flush_archetype_changes();
+            if (!change_logs.empty()) trim_change_logs();
+            if (!dirty_observers.empty()) notify_observers();
+            if (pending_component_deletes == 0 && pending_entity_deletes.empty()) return;
 
-            // Ensure that components are marked as deleted, and list out entities for erasure
-            for (auto it=entity_store.begin(); it!=entity_store.end(); ++it) {
-                if (it->second.deleted) {
-                    for (std::unique_ptr<impl::base_component_store> &store : component_store) {
-                        if (store) store->erase_by_entity_id(*this, it->second.id);
-                    }
-                    entities_to_delete.insert(it->second.id);
+            // Erase components; deleting an entity queued all of its components.
+            if (pending_component_deletes > 0) {
+                for (std::unique_ptr<impl::base_component_store> &store : component_store) {
+                    if (store) store->really_delete();
                 }
+                pending_component_deletes = 0;
             }
 
             // Actually delete entities
-            for (const std::size_t &id : entities_to_delete) entity_store.erase(id);
-
-            // Now we erase components
-            for (std::unique_ptr<impl::base_component_store> &store : component_store) {
-                if (store) store->really_delete();
-            }
+            for (const std::size_t &id : pending_entity_deletes) entity_store.erase(id);
+            pending_entity_deletes.clear();
         }
 
         /*
@@ -646,34 +3412,25 @@ namespace rltk {
          */
         template <class MSG>
         inline void emit(MSG message) {
-            impl::message_t<MSG> handle(message);
-            if (pubsub_holder.size() > handle.family_id) {
-                for (auto &func : static_cast<impl::subscription_holder_t<MSG> *>(pubsub_holder[handle.family_id].get())->subscriptions) {
-                    if (std::get<0>(func) && std::get<1>(func)) {
-                        std::get<1>(func)(message);
-                    } else {
-                        // It is destined for the system's mailbox queue.
-                        auto finder = std::get<2>(func)->mailboxes.find(handle.family_id);
-                        if (finder != std::get<2>(func)->mailboxes.end()) {
-                            static_cast<impl::mailbox_t<MSG> *>(finder->second.get())->messages.push(message);
-                        }
-                    }
-                }
+            const std::size_t family_id = impl::message_family<MSG>::id();
+            if (pubsub_holder.size() > family_id && pubsub_holder[family_id]) {
+                static_cast<impl::subscription_holder_t<MSG> *>(pubsub_holder[family_id].get())->dispatch(span_t<MSG>(&message, 1), false);
             }
         }
 
         /*
          * Submits a message for delivery. It will be delivered to every system that has issued a subscribe or subscribe_mbox
-         * call at the end of the next system execution. This is thead-safe, so you can emit_defer from within a parallel_each.
+         * call at the end of the next system execution (or wave of parallel systems). This is thread-safe, and lock-free
+         * unless a burst overflows the type's queue (see mpsc_queue), so you can emit_deferred from within a parallel_each
+         * or a system running on a worker thread.
          */
         template <class MSG>
         inline void emit_deferred(MSG message) {
-            impl::message_t<MSG> handle(message);
-            if (pubsub_holder.size() > handle.family_id) {
-
-                auto * subholder = static_cast<impl::subscription_holder_t<MSG> *>(pubsub_holder[handle.family_id].get());
-                std::lock_guard<std::mutex> postlock(subholder->delivery_mutex);
-                subholder->delivery_queue.push(message);
+            const std::size_t family_id = impl::message_family<MSG>::id();
+            if (pubsub_holder.size() > family_id && pubsub_holder[family_id]) {
+                auto * holder = static_cast<impl::subscription_holder_t<MSG> *>(pubsub_holder[family_id].get());
+                holder->delivery_queue.push(std::move(message));
+                if (!holder->queued.exchange(true)) dirty_messages.push(family_id);
             }
         }
 
@@ -682,6 +3439,7 @@ namespace rltk {
         inline void add_system( Args && ... args ) {
             system_store.push_back(std::make_unique<S>( std::forward<Args>(args) ... ));
             system_profiling.push_back(system_profiling_t{});
+            schedule_dirty = true;
         }
 
         void delete_all_systems();
@@ -690,20 +3448,201 @@ namespace rltk {
 
         void ecs_tick(const double duration_ms);
 
-        void ecs_save(std::unique_ptr<std::ofstream> &lbfile);
+        /*
+         * Saves the world as a native snapshot: a header mapping each component type's name to the family ID it
+         * was saved under, then one section for the entities and one per component store. Arrays of trivially
+         * copyable components are written with a single block copy; other types go through their cereal
+         * serialize. ecs_load reads snapshots - remapping family IDs by name, so the order in which types were
+         * registered doesn't matter - as well as saves made in the older all-cereal format.
+         *
+         * With compress set, each section is zlib-compressed in 1 MB chunks spread over the worker pool (see
+         * set_worker_threads), and ecs_load inflates them on the pool in the same way, then fills the stores in
+         * parallel. ecs_load_mapped loads a compressed snapshot in full rather than lazily.
+         */
+        void ecs_save(std::unique_ptr<std::ofstream> &lbfile, const bool compress = false);
+
+        /*
+         * Saves the world to path without holding up the game. The call itself only copies the entity list and
+         * each store's dense arrays (into the buffers the previous save used, once it has finished with them, so
+         * regular autosaves don't pay for fresh memory); serialising, compressing and writing the file happen on
+         * a background thread. Call it between ticks, like ecs_save - the copy is of the world as it stands. The
+         * file is written alongside as path.tmp and renamed over path once complete, so a crash mid-save never
+         * leaves a broken file, and a snapshot ecs_load_mapped is reading from stays intact. The future is ready
+         * when the file is, and get() re-throws anything that went wrong. It is only a completion handle: unlike
+         * one from std::async, dropping it doesn't wait for the save, which carries on regardless. Wait on it
+         * before the program exits if the file must be written.
+         *
+         * With compress set, the sections are compressed as for ecs_save, on a pool of the background thread's
+         * own (sized as set_worker_threads would size the ecs's), so the save never competes with parallel_each
+         * for the ecs's workers.
+         */
+        std::future<void> ecs_save_async(const std::string &path, const bool compress = true);
+
+        /*
+         * Delta saves. Once enable_delta_saves has been called, ecs_save_delta writes only what has changed since
+         * the previous save (full or delta): entities created, deleted or given a different set of components,
+         * and the components that were assigned or marked changed. Each delta carries the ID of the full save it
+         * follows and its place in the chain, so to restore, ecs_load the full save and then ecs_apply_delta each
+         * delta written after it, in order; applying one out of turn throws, leaving the world as it was. Every
+         * ecs_save (or load) starts a new chain, so call enable_delta_saves before the first of them.
+         *
+         * This uses the same change tracking as each_changed, for every component type in use, so the same rule
+         * applies: a component modified through a reference (from each, component<C> and so on) is only saved if
+         * it is passed to mark_changed. Tracking costs a little on every assign, which is why it is opt-in. In
+         * ARCHETYPE mode the components are gathered into stores first, as for ecs_save; only the file is smaller.
+         */
+        void enable_delta_saves();
+        void ecs_save_delta(std::unique_ptr<std::ofstream> &lbfile);
+        void ecs_apply_delta(std::unique_ptr<std::ifstream> &lbfile);
 
         void ecs_load(std::unique_ptr<std::ifstream> &lbfile);
 
+        /*
+         * Loads a native snapshot by mapping the file into memory rather than reading it. Entities are loaded
+         * straight away, and every component section is checked, but a store of trivially copyable components is
+         * only filled from the mapping the first time something asks for it - so a big save with components the
+         * first frame never touches starts quickly. Components saved through cereal are decoded up front, so a
+         * section that doesn't decode fails the load rather than a later lookup. The file is held open until the
+         * next load (or materialise_components), and must not be overwritten in the meantime; save somewhere else,
+         * or call materialise_components first. In ARCHETYPE mode everything is loaded at once, as with ecs_load.
+         * Older all-cereal saves can't be mapped.
+         */
+        void ecs_load_mapped(const std::string &path);
+
+        /*
+         * Fills every store still waiting on a mapped snapshot, and lets go of the file.
+         */
+        void materialise_components();
+
+        /*
+         * Calls func(entity_t &, const C &) for every C, as all_components does. If C is still waiting on a mapped
+         * snapshot and is trivially copyable (and has no soa_layout), the values are read where they sit in the
+         * mapping and no store is built at all.
+         */
+        template <class C, typename F>
+        inline void read_components(F func) {
+            const std::size_t family_id = impl::component_family<C>::id();
+            if (std::is_trivially_copyable<C>::value && !soa_layout<C>::enabled && !impl::is_tag<C>::value && mapped &&
+                    mapped->sections[family_id].waiting.load(std::memory_order_acquire)) {
+                impl::snapshot_reader_t in = mapped->reader(family_id);
+                const std::size_t count = static_cast<std::size_t>(in.read<std::uint64_t>());
+                const char * ids = in.skip_ids(count);
+                std::size_t length;
+                const char * values = impl::skip_snapshot_values<C>(in, count, length);
+                if (reinterpret_cast<std::uintptr_t>(values) % alignof(C) == 0) {
+                    for (std::size_t i=0; i<count; ++i) {
+                        std::uint64_t id;
+                        std::memcpy(&id, ids + i * sizeof(std::uint64_t), sizeof(id));
+                        entity_t * e = entity(static_cast<std::size_t>(id));
+                        if (e) func(*e, reinterpret_cast<const C *>(values)[i]);
+                    }
+                    return;
+                }
+            }
+            all_components<C>([&func] (entity_t &e, C &component) { func(e, static_cast<const C &>(component)); });
+        }
+
+        /*
+         * Makes component types known to ecs_load. Types are registered when first assigned, but a program that
+         * loads a snapshot before assigning anything must name the types the snapshot may hold:
+         * register_components<position, renderable, player_t>();
+         */
+        template <typename... Cs>
+        inline void register_components() {
+            int unused[] = { 0, (impl::register_snapshot_type<Cs>(), 0)... };
+            (void)unused;
+        }
+
         std::string ecs_profile_dump();
 
+        /*
+         * Returns the concrete store for component type C, or nullptr if nothing has created one yet.
+         */
+        template <class C>
+        inline typename impl::store_for<C>::type * get_store() {
+            const std::size_t family_id = impl::component_family<C>::id();
+            if (mapped) materialise(family_id);
+            if (component_store.size() <= family_id) return nullptr;
+            return static_cast<typename impl::store_for<C>::type *>(component_store[family_id].get());
+        }
+
+        /*
+         * Returns the concrete store for component type C, creating it if needed.
+         */
+        template <class C>
+        inline typename impl::store_for<C>::type * get_or_create_store() {
+            const std::size_t family_id = impl::component_family<C>::id();
+            if (mapped) materialise(family_id);
+            if (component_store.size() < family_id+1) {
+                component_store.resize(family_id+1);
+            }
+            if (!component_store[family_id]) {
+                component_store[family_id] = std::make_unique<typename impl::store_for<C>::type>();
+                impl::register_snapshot_type<C>();
+            }
+            return static_cast<typename impl::store_for<C>::type *>(component_store[family_id].get());
+        }
+
         // The ECS component store
         std::vector<std::unique_ptr<impl::base_component_store>> component_store;
 
+        // Component layout; in ARCHETYPE mode component data lives in archetypes rather than component_store
+        storage_mode_t storage_mode;
+        impl::archetype_storage_t archetypes;
+        std::unique_ptr<command_buffer_t> archetype_deferred; // Assigns held back while archetypes are being iterated
+
         // The ECS entity store
-        std::unordered_map<std::size_t, entity_t> entity_store;
+        impl::entity_store_t entity_store;
+
+        // Garbage collection queues: entities awaiting erasure, and the number of components awaiting it
+        std::vector<std::size_t> pending_entity_deletes;
+        std::size_t pending_component_deletes = 0;
+
+        // Cached queries, indexed by impl::view_family; the mutex guards views while a parallel wave is running
+        std::vector<std::unique_ptr<impl::view_cache_t>> views;
+        std::mutex views_mutex;
+        bool in_parallel_wave = false;
+
+        // Resources, indexed by impl::resource_family
+        std::vector<std::unique_ptr<impl::base_resource_t>> resources;
+
+        // Registered prefabs, by name
+        std::unordered_map<std::string, std::unique_ptr<prefab_t>> prefabs;
+
+        // The last copy handed to ecs_save_async; its buffers are reused once that save is done with them
+        std::shared_ptr<impl::snapshot_capture_t> async_capture;
+
+        // What the last save held, once enable_delta_saves is called; the full save's ID, and the last delta's number
+        std::unique_ptr<impl::delta_base_t> delta_base;
+        std::uint32_t save_id = 0;
+        std::uint32_t save_sequence = 0;
+
+        // Stores still to be filled from a snapshot loaded by ecs_load_mapped, if any
+        std::unique_ptr<impl::mapped_snapshot_t> mapped;
+
+        // The spatial hash kept by index_positions, if any
+        std::unique_ptr<impl::spatial_index_t> positions;
+
+        // Observers, indexed by component family, and the families with events waiting for notify_observers
+        std::vector<std::unique_ptr<impl::base_observer_t>> observers;
+        std::vector<std::size_t> dirty_observers;
+        bool notifying = false;
+
+        // Change tracking, indexed by component family; null for types nothing has asked about
+        std::vector<std::unique_ptr<impl::change_log_t>> change_logs;
+        std::size_t change_tick = 1;
+        std::size_t last_trim_tick = 0;
+
+        // Worker pool for parallel iteration
+        std::unique_ptr<thread_pool> worker_pool;
+        std::size_t worker_threads = 0;
+
+        // Deferred structural changes: [0] for non-worker threads, [n] for pool worker n-1
+        std::vector<std::unique_ptr<command_buffer_t>> command_buffers;
 
         // Mailbox system
         std::vector<std::unique_ptr<impl::subscription_base_t>> pubsub_holder;
+        mpsc_queue<std::size_t> dirty_messages; // Message families with deferred traffic waiting for deliver_messages
 
         // Storage of systems
         std::vector<std::unique_ptr<base_system>> system_store;
@@ -711,19 +3650,316 @@ namespace rltk {
         // Profile data storage
         std::vector<system_profiling_t> system_profiling;
 
+        // Microseconds each thread (0 = ticking thread, n = pool worker n-1) spent in systems during the last tick
+        std::vector<double> thread_profiling;
+
+        /*
+         * The system schedule: "waves" of system indices. Systems within a wave don't conflict with each other,
+         * so run concurrently; waves run in order, with messages delivered in between. Each system goes in the
+         * wave after the last one holding a system it conflicts with (and was added before), so conflicting
+         * systems always run in the order they were added.
+         */
+        std::vector<std::vector<std::size_t>> system_schedule;
+        bool schedule_dirty = true;
+
+        void build_schedule();
+        void begin_parallel_wave();
+        void end_parallel_wave() noexcept;
+        void write_snapshot(std::ostream &out, const bool compress);
+        void capture_snapshot(impl::snapshot_capture_t &capture, const bool copy_stores);
+        void stores_from_archetypes();
+        void read_snapshot(const char * data, const std::size_t size, std::unique_ptr<mapped_file> lazy_file = nullptr);
+        void materialise_section(const std::size_t family_id);
+        void reset_for_load();
+        void finish_load();
+        void rebaseline();
+        void track_families(const std::bitset<impl::MAX_COMPONENTS> &families);
+        void run_system(const std::size_t index, const double duration_ms);
+
         // Helpers
+
+        /*
+         * Fills family_id's store from the mapped snapshot if it is still waiting. Safe to race from several
+         * threads (parallel_each can reach a store first from a worker): the section is loaded once, under the
+         * snapshot's mutex, and component_store is already sized so no other slot moves. Only running out of
+         * memory can fail here (see read_snapshot); the section is then left waiting, to be tried again.
+         */
+        inline void materialise(const std::size_t family_id) {
+            if (family_id < impl::MAX_COMPONENTS && mapped->sections[family_id].waiting.load(std::memory_order_acquire)) {
+                materialise_section(family_id);
+            }
+        }
+
         inline void unset_component_mask(const std::size_t id, const std::size_t family_id, bool delete_if_empty) {
-            auto finder = entity_store.find(id);
-            if (finder != entity_store.end()) {
-                finder->second.component_mask.reset(family_id);
-                if (delete_if_empty && finder->second.component_mask.none()) finder->second.deleted = true;
+            entity_t * e = entity_store.find(id);
+            if (e) {
+                e->component_mask.reset(family_id);
+                const bool now_deleted = delete_if_empty && e->component_mask.none();
+                if (now_deleted) {
+                    e->deleted = true;
+                    pending_entity_deletes.push_back(id);
+                }
+                for (auto &v : views) {
+                    if (!v) continue;
+                    v->on_mask_unset(*e, family_id);
+                    if (now_deleted) v->on_entity_deleted(*e);
+                }
+            }
+        }
+
+        inline void set_component_mask(entity_t &e, const std::size_t family_id) {
+            e.component_mask.set(family_id);
+            for (auto &v : views) {
+                if (v) v->on_mask_set(e, family_id);
+            }
+        }
+
+        /*
+         * Checks whether assign_batch can block-copy into C's store - sparse-set mode, no observers of C, and every
+         * entity in the range live with no C (or C pending deletion) already - and if so sets C in their masks.
+         * This is one pass over the range; if an entity fails the test, the bits set so far are cleared again.
+         */
+        template <class C>
+        inline bool batch_claim(const entity_range_t &range) {
+            if (storage_mode != storage_mode_t::SPARSE_SET || observer<C>()) return false;
+            const std::size_t family_id = impl::component_family<C>::id();
+            typename impl::store_for<C>::type * store = get_store<C>();
+            for (std::size_t i=0; i<range.size(); ++i) {
+                entity_t * e = entity_store.find(range[i]);
+                if (!e || e->deleted || e->component_mask.test(family_id) || (store && store->index.get(range[i]) != impl::NO_INDEX)) {
+                    while (i > 0) entity_store.find(range[--i])->component_mask.reset(family_id);
+                    return false;
+                }
+                e->component_mask.set(family_id);
+            }
+            return true;
+        }
+
+        /* Tells views and change tracking about a range claimed by batch_claim (the mask bits are already set) */
+        template <class C>
+        inline void batch_appended(const entity_range_t &range) {
+            const std::size_t family_id = impl::component_family<C>::id();
+            if (impl::is_tag<C>::value) impl::register_snapshot_type<C>();
+            for (auto &v : views) {
+                if (v) v->on_range_set(entity_store, range, family_id);
+            }
+            if (family_id < change_logs.size() && change_logs[family_id]) change_logs[family_id]->mark_range(entity_store, range, change_tick);
+        }
+
+        /* The families of the component types given as instantiate overrides */
+        template <typename... Os>
+        inline std::bitset<impl::MAX_COMPONENTS> override_mask() const {
+            std::bitset<impl::MAX_COMPONENTS> mask;
+            int unused[] = { 0, (mask.set(impl::component_family<typename impl::override_type<typename std::decay<Os>::type>::type>::id()), 0)... };
+            (void)unused;
+            return mask;
+        }
+
+        inline const prefab_t & registered_prefab(const std::string &name) const {
+            auto finder = prefabs.find(name);
+            if (finder == prefabs.end()) throw std::runtime_error("No prefab is registered as " + name + ".");
+            return *finder->second;
+        }
+
+        /* Returns the observers of C - creating them if create is set - or nullptr */
+        template <class C>
+        inline impl::observer_t<C> * observer(const bool create = false) {
+            const std::size_t family_id = impl::component_family<C>::id();
+            if (observers.size() < family_id+1) {
+                if (!create) return nullptr;
+                observers.resize(family_id+1);
+            }
+            if (!observers[family_id] && create) observers[family_id] = std::make_unique<impl::observer_t<C>>();
+            return static_cast<impl::observer_t<C> *>(observers[family_id].get());
+        }
+
+        inline void observer_queued(impl::base_observer_t &observer, const std::size_t family_id) {
+            if (observer.queued) return;
+            observer.queued = true;
+            dirty_observers.push_back(family_id);
+        }
+
+        inline void observe_removal(entity_t &e, const std::size_t family_id) {
+            if (family_id < observers.size() && observers[family_id]) {
+                observers[family_id]->removing(*this, e);
+                observer_queued(*observers[family_id], family_id);
+            }
+        }
+
+        inline void stamp_change(const entity_t &e, const std::size_t family_id) {
+            if (family_id < change_logs.size() && change_logs[family_id]) change_logs[family_id]->mark(e.handle(), change_tick);
+        }
+
+        /* Returns the change log for C, starting one (with every current C counted as changed) if needed */
+        template <class C>
+        inline impl::change_log_t & change_log() {
+            return change_log(impl::component_family<C>::id());
+        }
+
+        inline impl::change_log_t & change_log(const std::size_t family_id) {
+            if (change_logs.size() < family_id+1) change_logs.resize(family_id+1);
+            if (!change_logs[family_id]) {
+                change_logs[family_id] = std::make_unique<impl::change_log_t>();
+                for (entity_t &e : entity_store) {
+                    if (!e.deleted && e.component_mask.test(family_id)) change_logs[family_id]->mark(e.handle(), change_tick);
+                }
+            }
+            return *change_logs[family_id];
+        }
+
+        /*
+         * Drops changes that every system has seen, that are older than the previous garbage collection, and
+         * that neither the next delta save nor the position index still needs
+         */
+        inline void trim_change_logs() {
+            std::size_t cutoff = last_trim_tick;
+            for (const std::unique_ptr<base_system> &sys : system_store) {
+                cutoff = std::min(cutoff, sys->last_run_tick);
+            }
+            if (delta_base && delta_base->valid) cutoff = std::min(cutoff, delta_base->tick);
+            if (positions) cutoff = std::min(cutoff, positions->synced_tick);
+            for (auto &log : change_logs) {
+                if (log) log->trim(cutoff);
+            }
+            last_trim_tick = change_tick;
+        }
+
+        /*
+         * Archetype mode: held for the duration of anything that walks the archetypes. Structural changes made
+         * meanwhile are queued, and applied when the outermost walk ends.
+         */
+        struct archetype_iteration_t {
+            ecs &ECS;
+            explicit archetype_iteration_t(ecs &world) : ECS(world) { ++ECS.archetypes.iterating; }
+            ~archetype_iteration_t() {
+                if (--ECS.archetypes.iterating == 0) ECS.flush_archetype_changes();
+            }
+        };
+
+        /* Applies queued archetype moves and assigns, if nothing is iterating the archetypes */
+        void flush_archetype_changes();
+
+        /* Moves an entity to the archetype matching its component mask (or out of storage, if it is deleted) */
+        inline void update_archetype(const std::size_t id) {
+            entity_t * e = entity_store.find(id);
+            if (!e || e->deleted) {
+                archetypes.remove(id);
+            } else {
+                archetypes.move(id, e->component_mask);
+            }
+        }
+
+        inline void archetype_changed(const std::size_t id) {
+            if (archetypes.iterating > 0) {
+                archetypes.defer(id);
+            } else {
+                update_archetype(id);
+            }
+        }
+
+        /*
+         * Archetype mode assign. Replaces the component in place if the entity's archetype has it; otherwise moves
+         * the entity to the archetype with C added - unless the archetypes are being iterated, in which case the
+         * assign is queued and false is returned.
+         */
+        template <class C>
+        inline bool archetype_assign(entity_t &e, C &&component) {
+            archetypes.register_type<C>();
+            const std::size_t family_id = impl::component_family<C>::id();
+            impl::archetype_t * current = archetypes.archetype(e.id);
+            if (impl::is_tag<C>::value && current && current->mask.test(family_id)) return true;
+            if (current && current->column_of[family_id] != impl::NO_COLUMN) {
+                *static_cast<C *>(current->at(archetypes.row_of.get(e.id), current->column_of[family_id])) = std::move(component);
+                return true;
+            }
+            if (archetypes.iterating > 0) {
+                if (!archetype_deferred) archetype_deferred = std::make_unique<command_buffer_t>(*this);
+                archetype_deferred->assign<C>(e.id, std::move(component));
+                return false;
+            }
+            std::bitset<impl::MAX_COMPONENTS> mask = current ? current->mask : std::bitset<impl::MAX_COMPONENTS>();
+            mask.set(family_id);
+            const std::size_t row = archetypes.move(e.id, mask);
+            if (impl::is_tag<C>::value) return true;
+            impl::archetype_t * destination = archetypes.archetype(e.id);
+            new (destination->at(row, destination->column_of[family_id])) C(std::move(component));
+            return true;
+        }
+
+        /* Calls func(archetype_t &, chunk_t &) for every chunk of every archetype having all of required */
+        template <typename F>
+        inline void archetype_chunks(const std::bitset<impl::MAX_COMPONENTS> &required, F &&func) {
+            const std::size_t count = archetypes.archetypes.size();
+            for (std::size_t a=0; a<count; ++a) {
+                impl::archetype_t &archetype = *archetypes.archetypes[a];
+                if ((archetype.mask & required) != required) continue;
+                for (const impl::archetype_t::chunk_t &chunk : archetype.chunks) func(archetype, chunk);
+            }
+        }
+
+        /* As archetype_chunks, with the chunks spread over the worker pool */
+        template <typename F>
+        inline void parallel_archetype_chunks(const std::bitset<impl::MAX_COMPONENTS> &required, F &&func) {
+            archetype_iteration_t guard(*this);
+            std::vector<std::pair<impl::archetype_t *, const impl::archetype_t::chunk_t *>> chunks;
+            archetype_chunks(required, [&chunks] (impl::archetype_t &archetype, const impl::archetype_t::chunk_t &chunk) {
+                chunks.emplace_back(&archetype, &chunk);
+            });
+            workers().parallel_for(chunks.size(), 1, [&chunks, &func] (const std::size_t begin, const std::size_t end) {
+                for (std::size_t i=begin; i<end; ++i) func(*chunks[i].first, *chunks[i].second);
+            });
+        }
+
+        /*
+         * Calls func(entity_t &, Cs &...) for each row of an archetype chunk whose entity is live and still has
+         * all of Cs.
+         */
+        template <typename... Cs, typename F>
+        inline void each_archetype_row(impl::archetype_t &archetype, const impl::archetype_t::chunk_t &chunk, F &&func) {
+            const std::bitset<impl::MAX_COMPONENTS> &required = impl::required_mask<Cs...>();
+            std::tuple<Cs *...> columns{ archetype_column<Cs>(archetype, chunk)... };
+            const std::size_t * ids = archetype.ids(chunk);
+            for (std::size_t row=0; row<chunk.count; ++row) {
+                entity_t * e = entity_store.find(ids[row]);
+                if (!e || e->deleted || (e->component_mask & required) != required) continue;
+                func(*e, column_row<Cs>(std::get<Cs *>(columns), row)...);
             }
         }
 
-        /* Delivers the queue; called at the end of each system call */
+        /* A chunk's column for C; for a tag, which has no column, the shared instance stands in for every row */
+        template <class C>
+        inline C * archetype_column(impl::archetype_t &archetype, const impl::archetype_t::chunk_t &chunk) noexcept {
+            if (impl::is_tag<C>::value) return &impl::tag_instance<C>();
+            return archetype.column<C>(chunk, archetype.column_of[impl::component_family<C>::id()]);
+        }
+
+        template <class C>
+        static inline C & column_row(C * column, const std::size_t row) noexcept {
+            return impl::is_tag<C>::value ? *column : column[row];
+        }
+
+        template <class C>
+        inline typename impl::store_for<C>::type::chunk_type archetype_chunk(impl::archetype_t &archetype, const impl::archetype_t::chunk_t &chunk, std::false_type) {
+            return component_chunk_t<C>{
+                span_t<C>(archetype.column<C>(chunk, archetype.column_of[impl::component_family<C>::id()]), chunk.count),
+                span_t<const std::size_t>(archetype.ids(chunk), chunk.count),
+                span_t<const std::uint8_t>(archetype.stale(chunk), chunk.count)
+            };
+        }
+
+        template <class C>
+        inline typename impl::store_for<C>::type::chunk_type archetype_chunk(impl::archetype_t &, const impl::archetype_t::chunk_t &, std::true_type) {
+            throw std::runtime_error("each_chunk over an soa_layout component is not available in archetype mode.");
+        }
+
+        /*
+         * Delivers the queue; called at the end of each system call. Only message types that have had something
+         * passed to emit_deferred since the last delivery are visited.
+         */
         inline void deliver_messages() {
-            for (auto &holder : pubsub_holder) {
-                if (holder) holder->deliver_messages();
+            std::size_t family_id;
+            while (dirty_messages.pop(family_id)) {
+                if (family_id < pubsub_holder.size() && pubsub_holder[family_id]) pubsub_holder[family_id]->deliver_messages();
             }
         }
 
@@ -733,74 +3969,279 @@ namespace rltk {
         template<class Archive>
         void serialize(Archive & archive)
         {
-            archive( entity_store, component_store, entity_t::entity_counter, impl::base_component_t::type_counter ); // serialize things by passing them to the archive
+            std::size_t next_id = entity_store.next_id.load();
+            archive( entity_store, component_store, next_id, impl::base_component_t::type_counter ); // serialize things by passing them to the archive
+            entity_store.next_id.store(next_id);
         }
     };
 
     namespace impl {
         template <class C>
         inline void assign(ecs &ECS, entity_t &E, C component) {
-            impl::component_t<C> temp(component);
-            temp.entity_id = E.id;
-            if (ECS.component_store.size() < temp.family_id+1) {
-                ECS.component_store.resize(temp.family_id+1);
+            observer_t<C> * observer = ECS.observer<C>();
+            if (observer) {
+                observer->assigning(ECS, E, component);
+                ECS.observer_queued(*observer, component_family<C>::id());
+            }
+            if (ECS.storage_mode == storage_mode_t::ARCHETYPE) {
+                if (!ECS.archetype_assign<C>(E, std::move(component))) { // Queued until iteration ends
+                    if (observer) observer->retract();
+                    return;
+                }
+            } else if (!is_tag<C>::value) {
+                ECS.get_or_create_store<C>()->insert(E.id, component);
+            } else {
+                register_snapshot_type<C>();
             }
-            if (!ECS.component_store[temp.family_id]) ECS.component_store[temp.family_id] = std::move(std::make_unique<impl::component_store_t<impl::component_t<C>>>());
+            ECS.set_component_mask(E, component_family<C>::id());
+            ECS.stamp_change(E, component_family<C>::id());
+        }
+
+        template <class C>
+        inline void prefab_component_t<C>::instantiate(ecs &ECS, entity_t &e) const {
+            assign<C>(ECS, e, component);
+        }
+
+        template <class C>
+        inline void prefab_component_t<C>::instantiate(ecs &ECS, const entity_range_t &range) const {
+            ECS.assign_batch<C>(range, component);
+        }
 
-            static_cast<impl::component_store_t<impl::component_t<C>> *>(ECS.component_store[temp.family_id].get())->components.push_back(temp);
-            E.component_mask.set(temp.family_id);
+        template <class C>
+        inline void component_to_store(ecs &ECS, const std::size_t entity_id, void * component) {
+            ECS.get_or_create_store<C>()->insert(entity_id, *static_cast<C *>(component));
         }
 
         template <class C>
-        inline C * component(ecs &ECS, entity_t &E) noexcept {
+        inline C * component(ecs &ECS, entity_t &E) {
+            static_assert(!soa_layout<C>::enabled, "Components with an soa_layout have no address; use each, all_components or each_chunk");
             C * result = nullptr;
             if (E.deleted) return result;
 
-            C empty_component;
-            impl::component_t<C> temp(empty_component);
-            if (!E.component_mask.test(temp.family_id)) return result;
-            for (impl::component_t<C> &component : static_cast<impl::component_store_t<impl::component_t<C>> *>(ECS.component_store[temp.family_id].get())->components) {
-                if (component.entity_id == E.id) {
-                    result = &component.data;
-                    return result;
+            if (!E.component_mask.test(component_family<C>::id())) return result;
+            if (is_tag<C>::value) return &tag_instance<C>();
+            if (ECS.storage_mode == storage_mode_t::ARCHETYPE) return ECS.archetypes.find<C>(E.id);
+            return ECS.get_store<C>()->find(E.id);
+        }
+
+        template <class C>
+        inline void mark_changed(ecs &ECS, entity_t &E) {
+            ECS.mark_changed<C>(E);
+        }
+
+        /* Copies E's C into out (which must be empty), for observer events; types with an soa_layout are gathered */
+        template <class C>
+        inline void copy_component(ecs &ECS, entity_t &E, std::vector<C> &out, std::false_type) {
+            if (is_tag<C>::value) return out.push_back(tag_instance<C>());
+            C * component = (ECS.storage_mode == storage_mode_t::ARCHETYPE) ? ECS.archetypes.find<C>(E.id) : ECS.get_store<C>()->find(E.id);
+            out.push_back(*component);
+        }
+
+        template <class C>
+        inline void copy_component(ecs &ECS, entity_t &E, std::vector<C> &out, std::true_type) {
+            if (ECS.storage_mode == storage_mode_t::ARCHETYPE) {
+                out.push_back(*ECS.archetypes.find<C>(E.id));
+            } else {
+                soa_component_store_t<C> * store = ECS.get_store<C>();
+                out.push_back(store->gather(store->find_index(E.id)));
+            }
+        }
+
+        /*
+         * The values are copied before the event is queued, and dropped again if anything throws, so a copy that
+         * fails leaves the observer as it was.
+         */
+        template <class C>
+        inline void observer_t<C>::assigning(ecs &ECS, entity_t &e, const C &component) {
+            const std::size_t value = values.size();
+            const bool replacing = e.component_mask.test(component_family<C>::id());
+            try {
+                if (replacing) copy_component<C>(ECS, e, values, std::integral_constant<bool, soa_layout<C>::enabled>());
+                values.push_back(component);
+                events.push_back(event_t{ replacing ? event_kind_t::REPLACED : event_kind_t::ADDED, e.handle(), value });
+            } catch (...) {
+                values.erase(values.begin() + value, values.end());
+                throw;
+            }
+        }
+
+        template <class C>
+        void observer_t<C>::removing(ecs &ECS, entity_t &e) {
+            const std::size_t value = values.size();
+            try {
+                copy_component<C>(ECS, e, values, std::integral_constant<bool, soa_layout<C>::enabled>());
+                events.push_back(event_t{ event_kind_t::REMOVED, e.handle(), value });
+            } catch (...) {
+                values.erase(values.begin() + value, values.end());
+                throw;
+            }
+        }
+
+        template <class C>
+        void observer_t<C>::deliver(ecs &ECS) {
+            std::vector<event_t> batch;
+            std::vector<C> batch_values;
+            batch.swap(events);
+            batch_values.swap(values);
+            for (const event_t &event : batch) {
+                entity_t * e = ECS.entity_store.find(event.entity); // Deleted entities are kept until after delivery
+                if (!e) continue;
+                switch (event.kind) {
+                    case event_kind_t::ADDED : {
+                        for (auto &func : on_add) func(*e, batch_values[event.value]);
+                    } break;
+                    case event_kind_t::REPLACED : {
+                        for (auto &func : on_replace) func(*e, batch_values[event.value], batch_values[event.value+1]);
+                    } break;
+                    case event_kind_t::REMOVED : {
+                        for (auto &func : on_remove) func(*e, batch_values[event.value]);
+                    } break;
                 }
             }
-            return result;
         }
 
+        /* Finds (creating if needed) the subscription holder for a message type, and records B as a subscriber */
         template<class MSG>
-        inline void subscribe(ecs &ECS, base_system &B, std::function<void(MSG &message)> destination) {
-            MSG empty_message{};
-            impl::message_t<MSG> handle(empty_message);
-            if (ECS.pubsub_holder.size() < handle.family_id + 1) {
-                ECS.pubsub_holder.resize(handle.family_id + 1);
+        inline subscription_holder_t<MSG> * subscription_holder(ecs &ECS, base_system &B) {
+            const std::size_t family_id = message_family<MSG>::id();
+            if (ECS.pubsub_holder.size() < family_id + 1) {
+                ECS.pubsub_holder.resize(family_id + 1);
             }
-            if (!ECS.pubsub_holder[handle.family_id]) {
-                ECS.pubsub_holder[handle.family_id] = std::move(std::make_unique<subscription_holder_t<MSG>>());
+            if (!ECS.pubsub_holder[family_id]) {
+                ECS.pubsub_holder[family_id] = std::make_unique<subscription_holder_t<MSG>>();
             }
-            static_cast<subscription_holder_t<MSG> *>(ECS.pubsub_holder[handle.family_id].get())->subscriptions.push_back(std::make_tuple(true,destination,nullptr));
+            B.subscribed_messages.insert(family_id);
+            ECS.schedule_dirty = true;
+            return static_cast<subscription_holder_t<MSG> *>(ECS.pubsub_holder[family_id].get());
+        }
+
+        template<class MSG>
+        inline void subscribe(ecs &ECS, base_system &B, std::function<void(MSG &message)> destination) {
+            if (destination) subscription_holder<MSG>(ECS, B)->handlers.push_back(destination);
+        }
+
+        template<class MSG>
+        inline void subscribe_batch(ecs &ECS, base_system &B, std::function<void(span_t<MSG> messages)> destination) {
+            if (destination) subscription_holder<MSG>(ECS, B)->batch_handlers.push_back(destination);
         }
 
         template<class MSG>
         inline void subscribe_mbox(ecs &ECS, base_system &B) {
-            MSG empty_message{};
-            impl::message_t<MSG> handle(empty_message);
-            if (ECS.pubsub_holder.size() < handle.family_id + 1) {
-                ECS.pubsub_holder.resize(handle.family_id + 1);
-            }
-            if (!ECS.pubsub_holder[handle.family_id]) {
-                ECS.pubsub_holder[handle.family_id] = std::move(std::make_unique<subscription_holder_t<MSG>>());
-            }
-            std::function<void(MSG &message)> destination; // Deliberately empty
-            static_cast<impl::subscription_holder_t<MSG> *>(ECS.pubsub_holder[handle.family_id].get())->subscriptions.push_back(std::make_tuple(false,destination,&B));
-            B.mailboxes[handle.family_id] = std::make_unique<impl::mailbox_t<MSG>>();
+            subscription_holder_t<MSG> * holder = subscription_holder<MSG>(ECS, B);
+            std::unique_ptr<impl::subscription_mailbox_t> &mailbox = B.mailboxes[message_family<MSG>::id()];
+            if (mailbox) return; // Already subscribed; the holder keeps a pointer to the existing mailbox
+            mailbox = std::make_unique<impl::mailbox_t<MSG>>();
+            holder->mailboxes.push_back(static_cast<impl::mailbox_t<MSG> *>(mailbox.get()));
+        }
+
+    }
+
+    template <class C, class... Cs, typename F>
+    inline void base_system::each_changed(ecs &ECS, F func) {
+        ECS.each_changed<C, Cs...>(changes_since, func);
+    }
+
+    inline std::size_t command_buffer_t::create_entity() {
+        const std::size_t id = ECS->entity_store.reserve_id();
+        commands.push_back(command_t{ command_kind_t::CREATE_ENTITY, false, id, 0, 0, nullptr });
+        return id;
+    }
+
+    namespace impl {
+        /*
+         * How the view iterators reach an entity's component: a pointer into the store, or - for a type with an
+         * soa_layout - a copy gathered from the arrays, scattered back when the reference goes out of scope (at
+         * the end of the full expression that made it).
+         */
+        template <class C, bool SOA>
+        struct component_ref_t {
+            C * component;
+
+            component_ref_t(ecs &ECS, entity_t &e) : component(is_tag<C>::value ? &tag_instance<C>() : ECS.get_store<C>()->find(e.id)) {}
+            inline C & get() noexcept { return *component; }
+        };
+
+        template <class C>
+        struct component_ref_t<C, true> {
+            soa_component_store_t<C> * store;
+            std::size_t idx;
+            C component;
+
+            component_ref_t(ecs &ECS, entity_t &e) : store(ECS.get_store<C>()), idx(store->find_index(e.id)), component(store->gather(idx)) {}
+            ~component_ref_t() { store->scatter(idx, component); }
+            component_ref_t(const component_ref_t &) = delete;
+            component_ref_t & operator=(const component_ref_t &) = delete;
+            inline C & get() noexcept { return component; }
+        };
+
+        template <typename P, typename F, typename... Refs>
+        inline void call_if(entity_t &e, P &predicate, F &callback, Refs &&... refs) {
+            if (predicate(e, refs.get()...)) callback(e, refs.get()...);
+        }
+    }
+
+    template <typename... Cs>
+    template <typename F>
+    inline void view_t<Cs...>::each(F callback) {
+        ecs &world = *ECS;
+        if (world.storage_mode == storage_mode_t::ARCHETYPE && sizeof...(Cs) > 0) {
+            ecs::archetype_iteration_t guard(world);
+            world.archetype_chunks(cache->required, [&world, &callback] (impl::archetype_t &archetype, const impl::archetype_t::chunk_t &chunk) {
+                world.each_archetype_row<Cs...>(archetype, chunk, callback);
+            });
+            return;
+        }
+        cache->each(world.entity_store, [&world, &callback] (entity_t &e) {
+            callback(e, impl::component_ref_t<Cs>(world, e).get()...);
+        });
+    }
+
+    template <typename... Cs>
+    template <typename F>
+    inline void view_t<Cs...>::parallel_each(F callback, const std::size_t grain) {
+        ecs &world = *ECS;
+        if (world.storage_mode == storage_mode_t::ARCHETYPE && sizeof...(Cs) > 0) {
+            world.parallel_archetype_chunks(cache->required, [&world, &callback] (impl::archetype_t &archetype, const impl::archetype_t::chunk_t &chunk) {
+                world.each_archetype_row<Cs...>(archetype, chunk, callback);
+            });
+            return;
         }
+        cache->parallel_each(world.workers(), world.entity_store, grain, [&world, &callback] (entity_t &e) {
+            callback(e, impl::component_ref_t<Cs>(world, e).get()...);
+        });
+    }
 
-        inline void unset_component_mask(ecs &ECS, const std::size_t id, const std::size_t family_id, bool delete_if_empty) {
-            ECS.unset_component_mask(id, family_id, delete_if_empty);
+    template <typename... Cs>
+    template <typename P, typename F>
+    inline void view_t<Cs...>::each_if(P&& predicate, F callback) {
+        ecs &world = *ECS;
+        if (world.storage_mode == storage_mode_t::ARCHETYPE && sizeof...(Cs) > 0) {
+            ecs::archetype_iteration_t guard(world);
+            world.archetype_chunks(cache->required, [&world, &predicate, &callback] (impl::archetype_t &archetype, const impl::archetype_t::chunk_t &chunk) {
+                world.each_archetype_row<Cs...>(archetype, chunk, [&predicate, &callback] (entity_t &e, Cs &... components) {
+                    if (predicate(e, components...)) callback(e, components...);
+                });
+            });
+            return;
         }
+        cache->each(world.entity_store, [&world, &predicate, &callback] (entity_t &e) {
+            impl::call_if(e, predicate, callback, impl::component_ref_t<Cs>(world, e)...);
+        });
     }
 
 } // End RLTK namespace
 
+/*
+ * Gives a component structure-of-arrays storage (see rltk::soa_layout). Use at global scope, listing a pointer to
+ * every data member: RLTK_SOA_LAYOUT(position, &position::x, &position::y)
+ */
+#define RLTK_SOA_LAYOUT(TYPE, ...) \
+    namespace rltk { \
+        template <> \
+        struct soa_layout<TYPE> { \
+            static constexpr bool enabled = true; \
+            static inline auto fields() noexcept { return std::make_tuple(__VA_ARGS__); } \
+        }; \
+    }
+
 CEREAL_REGISTER_ARCHIVE(rltk::ecs)
@@ -0,0 +1,83 @@
+#include "mapped_file.hpp"
+#include <stdexcept>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace rltk {
+
+#ifdef _WIN32
+
+mapped_file::mapped_file(const std::string &path) {
+	HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+		FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE) throw std::runtime_error("Unable to open " + path);
+	LARGE_INTEGER file_size;
+	if (!GetFileSizeEx(file, &file_size)) {
+		CloseHandle(file);
+		throw std::runtime_error("Unable to read the size of " + path);
+	}
+	file_handle = file;
+	length = static_cast<std::size_t>(file_size.QuadPart);
+	if (length == 0) return;
+
+	HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (mapping == nullptr) {
+		CloseHandle(file);
+		throw std::runtime_error("Unable to map " + path);
+	}
+	void * view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (view == nullptr) {
+		CloseHandle(mapping);
+		CloseHandle(file);
+		throw std::runtime_error("Unable to map " + path);
+	}
+	mapping_handle = mapping;
+	bytes = static_cast<const char *>(view);
+}
+
+mapped_file::~mapped_file() {
+	if (bytes != nullptr) UnmapViewOfFile(bytes);
+	if (mapping_handle != nullptr) CloseHandle(mapping_handle);
+	if (file_handle != nullptr) CloseHandle(file_handle);
+}
+
+#else
+
+mapped_file::mapped_file(const std::string &path) {
+	const int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0) throw std::runtime_error("Unable to open " + path);
+	struct stat info;
+	if (fstat(fd, &info) != 0) {
+		close(fd);
+		throw std::runtime_error("Unable to read the size of " + path);
+	}
+	length = static_cast<std::size_t>(info.st_size);
+	if (length == 0) {
+		close(fd);
+		return;
+	}
+
+	// The mapping keeps its own reference to the file, so the descriptor can go straight away
+	void * view = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (view == MAP_FAILED) throw std::runtime_error("Unable to map " + path);
+	bytes = static_cast<const char *>(view);
+}
+
+mapped_file::~mapped_file() {
+	if (bytes != nullptr) munmap(const_cast<char *>(bytes), length);
+}
+
+#endif
+
+}
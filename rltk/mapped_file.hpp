@@ -0,0 +1,41 @@
+#pragma once
+
+/* RLTK (RogueLike Tool Kit) 1.00
+ * Copyright (c) 2016-Present, Bracket Productions.
+ * Licensed under the MIT license - see LICENSE file.
+ *
+ * Read-only memory-mapped files, used by the ECS to load snapshots lazily.
+ */
+
+#include <string>
+#include <cstddef>
+
+namespace rltk {
+
+/*
+ * A whole file mapped read-only into memory for the lifetime of the object. Pages are read in by the OS as
+ * they are first touched. The file must not be truncated or rewritten while it is mapped. Throws
+ * std::runtime_error if the file cannot be opened or mapped.
+ */
+class mapped_file
+{
+public:
+	explicit mapped_file(const std::string &path);
+	~mapped_file();
+
+	mapped_file(const mapped_file &) = delete;
+	mapped_file & operator=(const mapped_file &) = delete;
+
+	const char * data() const noexcept { return bytes; }
+	std::size_t size() const noexcept { return length; }
+
+private:
+	const char * bytes = nullptr;
+	std::size_t length = 0;
+#ifdef _WIN32
+	void * file_handle = nullptr;
+	void * mapping_handle = nullptr;
+#endif
+};
+
+}
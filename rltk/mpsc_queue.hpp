@@ -0,0 +1,218 @@
+#pragma once
+
+/* RLTK (RogueLike Tool Kit) 1.00
+ * Copyright (c) 2016-Present, Bracket Productions.
+ * Licensed under the MIT license - see LICENSE file.
+ *
+ * Multi-producer, single-consumer queue, used for deferred message delivery.
+ */
+
+#include <atomic>
+#include <utility>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+namespace rltk {
+
+/*
+ * A multi-producer, single-consumer queue: a bounded ring (after Dmitry Vyukov's design) with an overflow list
+ * behind it. push claims a ring slot with one compare-and-swap and constructs the item in place, so any number
+ * of threads can push at once without locks or allocating. Only when the ring is full does push fall back to
+ * appending to the overflow list under a mutex; the consumer takes that list over once it has caught up, and
+ * the ring is used again. Each producer's items come out in the order it pushed them. The ring itself is
+ * allocated by the first push. pop/drain must only ever be called from one thread at a time, and an item
+ * whose push is still under way holds back the ones after it until the next pop/drain. T only needs to be
+ * move-constructible.
+ *
+ * push is lock-free rather than wait-free: the compare-and-swap only fails because another producer's
+ * succeeded, so some push always completes, but one thread can in theory keep losing. Handing out slots with
+ * fetch_add would avoid the retry, but a slot taken that way must be filled - and when the ring is full there
+ * is nowhere to fill it without allocating, so a failed allocation would leave a hole that stalls every item
+ * after it. Claiming a slot only once it is known to be free keeps push free to fail cleanly (the item is
+ * simply not queued); either way, every producer updates the same counter.
+ * The overflow mutex is only taken while more than a ring's worth is waiting between drains; the alternative,
+ * a strictly bounded queue, would have to drop messages or make producers wait for the consumer.
+ */
+template <class T>
+class mpsc_queue
+{
+public:
+	/* capacity is the number of ring slots, rounded up to a power of two; by default about 32KB worth */
+	explicit mpsc_queue(const std::size_t capacity = default_capacity()) : mask(round_up(capacity) - 1) {}
+
+	~mpsc_queue() {
+		drain([] (T &) {});
+		delete[] ring.load();
+	}
+
+	mpsc_queue(const mpsc_queue &) = delete;
+	mpsc_queue & operator=(const mpsc_queue &) = delete;
+
+	/* Adds an item; safe from any thread */
+	void push(T item) {
+		if (!overflowing.load(std::memory_order_acquire) && push_ring(item)) return;
+		std::lock_guard<std::mutex> lock(overflow_mutex);
+		overflow.push_back(std::move(item));
+		overflowing.store(true, std::memory_order_release); // Later pushes queue behind this one until it's taken
+	}
+
+	/* Removes the oldest item, if there is one; consumer thread only */
+	bool pop(T &item) {
+		T * next = front();
+		if (next == nullptr) return false;
+		item = std::move(*next);
+		pop_front();
+		return true;
+	}
+
+	/*
+	 * Calls func(T &) on every item currently in the queue, oldest first, removing them as it goes. Returns
+	 * the number of items handled. Consumer thread only.
+	 */
+	template <typename F>
+	std::size_t drain(F &&func) {
+		std::size_t count = 0;
+		T * next;
+		while ((next = front()) != nullptr) {
+			struct pop_guard_t {
+				mpsc_queue &queue;
+				~pop_guard_t() { queue.pop_front(); }
+			} guard{ *this };
+			func(*next);
+			++count;
+		}
+		return count;
+	}
+
+	/* True if nothing has been pushed since the last pop/drain; consumer thread only */
+	bool empty() const noexcept {
+		if (spill_index < spill.size() || overflowing.load(std::memory_order_acquire)) return false;
+		const cell_t * cells = ring.load(std::memory_order_acquire);
+		return cells == nullptr || cells[dequeue_position & mask].sequence.load(std::memory_order_acquire) != dequeue_position + 1;
+	}
+
+private:
+	struct cell_t {
+		std::atomic<std::size_t> sequence{0};
+		bool skipped = false; // Constructing the item threw; the consumer passes over the slot
+		typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+
+		T * value() noexcept { return reinterpret_cast<T *>(&storage); }
+	};
+
+	static constexpr std::size_t default_capacity() noexcept {
+		return sizeof(cell_t) * 64 > 32768 ? 64 : 32768 / sizeof(cell_t);
+	}
+
+	static std::size_t round_up(const std::size_t capacity) noexcept {
+		std::size_t size = 2;
+		while (size < capacity) size <<= 1;
+		return size;
+	}
+
+	cell_t * cells_for_push() {
+		cell_t * cells = ring.load(std::memory_order_acquire);
+		if (cells != nullptr) return cells;
+		std::unique_ptr<cell_t[]> fresh(new cell_t[mask + 1]);
+		for (std::size_t i=0; i<=mask; ++i) fresh[i].sequence.store(i, std::memory_order_relaxed);
+		if (ring.compare_exchange_strong(cells, fresh.get(), std::memory_order_acq_rel, std::memory_order_acquire)) return fresh.release();
+		return cells; // Another producer got there first
+	}
+
+	/* Puts item in the ring if there is room; item is only moved from if it succeeds */
+	bool push_ring(T &item) {
+		cell_t * cells = cells_for_push();
+		std::size_t position = enqueue_position.load(std::memory_order_relaxed);
+		for (;;) {
+			cell_t &cell = cells[position & mask];
+			const std::size_t sequence = cell.sequence.load(std::memory_order_acquire);
+			const std::ptrdiff_t difference = static_cast<std::ptrdiff_t>(sequence - position);
+			if (difference == 0) {
+				if (enqueue_position.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+					try {
+						new (&cell.storage) T(std::move(item));
+						cell.skipped = false;
+					} catch (...) {
+						cell.skipped = true;
+						cell.sequence.store(position + 1, std::memory_order_release);
+						throw;
+					}
+					cell.sequence.store(position + 1, std::memory_order_release);
+					return true;
+				}
+			} else if (difference < 0) {
+				return false; // Full
+			} else {
+				position = enqueue_position.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	/* The oldest item: the rest of a taken-over overflow list first, then the ring, then the overflow list */
+	T * front() {
+		for (;;) {
+			if (spill_index < spill.size()) return &spill[spill_index];
+			cell_t * cells = ring.load(std::memory_order_acquire);
+			if (cells != nullptr) {
+				cell_t &cell = cells[dequeue_position & mask];
+				if (cell.sequence.load(std::memory_order_acquire) == dequeue_position + 1) {
+					if (!cell.skipped) return cell.value();
+					release(cell);
+					continue;
+				}
+			}
+			if (!take_overflow()) return nullptr;
+		}
+	}
+
+	void pop_front() noexcept {
+		if (spill_index < spill.size()) {
+			if (++spill_index == spill.size()) {
+				spill.clear();
+				spill_index = 0;
+			}
+			return;
+		}
+		cell_t &cell = ring.load(std::memory_order_relaxed)[dequeue_position & mask];
+		cell.value()->~T();
+		release(cell);
+	}
+
+	void release(cell_t &cell) noexcept {
+		cell.sequence.store(dequeue_position + mask + 1, std::memory_order_release);
+		++dequeue_position;
+	}
+
+	/*
+	 * Moves the overflow list into spill, once every ring push that was claimed before it has been consumed -
+	 * a producer's earlier items may still be in the ring, and must come out first.
+	 */
+	bool take_overflow() {
+		if (!overflowing.load(std::memory_order_acquire)) return false;
+		std::lock_guard<std::mutex> lock(overflow_mutex);
+		if (enqueue_position.load(std::memory_order_acquire) != dequeue_position) return false;
+		spill.swap(overflow);
+		overflowing.store(false, std::memory_order_release);
+		return !spill.empty();
+	}
+
+	const std::size_t mask;
+	std::atomic<cell_t *> ring{nullptr};
+
+	// Producer side: the next ring position to claim, and the overflow list for when the ring is full
+	std::atomic<std::size_t> enqueue_position{0};
+	std::atomic<bool> overflowing{false};
+	std::mutex overflow_mutex;
+	std::vector<T> overflow;
+
+	// Consumer side: the next ring position to read, and an overflow list taken over but not yet consumed
+	std::size_t dequeue_position = 0;
+	std::vector<T> spill;
+	std::size_t spill_index = 0;
+};
+
+}
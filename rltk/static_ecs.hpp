@@ -0,0 +1,348 @@
+#pragma once
+
+/* RLTK (RogueLike Tool Kit) 1.00
+ * Copyright (c) 2016-Present, Bracket Productions.
+ * Licensed under the MIT license - see LICENSE file.
+ *
+ * Statically typed entity-component world, for games with a fixed set of component types.
+ */
+
+#include "ecs.hpp"
+
+namespace rltk {
+
+    namespace impl {
+
+        /* The position of C in the list Cs..., as a compile-time constant */
+        template <class C, class... Cs>
+        struct type_index;
+
+        template <class C>
+        struct type_index<C> {
+            static_assert(sizeof(C) == 0, "This component type is not part of the static_ecs");
+        };
+
+        template <class C, class... Cs>
+        struct type_index<C, C, Cs...> : std::integral_constant<std::size_t, 0> {};
+
+        template <class C, class D, class... Cs>
+        struct type_index<C, D, Cs...> : std::integral_constant<std::size_t, 1 + type_index<C, Cs...>::value> {};
+
+        /*
+         * How static_ecs iteration reaches a component: a pointer into the store or, for a type with an
+         * soa_layout, a copy gathered from the arrays and scattered back when the reference goes out of scope.
+         */
+        template <class C, bool SOA = soa_layout<C>::enabled>
+        struct static_component_ref_t {
+            C * component;
+
+            static_component_ref_t(typename store_for<C>::type &store, const std::size_t entity_id) noexcept : component(store.find(entity_id)) {}
+            inline C & get() noexcept { return *component; }
+        };
+
+        template <class C>
+        struct static_component_ref_t<C, true> {
+            soa_component_store_t<C> * store;
+            std::size_t idx;
+            C component;
+
+            static_component_ref_t(soa_component_store_t<C> &s, const std::size_t entity_id) : store(&s), idx(s.find_index(entity_id)), component(s.gather(idx)) {}
+            ~static_component_ref_t() { store->scatter(idx, component); }
+            static_component_ref_t(const static_component_ref_t &) = delete;
+            static_component_ref_t & operator=(const static_component_ref_t &) = delete;
+            inline C & get() noexcept { return component; }
+        };
+    }
+
+    /*
+     * An entity in a static_ecs. It works like entity_t, but its component mask has one bit per component type
+     * of the world it belongs to, and the world is always passed explicitly.
+     */
+    template <std::size_t N>
+    struct static_entity_t {
+        std::size_t id = 0;
+        std::uint32_t generation = 0;
+        bool deleted = true;
+        std::bitset<N> component_mask;
+
+        inline entity_handle_t handle() const noexcept {
+            return entity_handle_t{ id, generation };
+        }
+
+        bool operator == (const static_entity_t &other) const { return other.id == id; }
+        bool operator != (const static_entity_t &other) const { return other.id != id; }
+
+        template <class C, class World>
+        inline static_entity_t * assign(World &world, C component) {
+            world.assign(*this, std::move(component));
+            return this;
+        }
+
+        template <class C, class World>
+        inline C * component(World &world) noexcept {
+            return world.template component<C>(*this);
+        }
+    };
+
+    /*
+     * static_ecs is an entity-component world whose component types are fixed at compile time:
+     *
+     *     rltk::static_ecs<position, renderable, ai> world;
+     *     world.create_entity()->assign(world, position{1,2});
+     *     world.each<position, ai>([] (auto &e, position &pos, ai &brain) { ... });
+     *
+     * Each component type gets its own store, held by value in a tuple, so finding a type's store is a
+     * compile-time lookup - there is no virtual dispatch, family ID or store indirection, and nothing is shared
+     * with other worlds. The entity/assign/component/each vocabulary matches ecs, so a system written against
+     * a generic world (auto & for the entity) works with either. Deletion is deferred in the same way: entities
+     * and components are marked deleted, and removed by ecs_garbage_collect.
+     *
+     * Systems, messaging, views and serialization are not provided; use ecs for those.
+     */
+    template <class... Components>
+    class static_ecs {
+    public:
+        static constexpr std::size_t COMPONENT_COUNT = sizeof...(Components);
+        typedef static_entity_t<COMPONENT_COUNT> entity_type;
+
+        static_ecs() = default;
+        static_ecs(const static_ecs &) = delete;
+        static_ecs & operator=(const static_ecs &) = delete;
+
+        /* Returns the live entity with a given ID, or nullptr. */
+        inline entity_type * entity(const std::size_t id) noexcept {
+            if (id == 0 || id >= entities.size() || entities[id].deleted) return nullptr;
+            return &entities[id];
+        }
+
+        /* Returns the entity referred to by a handle, or nullptr if it is gone or the ID was recycled. */
+        inline entity_type * entity(const entity_handle_t &handle) noexcept {
+            entity_type * result = entity(handle.id);
+            return (result && result->generation == handle.generation) ? result : nullptr;
+        }
+
+        /* Creates an entity, re-using a garbage collected ID if one is available. */
+        inline entity_type * create_entity() {
+            std::size_t id = 0;
+            while (id == 0 && !free_ids.empty()) {
+                id = free_ids.front();
+                free_ids.pop_front();
+                if (!entities[id].deleted) id = 0; // Claimed by create_entity(id) since it was freed
+            }
+            if (id == 0) id = std::max<std::size_t>(entities.size(), 1);
+            return occupy(id);
+        }
+
+        /* Creates an entity with a specified ID #. Throws if the ID is in use. */
+        inline entity_type * create_entity(const std::size_t new_id) {
+            if (new_id == 0 || (new_id < entities.size() && !entities[new_id].deleted)) {
+                throw std::runtime_error("WARNING: Duplicate entity ID. Odd things will happen\n");
+            }
+            return occupy(new_id);
+        }
+
+        /* Marks an entity, and all of its components, as deleted. */
+        inline void delete_entity(const std::size_t id) noexcept {
+            entity_type * e = entity(id);
+            if (!e) return;
+            for_each_store([e] (auto &store, const std::size_t family) {
+                if (e->component_mask.test(family)) store.mark_deleted(e->id);
+            });
+            e->component_mask.reset();
+            e->deleted = true;
+            --live_entities;
+            pending_entity_deletes.push_back(id);
+            pending_component_deletes = true;
+        }
+
+        inline void delete_entity(entity_type &e) noexcept {
+            delete_entity(e.id);
+        }
+
+        inline void delete_all_entities() noexcept {
+            for (std::size_t id=1; id<entities.size(); ++id) {
+                delete_entity(id);
+            }
+        }
+
+        /* Adds (or replaces) a component of type C on an entity. */
+        template <class C>
+        inline void assign(entity_type &e, C component) {
+            if (e.deleted) throw std::runtime_error("Cannot assign to a deleted entity");
+            store<C>().insert(e.id, component);
+            e.component_mask.set(family<C>());
+        }
+
+        /* Finds an entity's component of type C, or nullptr if it has none. */
+        template <class C>
+        inline C * component(entity_type &e) noexcept {
+            static_assert(!soa_layout<C>::enabled, "Components with an soa_layout have no address; use each, all_components or each_chunk");
+            if (e.deleted || !e.component_mask.test(family<C>())) return nullptr;
+            return store<C>().find(e.id);
+        }
+
+        /* Marks an entity's component as deleted. */
+        template <class C>
+        inline void delete_component(const std::size_t entity_id, bool delete_entity_if_empty=false) noexcept {
+            entity_type * e = entity(entity_id);
+            if (!e || !e->component_mask.test(family<C>())) return;
+            store<C>().mark_deleted(entity_id);
+            e->component_mask.reset(family<C>());
+            pending_component_deletes = true;
+            if (delete_entity_if_empty && e->component_mask.none()) delete_entity(entity_id);
+        }
+
+        /* Returns every live entity that has a component of type C. */
+        template <class C>
+        inline std::vector<entity_type *> entities_with_component() {
+            std::vector<entity_type *> result;
+            for_each_match<C>([&result] (entity_type &e) { result.push_back(&e); });
+            return result;
+        }
+
+        /* Calls func(entity, C &) on every live component of type C, in the store's dense order. */
+        template <class C, typename F>
+        inline void all_components(F func) {
+            auto &s = store<C>();
+            const std::size_t count = s.size();
+            for (std::size_t i=0; i<count; ++i) {
+                if (s.is_deleted(i)) continue;
+                entity_type * e = entity(s.entity_ids[i]);
+                if (e) s.visit(i, [&func, e] (C &component) { func(*e, component); });
+            }
+        }
+
+        /* Hands func the dense arrays for component type C, exactly as ecs::each_chunk does. */
+        template <class C, typename F>
+        inline void each_chunk(F func) {
+            auto &s = store<C>();
+            if (s.size() == 0) return;
+            auto chunk = s.chunk(0, s.size());
+            func(chunk);
+        }
+
+        /*
+         * Calls callback(entity, Cs &...) for every live entity having all of Cs. Iteration walks the smallest of
+         * the Cs stores, and tests the rest with the entity's component mask. With no component types, every
+         * live entity is visited.
+         */
+        template <typename... Cs, typename F>
+        inline void each(F callback) {
+            for_each_match<Cs...>([this, &callback] (entity_type &e) {
+                callback(e, impl::static_component_ref_t<Cs>(store<Cs>(), e.id).get()...);
+            });
+        }
+
+        /* As each, but only calls callback when predicate (given the same arguments) returns true. */
+        template <typename... Cs, typename P, typename F>
+        inline void each_if(P&& predicate, F callback) {
+            for_each_match<Cs...>([this, &predicate, &callback] (entity_type &e) {
+                call_if(e, predicate, callback, impl::static_component_ref_t<Cs>(store<Cs>(), e.id)...);
+            });
+        }
+
+        /* Removes everything marked as deleted, and frees the IDs of deleted entities for re-use. */
+        inline void ecs_garbage_collect() {
+            if (pending_component_deletes) {
+                for_each_store([] (auto &store, const std::size_t) { store.really_delete(); });
+                pending_component_deletes = false;
+            }
+            for (const std::size_t &id : pending_entity_deletes) {
+                entity_type &e = entities[id];
+                if (!e.deleted) continue; // Re-created with create_entity(id) since it was deleted
+                ++e.generation;
+                free_ids.push_back(id);
+            }
+            pending_entity_deletes.clear();
+        }
+
+        /* Number of live entities */
+        inline std::size_t size() const noexcept {
+            return live_entities;
+        }
+
+        /* Direct access to the store for component type C */
+        template <class C>
+        inline typename impl::store_for<C>::type & store() noexcept {
+            return std::get<family<C>()>(stores);
+        }
+
+        /* The bit used for component type C in an entity's component_mask */
+        template <class C>
+        static constexpr std::size_t family() noexcept {
+            return impl::type_index<C, Components...>::value;
+        }
+
+    private:
+        std::tuple<typename impl::store_for<Components>::type...> stores;
+        std::deque<entity_type> entities{ entity_type{} }; // Indexed by ID; a deque so entity pointers stay valid. ID 0 is never used.
+        std::deque<std::size_t> free_ids;
+        std::vector<std::size_t> pending_entity_deletes;
+        std::size_t live_entities = 0;
+        bool pending_component_deletes = false;
+
+        inline entity_type * occupy(const std::size_t id) {
+            while (entities.size() <= id) {
+                entities.emplace_back();
+                entities.back().id = entities.size() - 1;
+                if (entities.size() - 1 != id) free_ids.push_back(entities.size() - 1); // Skipped by create_entity(id)
+            }
+            entity_type &e = entities[id];
+            e.id = id;
+            e.deleted = false;
+            e.component_mask.reset();
+            ++live_entities;
+            return &e;
+        }
+
+        template <typename F, std::size_t... I>
+        inline void for_each_store(F &&func, std::index_sequence<I...>) {
+            int unused[] = { 0, (func(std::get<I>(stores), I), 0)... };
+            (void)unused;
+        }
+
+        /* Calls func(store, family) on every component store */
+        template <typename F>
+        inline void for_each_store(F &&func) {
+            for_each_store(func, std::index_sequence_for<Components...>());
+        }
+
+        template <typename P, typename F, typename... Refs>
+        static inline void call_if(entity_type &e, P &predicate, F &callback, Refs &&... refs) {
+            if (predicate(e, refs.get()...)) callback(e, refs.get()...);
+        }
+
+        /*
+         * Calls visit(entity_type &) for every live entity whose mask holds all of Cs. Every store keeps its
+         * entity IDs in a std::vector<std::size_t>, so the smallest one can be picked at run time and walked
+         * without knowing its type. Entities added during the walk are not visited.
+         */
+        template <typename... Cs, typename F>
+        inline void for_each_match(F &&visit) {
+            if (sizeof...(Cs) == 0) {
+                const std::size_t count = entities.size();
+                for (std::size_t id=1; id<count; ++id) {
+                    if (!entities[id].deleted) visit(entities[id]);
+                }
+                return;
+            }
+
+            std::bitset<COMPONENT_COUNT> required;
+            int unused[] = { 0, (required.set(family<Cs>()), 0)... };
+            (void)unused;
+
+            const std::vector<std::size_t> * candidates[] = { nullptr, &store<Cs>().entity_ids... };
+            const std::vector<std::size_t> * smallest = nullptr;
+            for (const std::vector<std::size_t> * candidate : candidates) {
+                if (candidate && (!smallest || candidate->size() < smallest->size())) smallest = candidate;
+            }
+
+            const std::size_t count = smallest->size();
+            for (std::size_t i=0; i<count; ++i) {
+                entity_type * e = entity((*smallest)[i]);
+                if (e && (e->component_mask & required) == required) visit(*e);
+            }
+        }
+    };
+
+}
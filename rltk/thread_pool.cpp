@@ -0,0 +1,105 @@
+#include "thread_pool.hpp"
+
+namespace rltk {
+
+namespace {
+	thread_local const thread_pool * current_pool = nullptr;
+	thread_local std::size_t current_worker_index = thread_pool::NOT_A_WORKER;
+}
+
+constexpr std::size_t thread_pool::NOT_A_WORKER;
+
+thread_pool::thread_pool(std::size_t threads) {
+	if (threads == 0) {
+		const std::size_t hardware = std::thread::hardware_concurrency();
+		threads = hardware > 1 ? hardware - 1 : 1;
+	}
+	worker_queues.reserve(threads);
+	for (std::size_t i=0; i<threads; ++i) {
+		worker_queues.push_back(std::make_unique<task_queue_t>());
+	}
+	workers.reserve(threads);
+	for (std::size_t i=0; i<threads; ++i) {
+		workers.emplace_back([this, i] () { worker_loop(i); });
+	}
+}
+
+thread_pool::~thread_pool() {
+	{
+		std::lock_guard<std::mutex> lock(sleep_mutex);
+		stopping = true;
+	}
+	tasks_ready.notify_all();
+	for (std::thread &worker : workers) {
+		worker.join();
+	}
+}
+
+void thread_pool::submit(std::function<void()> task) {
+	const std::size_t index = worker_index();
+	task_queue_t &queue = (index == NOT_A_WORKER) ? shared_queue : *worker_queues[index];
+	{
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		queue.tasks.push_back(std::move(task));
+	}
+	{
+		// Taking the lock orders this with a worker checking pending before it sleeps
+		std::lock_guard<std::mutex> lock(sleep_mutex);
+		++pending;
+	}
+	tasks_ready.notify_one();
+}
+
+std::size_t thread_pool::worker_index() const noexcept {
+	return current_pool == this ? current_worker_index : NOT_A_WORKER;
+}
+
+bool thread_pool::try_pop(const std::size_t index, std::function<void()> &task) {
+	// Newest task from our own deque first, as it is most likely still in cache
+	{
+		task_queue_t &own = *worker_queues[index];
+		std::lock_guard<std::mutex> lock(own.mutex);
+		if (!own.tasks.empty()) {
+			task = std::move(own.tasks.back());
+			own.tasks.pop_back();
+			return true;
+		}
+	}
+	{
+		std::lock_guard<std::mutex> lock(shared_queue.mutex);
+		if (!shared_queue.tasks.empty()) {
+			task = std::move(shared_queue.tasks.front());
+			shared_queue.tasks.pop_front();
+			return true;
+		}
+	}
+	// Steal the oldest task from another worker
+	for (std::size_t offset=1; offset<worker_queues.size(); ++offset) {
+		task_queue_t &victim = *worker_queues[(index + offset) % worker_queues.size()];
+		std::lock_guard<std::mutex> lock(victim.mutex);
+		if (!victim.tasks.empty()) {
+			task = std::move(victim.tasks.front());
+			victim.tasks.pop_front();
+			return true;
+		}
+	}
+	return false;
+}
+
+void thread_pool::worker_loop(const std::size_t index) {
+	current_pool = this;
+	current_worker_index = index;
+	while (true) {
+		std::function<void()> task;
+		if (try_pop(index, task)) {
+			--pending;
+			task();
+			continue;
+		}
+		std::unique_lock<std::mutex> lock(sleep_mutex);
+		tasks_ready.wait(lock, [this] () { return stopping || pending.load() > 0; });
+		if (stopping && pending.load() == 0) return;
+	}
+}
+
+}
@@ -0,0 +1,126 @@
+#pragma once
+
+/* RLTK (RogueLike Tool Kit) 1.00
+ * Copyright (c) 2016-Present, Bracket Productions.
+ * Licensed under the MIT license - see LICENSE file.
+ *
+ * Work-stealing thread pool, used by the ECS for parallel iteration and system scheduling.
+ */
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <memory>
+#include <exception>
+#include <limits>
+#include <algorithm>
+#include <type_traits>
+
+namespace rltk {
+
+class thread_pool
+{
+public:
+	/*
+	 * Starts a pool with the given number of worker threads. Zero picks one less than the number of
+	 * hardware threads (the thread calling parallel_for does a share of the work), with a minimum of one.
+	 */
+	explicit thread_pool(std::size_t threads = 0);
+	~thread_pool();
+
+	thread_pool(const thread_pool &) = delete;
+	thread_pool & operator=(const thread_pool &) = delete;
+
+	std::size_t size() const noexcept { return workers.size(); }
+
+	/*
+	 * Queues a task to run on a worker thread. Tasks submitted from one of this pool's workers go on that
+	 * worker's own deque (it takes the newest first, idle workers steal the oldest); tasks from any other
+	 * thread go on a shared queue.
+	 */
+	void submit(std::function<void()> task);
+
+	/*
+	 * Calls func(begin, end) over [0, count), split into ranges of at most grain items. The calling
+	 * thread works on ranges too, and the call returns once every range is done. If any call throws,
+	 * the first exception is re-thrown here after the remaining ranges finish.
+	 */
+	template <typename F>
+	void parallel_for(const std::size_t count, std::size_t grain, F &&func);
+
+	/*
+	 * Index of this pool's worker running the current thread, or NOT_A_WORKER on any other thread.
+	 */
+	std::size_t worker_index() const noexcept;
+	static constexpr std::size_t NOT_A_WORKER = std::numeric_limits<std::size_t>::max();
+
+private:
+	struct task_queue_t {
+		std::mutex mutex;
+		std::deque<std::function<void()>> tasks;
+	};
+
+	void worker_loop(const std::size_t index);
+	bool try_pop(const std::size_t index, std::function<void()> &task);
+
+	std::vector<std::thread> workers;
+	std::vector<std::unique_ptr<task_queue_t>> worker_queues;
+	task_queue_t shared_queue;
+	std::atomic<std::size_t> pending{0};
+	std::mutex sleep_mutex;
+	std::condition_variable tasks_ready;
+	bool stopping = false;
+};
+
+template <typename F>
+void thread_pool::parallel_for(const std::size_t count, std::size_t grain, F &&func) {
+	if (count == 0) return;
+	if (grain == 0) grain = 1;
+	const std::size_t chunks = (count + grain - 1) / grain;
+	if (chunks == 1) {
+		func(std::size_t(0), count);
+		return;
+	}
+
+	// Shared with the helper tasks, which may only get to run after this call has returned.
+	struct shared_state_t {
+		std::atomic<std::size_t> next_chunk{0};
+		std::atomic<std::size_t> chunks_done{0};
+		std::mutex done_mutex;
+		std::condition_variable all_done;
+		std::exception_ptr error;
+	};
+	auto state = std::make_shared<shared_state_t>();
+	typename std::remove_reference<F>::type * body = &func;
+
+	auto run_chunks = [state, body, count, grain, chunks] () {
+		std::size_t chunk;
+		while ((chunk = state->next_chunk.fetch_add(1)) < chunks) {
+			const std::size_t begin = chunk * grain;
+			try {
+				(*body)(begin, std::min(begin + grain, count));
+			} catch (...) {
+				std::lock_guard<std::mutex> lock(state->done_mutex);
+				if (!state->error) state->error = std::current_exception();
+			}
+			if (state->chunks_done.fetch_add(1) + 1 == chunks) {
+				std::lock_guard<std::mutex> lock(state->done_mutex);
+				state->all_done.notify_all();
+			}
+		}
+	};
+
+	const std::size_t helpers = std::min(workers.size(), chunks - 1);
+	for (std::size_t i=0; i<helpers; ++i) submit(run_chunks);
+	run_chunks();
+
+	std::unique_lock<std::mutex> lock(state->done_mutex);
+	state->all_done.wait(lock, [&state, chunks] () { return state->chunks_done.load() == chunks; });
+	if (state->error) std::rethrow_exception(state->error);
+}
+
+}
@@ -0,0 +1,162 @@
+/* RLTK (RogueLike Tool Kit) 1.00
+ * Copyright (c) 2016-Present, Bracket Productions.
+ * Licensed under the MIT license - see LICENSE file.
+ *
+ * Delta save test: after a full save, the world is changed - components assigned, marked changed in place and
+ * removed, entities deleted, IDs recycled - and a delta is written after each round of changes. Loading the full
+ * save and applying the deltas in order must rebuild the world exactly; applying one out of order, or one from
+ * another chain, must throw and leave the world alone.
+ */
+
+#include "../rltk/ecs.hpp"
+#include <cstdio>
+#include <iostream>
+#include <map>
+#include <sstream>
+
+using namespace rltk;
+
+struct position_t {
+	int x = 0;
+	int y = 0;
+};
+
+struct velocity_t {
+	float dx = 0.0F;
+	float dy = 0.0F;
+};
+RLTK_SOA_LAYOUT(velocity_t, &velocity_t::dx, &velocity_t::dy)
+
+struct player_t {};
+
+constexpr int ENTITIES = 2000;
+constexpr int ROUNDS = 4;
+
+std::string save_path(const int round) {
+	return "ecs_delta_saves_test_" + std::to_string(round) + ".bin";
+}
+
+/* Everything about the world's entities, one line each in ID order, for comparing two worlds */
+std::string describe(ecs &world) {
+	std::map<std::size_t, std::ostringstream> rows;
+	world.each([&world, &rows] (entity_t &e) {
+		std::ostringstream &row = rows[e.id];
+		row << e.id << "@" << e.generation;
+		if (position_t * pos = e.component<position_t>(world)) row << " pos " << pos->x << "," << pos->y;
+		if (e.component<player_t>(world)) row << " player";
+	});
+	world.each<velocity_t>([&rows] (entity_t &e, velocity_t &velocity) {
+		rows[e.id] << " vel " << velocity.dx << "," << velocity.dy;
+	});
+	std::string result;
+	for (auto &row : rows) result += row.second.str() + "\n";
+	return result;
+}
+
+/* One round of changes, of every kind a delta has to carry */
+void change(ecs &world, const int round) {
+	for (int i=0; i<50; ++i) {
+		const std::size_t id = 1 + static_cast<std::size_t>((round * 131 + i * 37) % ENTITIES);
+		entity_t * e = world.entity(id);
+		if (!e) continue;
+		switch (i % 5) {
+			case 0 : e->assign(world, position_t{ round, i }); break;
+			case 1 : world.delete_entity(id); break;
+			case 2 : world.delete_component<position_t>(id); break;
+			case 3 : e->assign(world, player_t{}); break;
+			case 4 : e->assign(world, velocity_t{ static_cast<float>(round), static_cast<float>(i) }); break;
+		}
+	}
+	// Modified in place, then marked
+	world.each<position_t>([&world, round] (entity_t &e, position_t &pos) {
+		if (e.id % 97 == static_cast<std::size_t>(round)) {
+			pos.y += 1000;
+			world.mark_changed<position_t>(e);
+		}
+	});
+	world.ecs_garbage_collect();
+	// Some of these recycle the IDs deleted above
+	for (int i=0; i<20; ++i) world.create_entity()->assign(world, position_t{ -round, -i });
+}
+
+int main() {
+	int failures = 0;
+	for (const storage_mode_t mode : { storage_mode_t::SPARSE_SET, storage_mode_t::ARCHETYPE }) {
+		const std::string name = (mode == storage_mode_t::SPARSE_SET) ? "sparse set" : "archetype";
+		ecs world(mode);
+		world.enable_delta_saves();
+		for (int i=0; i<ENTITIES; ++i) {
+			entity_t * e = world.create_entity();
+			e->assign(world, position_t{ i, -i });
+			if (i % 2 == 0) e->assign(world, velocity_t{ static_cast<float>(i), 1.0F });
+		}
+		{
+			std::unique_ptr<std::ofstream> out = std::make_unique<std::ofstream>(save_path(0), std::ios::binary);
+			world.ecs_save(out);
+		}
+		std::vector<std::string> expected;
+		for (int round=1; round<=ROUNDS; ++round) {
+			change(world, round);
+			std::unique_ptr<std::ofstream> out = std::make_unique<std::ofstream>(save_path(round), std::ios::binary);
+			world.ecs_save_delta(out);
+			expected.push_back(describe(world));
+		}
+
+		ecs loaded(mode);
+		{
+			std::unique_ptr<std::ifstream> in = std::make_unique<std::ifstream>(save_path(0), std::ios::binary);
+			loaded.ecs_load(in);
+		}
+		for (int round=1; round<=ROUNDS; ++round) {
+			// Skipping ahead must be refused, without touching the world
+			if (round < ROUNDS) {
+				const std::string before = describe(loaded);
+				bool threw = false;
+				try {
+					std::unique_ptr<std::ifstream> in = std::make_unique<std::ifstream>(save_path(round + 1), std::ios::binary);
+					loaded.ecs_apply_delta(in);
+				} catch (std::runtime_error &) {
+					threw = true;
+				}
+				if (!threw || describe(loaded) != before) {
+					std::cout << name << ": delta " << round + 1 << " was applied out of order\n";
+					++failures;
+				}
+			}
+			std::unique_ptr<std::ifstream> in = std::make_unique<std::ifstream>(save_path(round), std::ios::binary);
+			loaded.ecs_apply_delta(in);
+			if (describe(loaded) != expected[round - 1]) {
+				std::cout << name << ": after delta " << round << " the world differs from the one saved\n";
+				++failures;
+			}
+		}
+
+		// A delta from another chain is refused too
+		ecs other(mode);
+		other.enable_delta_saves();
+		other.create_entity()->assign(other, position_t{ 1, 1 });
+		{
+			std::unique_ptr<std::ofstream> out = std::make_unique<std::ofstream>(save_path(0), std::ios::binary);
+			other.ecs_save(out);
+		}
+		other.create_entity();
+		{
+			std::unique_ptr<std::ofstream> out = std::make_unique<std::ofstream>(save_path(1), std::ios::binary);
+			other.ecs_save_delta(out);
+		}
+		bool threw = false;
+		try {
+			std::unique_ptr<std::ifstream> in = std::make_unique<std::ifstream>(save_path(1), std::ios::binary);
+			loaded.ecs_apply_delta(in);
+		} catch (std::runtime_error &) {
+			threw = true;
+		}
+		if (!threw) {
+			std::cout << name << ": a delta from another save was applied\n";
+			++failures;
+		}
+	}
+	for (int round=0; round<=ROUNDS; ++round) std::remove(save_path(round).c_str());
+	if (failures == 0) std::cout << "ecs_delta_saves: every delta rebuilt the saved world\n";
+	return failures == 0 ? 0 : 1;
+}
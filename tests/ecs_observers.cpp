@@ -0,0 +1,97 @@
+/* RLTK (RogueLike Tool Kit) 1.00
+ * Copyright (c) 2016-Present, Bracket Productions.
+ * Licensed under the MIT license - see LICENSE file.
+ *
+ * Observer test: on_add, on_replace and on_remove events are held until a sync point - notify_observers, the end
+ * of each wave of ecs_tick, or ecs_garbage_collect - then delivered in the order they happened, with the values
+ * involved. Events raised by an observer are delivered in the same batch.
+ */
+
+#include "../rltk/ecs.hpp"
+#include <iostream>
+#include <sstream>
+
+using namespace rltk;
+
+struct health_t { int hp = 10; };
+struct dead_t {};
+
+/* Wounds everything with health, and notes what the observers had seen by the end of its update */
+struct damage_system : public base_system {
+	ecs &world;
+	std::ostringstream &events;
+	std::string seen_during_update;
+
+	damage_system(ecs &w, std::ostringstream &e) : world(w), events(e) {}
+
+	virtual void update(const double duration_ms) override {
+		world.each<health_t>([this] (entity_t &e, health_t &health) {
+			e.assign(world, health_t{ health.hp - 4 });
+		});
+		seen_during_update = events.str();
+	}
+};
+
+int expect(const std::string &log, const std::string &expected, const std::string &when) {
+	if (log == expected) return 0;
+	std::cout << when << ": observers saw \"" << log << "\", expected \"" << expected << "\"\n";
+	return 1;
+}
+
+int run(const storage_mode_t mode, const char * name) {
+	int failures = 0;
+	ecs world(mode);
+	std::ostringstream events;
+	world.on_add<health_t>([&events] (entity_t &e, const health_t &health) {
+		events << "add " << e.id << "=" << health.hp << ";";
+	});
+	world.on_replace<health_t>([&events, &world] (entity_t &e, const health_t &old, const health_t &now) {
+		events << "replace " << e.id << "=" << old.hp << ">" << now.hp << ";";
+		// Raises an event of its own, which must arrive in the same batch
+		if (now.hp <= 0) e.assign(world, dead_t{});
+	});
+	world.on_remove<health_t>([&events] (entity_t &e, const health_t &health) {
+		events << "remove " << e.id << "=" << health.hp << ";";
+	});
+	world.on_add<dead_t>([&events] (entity_t &e, const dead_t &) {
+		events << "dead " << e.id << ";";
+	});
+
+	entity_t * a = world.create_entity();
+	entity_t * b = world.create_entity();
+	a->assign(world, health_t{ 5 });
+	b->assign(world, health_t{ 7 });
+	a->assign(world, health_t{ 0 });
+	failures += expect(events.str(), "", std::string(name) + ", before notify_observers");
+	world.notify_observers();
+	failures += expect(events.str(), "add 1=5;add 2=7;replace 1=5>0;dead 1;", std::string(name) + ", notify_observers");
+
+	// A removal hands over the value, even once the entity has been garbage collected
+	events.str("");
+	world.delete_component<health_t>(1);
+	world.delete_entity(2);
+	world.ecs_garbage_collect();
+	failures += expect(events.str(), "remove 1=0;remove 2=7;", std::string(name) + ", ecs_garbage_collect");
+
+	// Changes made by a system are held until its wave is over
+	entity_t * c = world.create_entity();
+	c->assign(world, health_t{ 9 });
+	world.notify_observers();
+	events.str("");
+	world.add_system<damage_system>(world, events);
+	world.ecs_configure();
+	world.ecs_tick(1.0);
+	const damage_system &system = static_cast<const damage_system &>(*world.system_store.back());
+	failures += expect(system.seen_during_update, "", std::string(name) + ", during ecs_tick");
+	std::ostringstream expected;
+	expected << "replace " << c->id << "=9>5;";
+	failures += expect(events.str(), expected.str(), std::string(name) + ", after ecs_tick");
+	return failures;
+}
+
+int main() {
+	int failures = run(storage_mode_t::SPARSE_SET, "sparse set");
+	failures += run(storage_mode_t::ARCHETYPE, "archetype");
+	if (failures == 0) std::cout << "ecs_observers: every event arrived at its sync point\n";
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,105 @@
+/* RLTK (RogueLike Tool Kit) 1.00
+ * Copyright (c) 2016-Present, Bracket Productions.
+ * Licensed under the MIT license - see LICENSE file.
+ *
+ * Stress test: systems that only read the same components land in the same wave of ecs_tick, and iterate
+ * shared views (and, in archetype mode, the archetypes) at the same time. Between ticks the world is changed
+ * so that every view is stale when the wave starts. Every reader must see exactly the live matching entities.
+ */
+
+#include "../rltk/ecs.hpp"
+#include <iostream>
+
+using namespace rltk;
+
+struct position_t { int x = 0; int y = 0; };
+struct health_t { int hp = 10; };
+struct burning_t { int turns = 3; };
+
+constexpr int TICKS = 200;
+constexpr int ENTITIES = 5000;
+
+struct reader_system : public base_system {
+	ecs &world;
+	std::size_t positions = 0;
+	std::size_t wounded = 0;
+	std::size_t on_fire = 0;
+
+	explicit reader_system(ecs &w) : world(w) {
+		reads<position_t, health_t, burning_t>();
+	}
+
+	virtual void update(const double duration_ms) override {
+		positions = 0;
+		wounded = 0;
+		on_fire = 0;
+		world.view<position_t>().each([this] (entity_t &e, position_t &pos) {
+			if (pos.x >= 0) ++positions;
+		});
+		world.each<position_t, health_t>([this] (entity_t &e, position_t &pos, health_t &health) {
+			if (health.hp < 10) ++wounded;
+		});
+		world.all_components<burning_t>([this] (entity_t &e, burning_t &burning) {
+			++on_fire;
+		});
+	}
+};
+
+int run(const storage_mode_t mode, const char * name) {
+	ecs world(mode);
+	world.set_worker_threads(4);
+	for (int i=0; i<ENTITIES; ++i) {
+		entity_t * e = world.create_entity();
+		e->assign(world, position_t{ i, i });
+		if (i % 2 == 0) e->assign(world, health_t{ i % 10 });
+	}
+	const std::size_t first = world.system_store.size();
+	for (int i=0; i<4; ++i) world.add_system<reader_system>(world);
+	world.ecs_configure();
+
+	int failures = 0;
+	for (int tick=0; tick<TICKS; ++tick) {
+		// Churn the world so every view has something to compact before the wave
+		for (int i=0; i<20; ++i) {
+			const std::size_t id = 1 + static_cast<std::size_t>((tick * 37 + i * 101) % ENTITIES);
+			entity_t * e = world.entity(id);
+			if (!e) continue;
+			if (i % 3 == 0) world.delete_entity(id);
+			else if (i % 3 == 1) world.delete_component<health_t>(id);
+			else e->assign(world, burning_t{});
+		}
+		for (int i=0; i<10; ++i) {
+			entity_t * e = world.create_entity();
+			e->assign(world, position_t{ tick, i });
+			e->assign(world, health_t{ i });
+		}
+
+		// Counted without views, so on the first tick the readers create theirs inside the wave
+		std::size_t positions = 0, wounded = 0, on_fire = 0;
+		world.all_components<position_t>([&positions] (entity_t &e, position_t &pos) { if (pos.x >= 0) ++positions; });
+		world.all_components<health_t>([&world, &wounded] (entity_t &e, health_t &health) {
+			if (health.hp < 10 && e.component<position_t>(world)) ++wounded;
+		});
+		world.all_components<burning_t>([&on_fire] (entity_t &e, burning_t &burning) { ++on_fire; });
+
+		world.ecs_tick(1.0);
+
+		for (std::size_t i=first; i<world.system_store.size(); ++i) {
+			const reader_system &reader = static_cast<const reader_system &>(*world.system_store[i]);
+			if (reader.positions != positions || reader.wounded != wounded || reader.on_fire != on_fire) {
+				std::cout << name << ": tick " << tick << ", system " << i << " saw " << reader.positions << "/"
+					<< reader.wounded << "/" << reader.on_fire << " entities; expected " << positions << "/"
+					<< wounded << "/" << on_fire << "\n";
+				++failures;
+			}
+		}
+	}
+	return failures;
+}
+
+int main() {
+	int failures = run(storage_mode_t::SPARSE_SET, "sparse set");
+	failures += run(storage_mode_t::ARCHETYPE, "archetype");
+	if (failures == 0) std::cout << "ecs_parallel_systems: all readers agreed\n";
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,136 @@
+/* RLTK (RogueLike Tool Kit) 1.00
+ * Copyright (c) 2016-Present, Bracket Productions.
+ * Licensed under the MIT license - see LICENSE file.
+ *
+ * Round-trip test: a world with plain, cereal-serialized, SoA and tag components - and deletions pending when
+ * it is saved - is written with ecs_save (raw and compressed) and ecs_save_async, then read back with ecs_load
+ * and ecs_load_mapped, in each combination of storage modes. The loaded world must hold the same entities,
+ * generations and components, and carry on handing out IDs after the saved ones.
+ */
+
+#include "../rltk/ecs.hpp"
+#include <cereal/types/string.hpp>
+#include <cstdio>
+#include <iostream>
+#include <map>
+#include <sstream>
+
+using namespace rltk;
+
+struct position_t {
+	int x = 0;
+	int y = 0;
+};
+
+struct name_t {
+	std::string name;
+
+	template<class Archive>
+	void serialize(Archive & archive) {
+		archive( name );
+	}
+};
+
+struct velocity_t {
+	float dx = 0.0F;
+	float dy = 0.0F;
+};
+RLTK_SOA_LAYOUT(velocity_t, &velocity_t::dx, &velocity_t::dy)
+
+struct player_t {};
+
+constexpr int ENTITIES = 3000;
+const std::string SAVE_PATH = "ecs_snapshots_test.bin";
+
+/* Everything about the world's entities, one line each in ID order, for comparing two worlds */
+std::string describe(ecs &world) {
+	std::map<std::size_t, std::ostringstream> rows;
+	world.each([&world, &rows] (entity_t &e) {
+		std::ostringstream &row = rows[e.id];
+		row << e.id << "@" << e.generation;
+		if (position_t * pos = e.component<position_t>(world)) row << " pos " << pos->x << "," << pos->y;
+		if (name_t * name = e.component<name_t>(world)) row << " name " << name->name;
+		if (e.component<player_t>(world)) row << " player";
+	});
+	world.each<velocity_t>([&rows] (entity_t &e, velocity_t &velocity) {
+		rows[e.id] << " vel " << velocity.dx << "," << velocity.dy;
+	});
+	std::string result;
+	for (auto &row : rows) result += row.second.str() + "\n";
+	return result;
+}
+
+void populate(ecs &world) {
+	for (int i=0; i<ENTITIES; ++i) {
+		entity_t * e = world.create_entity();
+		e->assign(world, position_t{ i, -i });
+		if (i % 3 == 0) e->assign(world, name_t{ "npc " + std::to_string(i) });
+		if (i % 2 == 0) e->assign(world, velocity_t{ static_cast<float>(i), 0.5F });
+		if (i % 100 == 0) e->assign(world, player_t{});
+	}
+	// Recycle an ID, so its generation has to survive the trip
+	world.delete_entity(7);
+	world.ecs_garbage_collect();
+	world.create_entity(7)->assign(world, position_t{ 70, 70 });
+	// And leave some deletions pending at save time
+	world.delete_entity(20);
+	world.delete_component<position_t>(21);
+	world.delete_component<velocity_t>(23);
+}
+
+int check(ecs &loaded, const std::string &expected, const std::size_t next_id, const std::string &name) {
+	int failures = 0;
+	if (describe(loaded) != expected) {
+		std::cout << name << ": the loaded world differs from the saved one\n";
+		++failures;
+	}
+	if (loaded.create_entity()->id != next_id) {
+		std::cout << name << ": new entities don't follow on from the saved IDs\n";
+		++failures;
+	}
+	return failures;
+}
+
+int run(const storage_mode_t save_mode, const storage_mode_t load_mode, const std::string &name) {
+	int failures = 0;
+	ecs world(save_mode);
+	populate(world);
+	const std::size_t next_id = ENTITIES + 1;
+	// Pending deletions are not saved
+	ecs collected(save_mode);
+	populate(collected);
+	collected.ecs_garbage_collect();
+	const std::string expected = describe(collected);
+
+	for (const bool compress : { false, true }) {
+		const std::string variant = name + (compress ? ", compressed" : ", raw");
+		{
+			std::unique_ptr<std::ofstream> out = std::make_unique<std::ofstream>(SAVE_PATH, std::ios::binary);
+			world.ecs_save(out, compress);
+		}
+		ecs loaded(load_mode);
+		std::unique_ptr<std::ifstream> in = std::make_unique<std::ifstream>(SAVE_PATH, std::ios::binary);
+		loaded.ecs_load(in);
+		failures += check(loaded, expected, next_id, variant + ", ecs_load");
+
+		ecs mapped(load_mode);
+		mapped.ecs_load_mapped(SAVE_PATH);
+		failures += check(mapped, expected, next_id, variant + ", ecs_load_mapped");
+	}
+
+	world.ecs_save_async(SAVE_PATH).get();
+	ecs loaded(load_mode);
+	std::unique_ptr<std::ifstream> in = std::make_unique<std::ifstream>(SAVE_PATH, std::ios::binary);
+	loaded.ecs_load(in);
+	failures += check(loaded, expected, next_id, name + ", ecs_save_async");
+	return failures;
+}
+
+int main() {
+	int failures = run(storage_mode_t::SPARSE_SET, storage_mode_t::SPARSE_SET, "sparse set to sparse set");
+	failures += run(storage_mode_t::SPARSE_SET, storage_mode_t::ARCHETYPE, "sparse set to archetype");
+	failures += run(storage_mode_t::ARCHETYPE, storage_mode_t::SPARSE_SET, "archetype to sparse set");
+	std::remove(SAVE_PATH.c_str());
+	if (failures == 0) std::cout << "ecs_snapshots: every round trip matched\n";
+	return failures == 0 ? 0 : 1;
+}